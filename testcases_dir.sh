@@ -41,3 +41,40 @@ echo -e "\033[32m setfattr -n user.has_integrity -v "1" $dir/$filename; \033[00m
 setfattr -n user.has_integrity -v "1" $dir/$filename;
 getfattr -n user.integrity_val $dir/$filename;
 
+
+# the wrapfs mount and its lower directory, as in hw2_mount.sh; run from $mnt
+mnt=/tmp
+lower=/n/scratch
+
+echo -e "\033[32m setfattr -n user.integrity_verify -v "off" $dir; \033[00m"
+setfattr -n user.integrity_verify -v "off" $dir;
+getfattr -n user.integrity_verify $dir;
+
+echo -e "\033[32m a new file and directory inherit integrity_verify \033[00m"
+rm -rf $dir/$filename $dir/sub;
+touch $dir/$filename;
+mkdir $dir/sub;
+touch $dir/sub/$filename;
+getfattr -n user.integrity_verify $dir/$filename;
+getfattr -n user.integrity_verify $dir/sub;
+getfattr -n user.integrity_verify $dir/sub/$filename;
+
+echo -e "\033[32m verify=off inherited: a file changed behind wrapfs is not checked \033[00m"
+echo "hello" > $dir/$filename;
+printf "j" | dd of=$lower/$dir/$filename bs=1 seek=0 conv=notrunc 2>/dev/null;
+cat $dir/$filename && echo "PASS" || echo "FAIL";
+
+echo -e "\033[32m the policy of the file wins over the one of its directory \033[00m"
+setfattr -n user.integrity_verify -v "open" $dir/$filename;
+cat $dir/$filename && echo "FAIL" || echo "PASS";
+
+echo -e "\033[32m verify= mount option: applies to files without a policy of their own \033[00m"
+rm -rf $dir/sub/$filename;
+touch $dir/sub/$filename;
+setfattr -x user.integrity_verify $dir/sub/$filename;
+echo "hello" > $dir/sub/$filename;
+printf "j" | dd of=$lower/$dir/sub/$filename bs=1 seek=0 conv=notrunc 2>/dev/null;
+mount -o remount,verify=off $mnt;
+cat $dir/sub/$filename && echo "PASS" || echo "FAIL";
+mount -o remount,verify=open $mnt;
+cat $dir/sub/$filename && echo "FAIL" || echo "PASS";
@@ -38,3 +38,143 @@ setfattr -n user.has_integrity -v "1" $filename;
 echo -e "\033[32m cat $filename; \033[00m"
 cat $filename;
 
+echo -e "\033[32m merkle(md5): truncate the file, the updated root must match a rebuilt one \033[00m"
+rm -rf $filename;
+touch $filename;
+setfattr -n user.has_integrity -v "1" $filename;
+setfattr -n user.integrity_type -v "merkle(md5)" $filename;
+dd if=/dev/urandom of=$filename bs=4096 count=1000 2>/dev/null;
+truncate -s 2867300 $filename;
+updated=`getfattr -e hex -n user.integrity_val $filename | grep =`;
+setfattr -n user.integrity_type -v "merkle(md5)" $filename;
+rebuilt=`getfattr -e hex -n user.integrity_val $filename | grep =`;
+echo "updated $updated, rebuilt $rebuilt";
+[ "$updated" = "$rebuilt" ] && echo "PASS" || echo "FAIL";
+
+# the wrapfs mount and its lower directory, as in hw2_mount.sh; run from $mnt
+mnt=/tmp
+lower=/n/scratch
+
+# PASS if the integrity_val of a file is the md5 of its contents
+check_md5() {
+	val=`getfattr -e hex -n user.integrity_val $1 2>/dev/null | grep =`;
+	sum=`md5sum < $1 | cut -d' ' -f1`;
+	[ "$val" = "user.integrity_val=0x$sum" ] && echo "PASS" || echo "FAIL: $val, md5 $sum";
+}
+
+# a protected file with the given verify policy, whose lower file is then changed behind wrapfs
+corrupted_file() {
+	rm -rf $1;
+	touch $1;
+	setfattr -n user.has_integrity -v "1" $1;
+	setfattr -n user.integrity_verify -v "$2" $1;
+	echo "hello" > $1;
+	printf "j" | dd of=$lower/$1 bs=1 seek=0 conv=notrunc 2>/dev/null;
+}
+
+echo -e "\033[32m integrity_type: a malformed type, an unknown algo and a type of another build fail \033[00m"
+rm -rf $filename;
+touch $filename;
+setfattr -n user.has_integrity -v "1" $filename;
+setfattr -n user.integrity_type -v "merkle(md5" $filename;
+setfattr -n user.integrity_type -v "nosuchalgo" $filename;
+setfattr -n user.integrity_type -v "sha1" $filename;
+setfattr -n user.integrity_type -v "xxhash64" $filename;
+getfattr -e hex -n user.integrity_val $filename;
+
+echo -e "\033[32m integrity_verify: only valid policies can be set \033[00m"
+setfattr -n user.integrity_verify -v "sometimes" $filename;
+setfattr -n user.integrity_verify -v "periodic=0" $filename;
+setfattr -n user.integrity_verify -v "periodic=5" $filename;
+getfattr -n user.integrity_verify $filename;
+setfattr -x user.integrity_verify $filename;
+getfattr -n user.integrity_verify $filename;
+
+echo -e "\033[32m verify=open: opening a file changed behind wrapfs fails with EPERM \033[00m"
+corrupted_file $filename open;
+cat $filename && echo "FAIL" || echo "PASS";
+
+echo -e "\033[32m verify=off: a file changed behind wrapfs is not checked \033[00m"
+corrupted_file $filename off;
+cat $filename && echo "PASS" || echo "FAIL";
+
+echo -e "\033[32m verify=first-read: open goes ahead, read fails with EPERM \033[00m"
+corrupted_file $filename first-read;
+(exec 3< $filename) && echo "PASS" || echo "FAIL";
+cat $filename && echo "FAIL" || echo "PASS";
+
+echo -e "\033[32m verify=first-read: mmap fails with EPERM \033[00m"
+corrupted_file $filename first-read;
+python -c "import mmap, sys; f = open(sys.argv[1]); mmap.mmap(f.fileno(), 0, prot=mmap.PROT_READ)" $filename \
+	&& echo "FAIL" || echo "PASS";
+
+echo -e "\033[32m verify=first-read: splice (sendfile) fails with EPERM \033[00m"
+corrupted_file $filename first-read;
+python3 -c "import os, sys; i = os.open(sys.argv[1], os.O_RDONLY); o = os.open('/dev/null', os.O_WRONLY); os.sendfile(o, i, 0, 6)" $filename \
+	&& echo "FAIL" || echo "PASS";
+
+echo -e "\033[32m legacy xattrs: a file with has_integrity and integrity_val of its own is read and converted \033[00m"
+legacy=legacy.txt
+rm -rf $legacy;
+# forget the dentry and inode of the old file, the new one is made behind wrapfs
+echo 2 > /proc/sys/vm/drop_caches;
+echo "hello" > $lower/$legacy;
+setfattr -n user.has_integrity -v "1" $lower/$legacy;
+setfattr -n user.integrity_val -v 0x`md5sum < $lower/$legacy | cut -d' ' -f1` $lower/$legacy;
+cat $legacy && echo "PASS" || echo "FAIL";
+echo "world" >> $legacy;
+getfattr -d -m - $lower/$legacy;
+getfattr -n user.integrity $lower/$legacy >/dev/null 2>&1 && echo "PASS" || echo "FAIL";
+getfattr -n user.has_integrity $lower/$legacy >/dev/null 2>&1 && echo "FAIL" || echo "PASS";
+check_md5 $legacy;
+
+echo -e "\033[32m two writers: only the close of the last one rehashes \033[00m"
+rm -rf $filename;
+touch $filename;
+setfattr -n user.has_integrity -v "1" $filename;
+before=`getfattr -e hex -n user.integrity_val $filename | grep =`;
+exec 3>> $filename;
+exec 4>> $filename;
+echo "first" >&3;
+exec 3>&-;
+after=`getfattr -e hex -n user.integrity_val $filename | grep =`;
+[ "$before" = "$after" ] && echo "PASS" || echo "FAIL";
+echo "second" >&4;
+exec 4>&-;
+check_md5 $filename;
+
+echo -e "\033[32m sequential write: the hash of the writes is the md5 of the file \033[00m"
+rm -rf $filename;
+touch $filename;
+setfattr -n user.has_integrity -v "1" $filename;
+dd if=/dev/urandom of=$filename bs=65536 count=64 2>/dev/null;
+check_md5 $filename;
+
+echo -e "\033[32m append to a file of 4MB: the resumed hash matches a full rehash \033[00m"
+echo "appended" >> $filename;
+check_md5 $filename;
+resumed=`getfattr -e hex -n user.integrity_val $filename | grep =`;
+setfattr -n user.integrity_type -v "md5" $filename;
+rehashed=`getfattr -e hex -n user.integrity_val $filename | grep =`;
+[ "$resumed" = "$rehashed" ] && echo "PASS" || echo "FAIL";
+
+echo -e "\033[32m unclean unmount: a file left with its pending marker is rehashed at mount \033[00m"
+rm -rf $filename;
+touch $filename;
+setfattr -n user.has_integrity -v "1" $filename;
+exec 3>> $filename;
+echo "hello" >&3;
+marker=`ls $lower/.wrapfs_integrity/pending`;
+echo "marker: $marker";
+exec 3>&-;
+ls $lower/.wrapfs_integrity/pending;
+cd /;
+umount $mnt;
+# what a crash while the file was written leaves: new contents, old integrity_val and the marker
+echo "world" >> $lower/$filename;
+touch $lower/.wrapfs_integrity/pending/$marker;
+mount -t wrapfs $lower $mnt -o user_xattr,pending=wait;
+cd $mnt;
+cat $filename && echo "PASS" || echo "FAIL";
+check_md5 $filename;
+ls $lower/.wrapfs_integrity/pending;
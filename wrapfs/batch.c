@@ -0,0 +1,249 @@
+/*
+ * This file contains the batched rehash of small files.
+ *
+ * Untar, rsync and package installs close thousands of small protected
+ * files in a burst. With rehash=deferred each of them used to get a work
+ * item of its own, which opened the file, waited for its pages and hashed
+ * them before the next one started. A file of at most WRAPFS_BATCH_MAX_SIZE
+ * bytes is put on the batch list of the mount instead, and one work item
+ * takes up to WRAPFS_BATCH_NR of them at a time:
+ *
+ *	- the reads of all the files of the batch are started first, so the
+ *	  device sees them together instead of one file per round trip
+ *	- every file is hashed in a single digest request on a context of its
+ *	  own, the requests are submitted one after the other without waiting,
+ *	  so an async hash engine has the whole batch queued at once and works
+ *	  on the files while the pages of the next ones are collected
+ *	- the records are stored once the digests are in
+ *
+ * Only files of a plain crypto integrity_type go through the batch, the
+ * others (and any file that changed its mind about being small) are
+ * rehashed the usual way by update_integrity_val, from the same worker.
+ * The contexts of a batch are taken with wrapfs_try_get_hash while it holds
+ * others, when none is free the batch waits for the ones it has submitted
+ * before it waits for a context.
+ */
+
+#include "wrapfs.h"
+
+struct batch_item {
+	struct inode *inode;
+	struct path lower_path;		/* NULL if another worker took the rehash */
+	struct list_head dirty;
+	unsigned int dirty_all;
+	struct wrapfs_integrity rec;
+	struct wrapfs_hash_pool *pool;
+	struct file *filp;		/* set if the file is hashed in the batch */
+	struct wrapfs_hash_ctx *ctx;	/* while its request is submitted */
+	loff_t size;
+	int result;			/* of the request */
+};
+
+/* Method to tell whether a released file is small enough to be rehashed in a batch */
+int wrapfs_batch_fits(struct path *lower_path) {
+	struct inode *lower_inode = lower_path->dentry->d_inode;
+
+	return S_ISREG(lower_inode->i_mode) && i_size_read(lower_inode) <= WRAPFS_BATCH_MAX_SIZE;
+}
+
+/* Method to queue the rehash of a small file in the batch of its mount
+ * Input: wrapfs inode, its rehash_path is set already
+ * Output: none, the inode is held until the batch is done with it
+ */
+void wrapfs_batch_add(struct inode *inode) {
+	struct wrapfs_sb_info *sbi = WRAPFS_SB(inode->i_sb);
+	struct wrapfs_inode_info *info = WRAPFS_I(inode);
+
+	spin_lock(&sbi->batch_lock);
+	if(list_empty(&info->batch_list)) {
+		ihold(inode);
+		list_add_tail(&info->batch_list, &sbi->batch_list);
+	}
+	spin_unlock(&sbi->batch_lock);
+	queue_work(sbi->rehash_wq, &sbi->batch_work);
+}
+
+/* rehash a file the way the rehash work of its inode does */
+static void batch_update(struct batch_item *item) {
+	long retval;
+
+	retval = update_integrity_val(item->inode, item->lower_path, &item->dirty, item->dirty_all);
+	if(retval<0) {
+		printk("wrapfs_batch_work: cannot set %s!!\n", ATTR_INTEGRITY_VAL);
+		wrapfs_mark_dirty_all(item->inode);
+	}
+}
+
+/* Method to get a file of a batch ready to be hashed
+ * Input: item with its inode set
+ * Output: none, item->filp is set if the file is hashed with the batch
+ * Following are the steps:
+ * 1. take the lower path and the written ranges as the rehash work does
+ * 2. a small file of a plain crypto integrity_type is opened and its reads are started
+ * 3. any other file with has_integrity=1 is rehashed now
+ */
+static void batch_prepare(struct batch_item *item) {
+	struct inode *inode = item->inode;
+	char algo[MAXLEN_ALGO_NAME + 1];
+	struct file *filp;
+
+	INIT_LIST_HEAD(&item->dirty);
+	item->filp = NULL;
+	item->ctx = NULL;
+	if(!wrapfs_rehash_take(inode, &item->lower_path))
+		return;
+
+	wrapfs_take_dirty(inode, &item->dirty, &item->dirty_all);
+	if((list_empty(&item->dirty) && !item->dirty_all) || has_integrity(inode, item->lower_path) != 1)
+		return;
+
+	item->size = i_size_read(item->lower_path.dentry->d_inode);
+	if(item->size <= 0 || item->size > WRAPFS_BATCH_MAX_SIZE)
+		goto rehash;
+	if(get_integrity_record(inode, item->lower_path, &item->rec))
+		goto rehash;
+	if(parse_integrity_type(integrity_record_type(&item->rec), algo, sizeof(algo)) != INTEGRITY_FAMILY_FLAT)
+		goto rehash;
+	item->pool = wrapfs_hash_pool(inode->i_sb, algo);
+	if(IS_ERR(item->pool) || item->pool->digest_size > MAXLEN)
+		goto rehash;
+
+	/* dentry_open consumes the references, so take our own */
+	path_get(&item->lower_path);
+	filp = dentry_open(item->lower_path.dentry, item->lower_path.mnt, O_RDONLY | O_LARGEFILE, current_cred());
+	if(IS_ERR(filp))
+		goto rehash;
+	wrapfs_hash_prefetch_file(filp, item->size);
+	item->filp = filp;
+	return;
+
+rehash:
+	batch_update(item);
+}
+
+/* wait for the requests submitted for items [from, to) and give their contexts back */
+static void batch_wait(struct batch_item *items, unsigned int from, unsigned int to) {
+	unsigned int i;
+
+	for(i = from; i < to; i++) {
+		if(!items[i].ctx)
+			continue;
+		items[i].result = wrapfs_hash_finish(items[i].ctx, items[i].result);
+		wrapfs_put_hash(items[i].ctx);
+		items[i].ctx = NULL;
+	}
+}
+
+/* Method to hash the files of a batch, each with a request of its own
+ * Input: items of the batch, number of items
+ * Output: none, the digest of every hashed file is in its record, item->result tells
+ * Following are the steps:
+ * 1. take a context for the next file, without waiting while earlier requests are out
+ * 2. if none is free, wait for the requests submitted so far, then wait for a context
+ * 3. submit the digest of the file and go on with the next one
+ */
+static void batch_hash(struct batch_item *items, unsigned int nr) {
+	struct wrapfs_hash_ctx *ctx;
+	unsigned int i, first = 0;
+
+	for(i = 0; i < nr; i++) {
+		if(!items[i].filp)
+			continue;
+		ctx = NULL;
+		if(first < i)
+			ctx = wrapfs_try_get_hash(items[i].pool);
+		if(!ctx) {
+			batch_wait(items, first, i);
+			first = i;
+			ctx = wrapfs_get_hash(items[i].pool);
+		}
+		items[i].ctx = ctx;
+		items[i].result = wrapfs_hash_start(ctx, items[i].filp, items[i].size, items[i].rec.ival);
+	}
+	batch_wait(items, first, nr);
+}
+
+/* store the digest of a hashed file and end its rehash */
+static void batch_finish(struct batch_item *item) {
+	long retval;
+
+	if(item->filp) {
+		fput(item->filp);
+		retval = item->result;
+		if(!retval) {
+			item->rec.ilen = item->pool->digest_size;
+			retval = put_integrity_record(item->inode, item->lower_path, &item->rec);
+		}
+		if(retval<0) {
+			printk("wrapfs_batch_work: cannot set %s, err=%ld\n", ATTR_INTEGRITY_VAL, retval);
+			wrapfs_mark_dirty_all(item->inode);
+		}
+	}
+	wrapfs_free_dirty(&item->dirty);
+	if(item->lower_path.dentry)
+		wrapfs_rehash_done(item->inode, &item->lower_path);
+	iput(item->inode);
+}
+
+/* take up to nr inodes off the batch list of a mount */
+static unsigned int batch_take(struct wrapfs_sb_info *sbi, struct batch_item *items, unsigned int nr) {
+	struct wrapfs_inode_info *info;
+	unsigned int n = 0;
+
+	spin_lock(&sbi->batch_lock);
+	while(n < nr && !list_empty(&sbi->batch_list)) {
+		info = list_first_entry(&sbi->batch_list, struct wrapfs_inode_info, batch_list);
+		list_del_init(&info->batch_list);
+		items[n++].inode = &info->vfs_inode;
+	}
+	spin_unlock(&sbi->batch_lock);
+	return n;
+}
+
+/* Method run on the rehash workqueue to rehash the small files queued on a mount
+ * Input: batch_work of a wrapfs super block
+ * Output: none, on failure a file stays dirty so that the next release tries again
+ * Following are the steps:
+ * 1. take up to WRAPFS_BATCH_NR inodes off the list
+ * 2. open the files and start all their reads
+ * 3. hash them with a request per file, see batch_hash
+ * 4. store the records, drop the inodes and go on while the list isn't empty
+ */
+static void wrapfs_batch_work(struct work_struct *work) {
+	struct wrapfs_sb_info *sbi = container_of(work, struct wrapfs_sb_info, batch_work);
+	struct batch_item one, *items;
+	unsigned int i, nr, max = WRAPFS_BATCH_NR;
+
+	items = kmalloc(sizeof(*items) * WRAPFS_BATCH_NR, GFP_KERNEL);
+	if(!items) {
+		/* one file at a time still gets the work done */
+		items = &one;
+		max = 1;
+	}
+
+	while((nr = batch_take(sbi, items, max))) {
+		for(i = 0; i < nr; i++)
+			batch_prepare(&items[i]);
+		batch_hash(items, nr);
+		for(i = 0; i < nr; i++)
+			batch_finish(&items[i]);
+	}
+
+	if(items != &one)
+		kfree(items);
+}
+
+/* Method to set up the batch list of a super block, called at mount */
+void wrapfs_init_batch(struct super_block *sb) {
+	struct wrapfs_sb_info *sbi = WRAPFS_SB(sb);
+
+	spin_lock_init(&sbi->batch_lock);
+	INIT_LIST_HEAD(&sbi->batch_list);
+	INIT_WORK(&sbi->batch_work, wrapfs_batch_work);
+}
+
+/* Method to wait until the rehashes queued in batches are done, open with pending=wait and
+ * unmount need them */
+void wrapfs_flush_batch(struct super_block *sb) {
+	flush_work_sync(&WRAPFS_SB(sb)->batch_work);
+}
@@ -0,0 +1,200 @@
+/*
+ * This file contains the choice of the crypto driver of each integrity algo.
+ *
+ * crypto_alloc_ahash by algo name takes the driver the crypto API ranks
+ * highest, and the priorities are set by the driver authors, not measured
+ * on the machine: a hardware engine with a slow round trip or a SIMD
+ * driver tuned for another CPU can win over a faster one. Like the raid6
+ * and xor code do for their routines, the drivers of the algos wrapfs knows
+ * are measured once when the module is loaded: every driver of an algo that
+ * the crypto API has hashes WRAPFS_HASH_BATCH pages in one request, the way
+ * the file data is fed to it, for WRAPFS_BENCH_JIFFIES, and the pools of
+ * every mount (see hash.c) use the fastest one. The candidates are the
+ * driver names in bench_candidates, plus whatever the crypto API picks for
+ * the algo name, so an engine wrapfs doesn't know about is measured too.
+ * The choice and the measured MB/s are logged. Only a name is kept: the
+ * pool takes its own reference on the driver when it allocates from it and
+ * falls back to the algo name if the driver went away meanwhile.
+ */
+
+#include "wrapfs.h"
+
+/* the known drivers of the algos that are measured, the generic one first */
+static const struct {
+	const char *algo;
+	const char *drivers[WRAPFS_BENCH_MAX_DRIVERS];
+} bench_candidates[] = {
+	{ ATTR_DEFAULTALGO,	{ "md5-generic" } },
+	{ "sha1",		{ "sha1-generic", "sha1-ssse3" } },
+	{ "sha256",		{ "sha256-generic", "sha256-ssse3" } },
+	{ "sha512",		{ "sha512-generic", "sha512-ssse3" } },
+	{ "crc32c",		{ "crc32c-generic", "crc32c-intel" } },
+	{ "xxhash64",		{ "xxhash64-wrapfs" } },
+};
+
+/* fastest driver of each algo of bench_candidates, empty if none could be measured;
+ * written once at module load and only read afterwards */
+static char bench_choice[ARRAY_SIZE(bench_candidates)][CRYPTO_MAX_ALG_NAME];
+
+struct bench_wait {
+	struct completion done;
+	int err;
+};
+
+/* completion callback of an async benchmark request */
+static void bench_done(struct crypto_async_request *req, int err) {
+	struct bench_wait *wait = req->data;
+
+	if(err == -EINPROGRESS)
+		return;
+	wait->err = err;
+	complete(&wait->done);
+}
+
+/* Method to measure how fast a crypto driver hashes
+ * Input: driver or algo name, page of data to hash, buffer for the name of the driver measured
+ * Output: returns the MB/s it hashed at, 0 if it can't be used
+ * Following are the steps:
+ * 1. allocate a transform by the name and note which driver it is
+ * 2. wait for the start of a jiffy
+ * 3. hash WRAPFS_HASH_BATCH times the page in one request until WRAPFS_BENCH_JIFFIES are up,
+ 	giving the CPU away between two requests
+ */
+static unsigned long bench_driver(const char *name, struct page *page, char *driver) {
+	struct scatterlist sg[WRAPFS_HASH_BATCH];
+	unsigned char out[MAXLEN];
+	struct crypto_ahash *tfm;
+	struct ahash_request *req;
+	struct bench_wait wait;
+	unsigned long start, mbps = 0;
+	u64 bytes = 0;
+	unsigned int i;
+	int retval;
+
+	tfm = crypto_alloc_ahash(name, 0, 0);
+	if(IS_ERR(tfm))
+		return 0;
+	strlcpy(driver, crypto_tfm_alg_driver_name(crypto_ahash_tfm(tfm)), CRYPTO_MAX_ALG_NAME);
+	/* an integrity_val can't hold a longer digest, the pool won't use the driver */
+	if(crypto_ahash_digestsize(tfm) > sizeof(out))
+		goto free_tfm;
+	req = ahash_request_alloc(tfm, GFP_KERNEL);
+	if(!req)
+		goto free_tfm;
+	init_completion(&wait.done);
+	ahash_request_set_callback(req, CRYPTO_TFM_REQ_MAY_BACKLOG | CRYPTO_TFM_REQ_MAY_SLEEP,
+		bench_done, &wait);
+
+	sg_init_table(sg, WRAPFS_HASH_BATCH);
+	for(i = 0; i < WRAPFS_HASH_BATCH; i++)
+		sg_set_page(&sg[i], page, PAGE_SIZE, 0);
+	ahash_request_set_crypt(req, sg, out, WRAPFS_HASH_BATCH * PAGE_SIZE);
+
+	start = jiffies;
+	while(jiffies == start)
+		cpu_relax();
+	start = jiffies;
+	while(time_before(jiffies, start + WRAPFS_BENCH_JIFFIES)) {
+		retval = crypto_ahash_digest(req);
+		if(retval == -EINPROGRESS || retval == -EBUSY) {
+			wait_for_completion(&wait.done);
+			INIT_COMPLETION(wait.done);
+			retval = wait.err;
+		}
+		if(retval)
+			goto free_req;
+		bytes += WRAPFS_HASH_BATCH * PAGE_SIZE;
+		cond_resched();
+	}
+	mbps = div_u64(bytes * HZ, WRAPFS_BENCH_JIFFIES) >> 20;
+	/* a driver too slow to show up in MB/s still beats one that doesn't work */
+	if(!mbps)
+		mbps = 1;
+
+free_req:
+	ahash_request_free(req);
+free_tfm:
+	crypto_free_ahash(tfm);
+	return mbps;
+}
+
+/* Method to pick the fastest driver of an algo of bench_candidates
+ * Input: index of the algo in bench_candidates, page of data to hash
+ * Output: none, bench_choice of the algo is set if a driver could be measured
+ * Following are the steps:
+ * 1. measure every known driver of the algo the crypto API has, loading its module if needed
+ * 2. measure the driver the crypto API picks for the algo name if it isn't one of them
+ * 3. log the MB/s of each one and remember the fastest
+ */
+static void bench_algo(unsigned int n, struct page *page) {
+	const char *algo = bench_candidates[n].algo;
+	char measured[WRAPFS_BENCH_MAX_DRIVERS + 1][CRYPTO_MAX_ALG_NAME];
+	const char *name;
+	unsigned long mbps, best = 0;
+	unsigned int i, j, nr = 0;
+
+	for(i = 0; i <= WRAPFS_BENCH_MAX_DRIVERS; i++) {
+		/* the last round is the choice of the crypto API */
+		name = i < WRAPFS_BENCH_MAX_DRIVERS ? bench_candidates[n].drivers[i] : algo;
+		if(!name)
+			continue;
+		if(name != algo && !crypto_has_alg(name, 0, 0))
+			continue;
+
+		mbps = bench_driver(name, page, measured[nr]);
+		for(j = 0; j < nr; j++)
+			if(!strcmp(measured[j], measured[nr]))
+				break;
+		if(j < nr || !mbps)
+			continue;
+
+		printk(KERN_INFO "wrapfs: %-24s %s %lu MB/s\n", measured[nr], algo, mbps);
+		if(mbps > best) {
+			best = mbps;
+			strcpy(bench_choice[n], measured[nr]);
+		}
+		nr++;
+	}
+
+	if(best)
+		printk(KERN_INFO "wrapfs: using %s for %s (%lu MB/s)\n", bench_choice[n], algo, best);
+}
+
+/* Method to measure the drivers of every algo of bench_candidates, called at module load
+ * Output: none, an algo without a choice is left to the crypto API
+ */
+void wrapfs_bench_init(void) {
+	struct page *page;
+	unsigned int n;
+
+	page = alloc_page(GFP_KERNEL);
+	if(!page) {
+		printk(KERN_WARNING "wrapfs_bench_init: out of memory, the crypto API picks the drivers\n");
+		return;
+	}
+	get_random_bytes(page_address(page), PAGE_SIZE);
+
+	for(n = 0; n < ARRAY_SIZE(bench_candidates); n++)
+		bench_algo(n, page);
+
+	__free_page(page);
+}
+
+/* Method to get the crypto driver picked for an algo at module load
+ * Input: algo, buffer for the driver name, its size
+ * Output: return 0 if a driver was picked; else return -ENOENT, the caller goes with the
+ 	algo name and the choice of the crypto API then
+ */
+int wrapfs_bench_pick(const char *algo, char *driver, size_t len) {
+	unsigned int n;
+
+	for(n = 0; n < ARRAY_SIZE(bench_candidates); n++) {
+		if(strcmp(bench_candidates[n].algo, algo))
+			continue;
+		if(!bench_choice[n][0])
+			break;
+		strlcpy(driver, bench_choice[n], len);
+		return 0;
+	}
+	return -ENOENT;
+}
@@ -29,6 +29,11 @@ static int wrapfs_d_revalidate(struct dentry *dentry, struct nameidata *nd)
 	lower_dentry = lower_path.dentry;
 	if (!lower_dentry->d_op || !lower_dentry->d_op->d_revalidate)
 		goto out;
+	/* lookup_one_len (the scrubber) has no nameidata */
+	if (!nd) {
+		err = lower_dentry->d_op->d_revalidate(lower_dentry, NULL);
+		goto out;
+	}
 	pathcpy(&saved_path, &nd->path);
 	pathcpy(&nd->path, &lower_path);
 	err = lower_dentry->d_op->d_revalidate(lower_dentry, nd);
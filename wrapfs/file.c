@@ -19,6 +19,21 @@ static ssize_t wrapfs_read(struct file *file, char __user *buf,
 	struct dentry *dentry = file->f_path.dentry;
 
 	lower_file = wrapfs_lower_file(file);
+
+	/* verify=first-read checks the file here, a failed background check stops the read */
+	err = wrapfs_verify_read(dentry->d_inode, lower_file);
+	if (err < 0)
+		return err;
+
+	/* blocks of a merkle protected file are checked on their first read */
+	if (WRAPFS_I(dentry->d_inode)->merkle) {
+		err = merkle_verify_range(dentry->d_inode, lower_file, *ppos, count);
+		if (err < 0) {
+			printk("wrapfs_read: Integrity check failed!!\n");
+			return err;
+		}
+	}
+
 	err = vfs_read(lower_file, buf, count, ppos);
 	/* update our inode atime upon a successful lower read */
 	if (err >= 0)
@@ -28,6 +43,45 @@ static ssize_t wrapfs_read(struct file *file, char __user *buf,
 	return err;
 }
 
+/*
+ * splice and sendfile take the pages of the lower page cache straight from
+ * the lower ->splice_read, so they get the same checks as read first.
+ */
+static ssize_t wrapfs_splice_read(struct file *file, loff_t *ppos,
+				  struct pipe_inode_info *pipe, size_t len,
+				  unsigned int flags)
+{
+	ssize_t err;
+	struct file *lower_file;
+	struct dentry *dentry = file->f_path.dentry;
+
+	lower_file = wrapfs_lower_file(file);
+	if (!lower_file->f_op || !lower_file->f_op->splice_read)
+		return -EINVAL;
+
+	/* verify=first-read checks the file here, a failed background check stops the splice */
+	err = wrapfs_verify_read(dentry->d_inode, lower_file);
+	if (err < 0)
+		return err;
+
+	/* blocks of a merkle protected file are checked on their first read */
+	if (WRAPFS_I(dentry->d_inode)->merkle) {
+		err = merkle_verify_range(dentry->d_inode, lower_file, *ppos, len);
+		if (err < 0) {
+			printk("wrapfs_splice_read: Integrity check failed!!\n");
+			return err;
+		}
+	}
+
+	err = lower_file->f_op->splice_read(lower_file, ppos, pipe, len, flags);
+	/* update our inode atime upon a successful lower splice */
+	if (err >= 0)
+		fsstack_copy_attr_atime(dentry->d_inode,
+					lower_file->f_path.dentry->d_inode);
+
+	return err;
+}
+
 static ssize_t wrapfs_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
 {
 	int err = 0;
@@ -36,15 +90,26 @@ static ssize_t wrapfs_write(struct file *file, const char __user *buf, size_t co
 
 	
 	lower_file = wrapfs_lower_file(file);
+	/* a crash from here on leaves a marker, the file is rehashed at the next mount */
+	if (S_ISREG(dentry->d_inode->i_mode))
+		wrapfs_mark_pending(dentry->d_inode, &lower_file->f_path);
 	err = vfs_write(lower_file, buf, count, ppos);
 	/* update our inode times+sizes upon a successful lower write */
 	if (err >= 0) {
 		fsstack_copy_inode_size(dentry->d_inode, lower_file->f_path.dentry->d_inode);
 		fsstack_copy_attr_times(dentry->d_inode, lower_file->f_path.dentry->d_inode);
 		
-		/* if it is a regular file then set the dirty bit on successful write */
-		if(!S_ISDIR(lower_file->f_path.dentry->d_inode->i_mode))
-			wrapfs_set_dirty_flag(file->f_path.dentry->d_inode, 1);
+		/* if it is a regular file then remember the written range on successful write,
+		 * *ppos is past the data even for O_APPEND */
+		if(!S_ISDIR(lower_file->f_path.dentry->d_inode->i_mode)) {
+			wrapfs_mark_dirty(dentry->d_inode, *ppos - err, *ppos);
+			/* a file written in one pass from offset 0 is hashed as it goes */
+			if (err > 0)
+				wrapfs_stream_write(file, lower_file, *ppos - err, err);
+			/* the hash tree checked at open no longer describes the file */
+			if(WRAPFS_I(dentry->d_inode)->merkle)
+				merkle_release(dentry->d_inode);
+		}
 	}
 
 	return err;
@@ -56,6 +121,7 @@ static int wrapfs_open(struct inode *inode, struct file *file)
 	int err = 0;
 	struct file *lower_file = NULL;
 	struct path lower_path;
+	struct wrapfs_integrity rec;
 
 	/* don't open unhashed/deleted files */
 	if (d_unhashed(file->f_path.dentry)) {
@@ -71,11 +137,25 @@ static int wrapfs_open(struct inode *inode, struct file *file)
 
 	/* open lower object and link wrapfs's file struct to lower's */
 	wrapfs_get_lower_path(file->f_path.dentry, &lower_path);
+	lower_file = dentry_open(lower_path.dentry, lower_path.mnt, file->f_flags, current_cred());
+	if (IS_ERR(lower_file)) {
+		err = PTR_ERR(lower_file);
+		lower_file = wrapfs_lower_file(file);
+		if (lower_file) {
+			wrapfs_set_lower_file(file, NULL);
+			fput(lower_file); /* fput calls dput for lower_dentry */
+		}
+		goto out_free;
+	}
+	wrapfs_set_lower_file(file, lower_file);
 
 	/* if inode is a directory then skip the step of computing/removing integrity_val */
 	if(!S_ISDIR(lower_path.dentry->d_inode->i_mode)) {
-		/* check for integrity and open if only matches */
-		err = has_integrity(lower_path);
+		/* check for integrity and open if only matches, the record is cached in
+		 * the inode, so an unprotected file is opened without any xattr I/O */
+		err = get_integrity_record(inode, lower_file->f_path, &rec);
+		if(!err)
+			err = integrity_record_flag(&rec);
 		if(err == 1) {
 			if(wrapfs_get_dirty_flag(file->f_path.dentry->d_inode) == 1) {
 				// retval = set_integrity_val(lower_path);
@@ -85,33 +165,36 @@ static int wrapfs_open(struct inode *inode, struct file *file)
 				// }
 				// wrapfs_set_dirty_flag(file->f_path.dentry->d_inode, 0);
 			}
+			else if(wrapfs_pending_rehash(inode)) {
+				/* pending=open: integrity_val is still being recomputed on the
+				 * rehash workqueue, open the file as if it were still dirty */
+			}
 			else {
-				err = check_integrity(lower_path);
+				/* the verify policy of the file or the mount says whether the
+				 * check is done now, on the first read or in the background;
+				 * a check done now is hashed through the lower file we just
+				 * opened if it is readable */
+				err = wrapfs_verify_open(inode, lower_file, &rec);
 				if(err<0) {
 					printk("wrapfs_open: Integrity check failed!!\n");
-					goto out_err;
+					wrapfs_set_lower_file(file, NULL);
+					fput(lower_file);
+					goto out_free;
 				}
 			}
 		}
 		err = 0;
 	}
 
-	lower_file = dentry_open(lower_path.dentry, lower_path.mnt, file->f_flags, current_cred());
-	if (IS_ERR(lower_file)) {
-		err = PTR_ERR(lower_file);
-		lower_file = wrapfs_lower_file(file);
-		if (lower_file) {
-			wrapfs_set_lower_file(file, NULL);
-			fput(lower_file); /* fput calls dput for lower_dentry */
-		}
-	} else {
-		wrapfs_set_lower_file(file, lower_file);
-	}
-
-	if (err)
+out_free:
+	if (err) {
 		kfree(WRAPFS_F(file));
-	else
+	} else {
+		/* count the writer, only the last one to close rehashes */
+		if (file->f_mode & FMODE_WRITE)
+			atomic_inc(&WRAPFS_I(inode)->writers);
 		fsstack_copy_attr_all(inode, wrapfs_lower_inode(inode));
+	}
 
 // out_put_lower_path:
 // 	wrapfs_put_lower_path(file->f_path.dentry, &lower_path);
@@ -124,44 +207,88 @@ static int wrapfs_file_release(struct inode *inode, struct file *file)
 {
 	struct file *lower_file;
 	int retval = 0;
+	int last;
 
 	// printk("wrapfs_file_release called!!\n");
 	lower_file = wrapfs_lower_file(file);
 	if (lower_file) {
+		last = (file->f_mode & FMODE_WRITE) && atomic_dec_and_test(&WRAPFS_I(inode)->writers);
 
-		/* check for dirty_flag, has_integrity and set integrity_val */
-		if((file->f_mode & FMODE_WRITE) && wrapfs_get_dirty_flag(file->f_path.dentry->d_inode)) {
-			retval = has_integrity(lower_file->f_path);
+		/* a file written in one pass was hashed as it was written, only the
+		 * digest is left to store */
+		if (wrapfs_stream_release(inode, file, &lower_file->f_path, last) == 1) {
+			wrapfs_clear_pending(inode, &lower_file->f_path, 1);
+		}
+		/* check for dirty ranges, has_integrity and update integrity_val; while
+		 * other writers still have the file open their ranges keep piling up
+		 * and the last of them rehashes once for everybody */
+		else if(last && wrapfs_get_dirty_flag(inode) &&
+			!wrapfs_defer_rehash(inode, &lower_file->f_path)) {
+			LIST_HEAD(dirty);
+			unsigned int dirty_all;
+
+			wrapfs_take_dirty(inode, &dirty, &dirty_all);
+			retval = has_integrity(inode, lower_file->f_path);
 			if(retval == 1) {
-				retval = set_integrity_val(lower_file->f_path);
+				/* only the written ranges get rehashed where the integrity_type allows it */
+				retval = update_integrity_val(inode, lower_file->f_path, &dirty, dirty_all);
 				if(retval<0) {
 					printk("file.c: wrapfs_file_release: cannot set %s!!\n", ATTR_INTEGRITY_VAL);
-					goto out;
+					/* keep the file dirty so that the next release tries again */
+					wrapfs_mark_dirty_all(inode);
 				}
-				wrapfs_set_dirty_flag(file->f_path.dentry->d_inode, 0);
+			}
+			else
 				retval = 0;
+			wrapfs_free_dirty(&dirty);
+			/* integrity_val is up to date, the marker goes unless others write */
+			if(retval >= 0) {
+				retval = 0;
+				wrapfs_clear_pending(inode, &lower_file->f_path, 1);
 			}
-			retval = 0;
 		}
 
+		/* the lower file is let go whether the update worked or not */
 		wrapfs_set_lower_file(file, NULL);
 		fput(lower_file);
 	}
 
-out:
 	kfree(WRAPFS_F(file));
 	return retval;
 }
 
 
+/* readdir callback that hides the sidecar store in the root directory */
+struct wrapfs_getdents_callback {
+	void *dirent;
+	filldir_t filldir;
+	int is_root;
+};
+
+static int wrapfs_filldir(void *buf, const char *name, int namelen,
+			  loff_t offset, u64 ino, unsigned int d_type)
+{
+	struct wrapfs_getdents_callback *cb = buf;
+
+	if (cb->is_root && namelen == strlen(WRAPFS_SIDECAR_DIR) &&
+	    !strncmp(name, WRAPFS_SIDECAR_DIR, namelen))
+		return 0;
+	return cb->filldir(cb->dirent, name, namelen, offset, ino, d_type);
+}
+
 static int wrapfs_readdir(struct file *file, void *dirent, filldir_t filldir)
 {
 	int err = 0;
 	struct file *lower_file = NULL;
 	struct dentry *dentry = file->f_path.dentry;
+	struct wrapfs_getdents_callback cb = {
+		.dirent = dirent,
+		.filldir = filldir,
+		.is_root = IS_ROOT(dentry),
+	};
 
 	lower_file = wrapfs_lower_file(file);
-	err = vfs_readdir(lower_file, filldir, dirent);
+	err = vfs_readdir(lower_file, wrapfs_filldir, &cb);
 	file->f_pos = lower_file->f_pos;
 	if (err >= 0)		/* copy the atime */
 		fsstack_copy_attr_atime(dentry->d_inode, lower_file->f_path.dentry->d_inode);
@@ -234,6 +361,27 @@ static int wrapfs_mmap(struct file *file, struct vm_area_struct *vma)
 		goto out;
 	}
 
+	/*
+	 * verify=first-read checks the file before it is mapped, so that a
+	 * mismatch is an EPERM from mmap rather than a SIGBUS on the first
+	 * fault (the fault checks too, for a background check that fails later)
+	 */
+	err = wrapfs_verify_read(file->f_path.dentry->d_inode, lower_file);
+	if (err < 0)
+		goto out;
+
+	/*
+	 * writes through the mapping bypass the hash tree checked at open and
+	 * can't be tracked by range, rehash the whole file on release
+	 */
+	if (willwrite) {
+		wrapfs_mark_pending(file->f_path.dentry->d_inode,
+				    &lower_file->f_path);
+		wrapfs_mark_dirty_all(file->f_path.dentry->d_inode);
+		if (WRAPFS_I(file->f_path.dentry->d_inode)->merkle)
+			merkle_release(file->f_path.dentry->d_inode);
+	}
+
 	/*
 	 * find and save lower vm_ops.
 	 *
@@ -320,6 +468,7 @@ const struct file_operations wrapfs_main_fops = {
 	.llseek		= generic_file_llseek,
 	.read		= wrapfs_read,
 	.write		= wrapfs_write,
+	.splice_read	= wrapfs_splice_read,
 	.unlocked_ioctl	= wrapfs_unlocked_ioctl,
 #ifdef CONFIG_COMPAT
 	.compat_ioctl	= wrapfs_compat_ioctl,
@@ -0,0 +1,620 @@
+/*
+ * This file contains the per-mount registry of crypto hash contexts.
+ *
+ * Allocating a crypto transform costs about as much as hashing a small
+ * file, so every mount keeps a pool of ready contexts for each integrity
+ * algo it has seen, each made of a transform and a CHUNKSIZE scratch
+ * buffer. The pool of ATTR_DEFAULTALGO is set up at mount, the others on
+ * first use, and all of them live until unmount.
+ *
+ * The contexts use the asynchronous hash (ahash) interface, so an algo may
+ * be served by a hardware engine, and they are made of the driver of the
+ * algo that hashed fastest on this machine (see bench.c); the request of a context keeps the state
+ * of the running hash, so a context belongs to one caller at a time. A pool
+ * has one context per possible CPU; since hashing a file sleeps on the
+ * reads, the contexts are handed out from a free list rather than pinned to
+ * a CPU. wrapfs_get_hash waits for a free context when all of them are busy.
+ *
+ * A caller must never wait for a context while it holds one: the rehash
+ * batches (see batch.c) that hold several take the next ones with
+ * wrapfs_try_get_hash, which doesn't wait. Nor may a caller take a sleeping
+ * lock while it holds a context if another path waits for a context while
+ * holding that lock: merkle_verify_range gets its context under
+ * merkle_mutex, so merkle_build drops the in-memory tree before it gets one.
+ *
+ * The second half of the file feeds file data to a hash. Instead of copying
+ * every chunk into a buffer with ->read, it walks the address_space of the
+ * lower inode and hands the page cache pages to the crypto layer through a
+ * scatterlist, with readahead windows of WRAPFS_HASH_RA_PAGES. It is a two
+ * stage pipeline: while one batch of pages is being hashed, the pages of the
+ * next batch are collected and the reads of the following WRAPFS_HASH_DEPTH
+ * batches are kept in flight, so the device and the CPU work at the same
+ * time and hashing a large file takes about max(I/O, hash) instead of the sum.
+ *
+ * Holes are not read. For a lower file with fewer blocks than its size says,
+ * the extents of the file are asked from the lower file system with fiemap,
+ * and a page that is neither cached nor backed by written blocks is handed to
+ * the crypto layer as the zero page, which is what a read of it would give.
+ * The digest doesn't change, only the I/O and the page cache pages go away.
+ * The block hash tree and the tree hash go further and take the digest of a
+ * block or chunk that is all hole without hashing it (see wrapfs_hash_hole).
+ */
+
+#include "wrapfs.h"
+
+/* Method to set up the hash pools of a super block, called at mount
+ * Input: wrapfs super block
+ * Output: none, the default pool is created on first use if it can't be created now
+ * The hash workqueue of the mount is created here as well.
+ */
+void wrapfs_init_hash_pools(struct super_block *sb) {
+	struct wrapfs_sb_info *sbi = WRAPFS_SB(sb);
+	struct wrapfs_hash_pool *pool;
+
+	spin_lock_init(&sbi->hash_lock);
+	mutex_init(&sbi->hash_mutex);
+	INIT_LIST_HEAD(&sbi->hash_pools);
+
+	pool = wrapfs_hash_pool(sb, ATTR_DEFAULTALGO);
+	if(IS_ERR(pool))
+		printk("wrapfs_init_hash_pools: cannot preallocate %s contexts\n", ATTR_DEFAULTALGO);
+
+	/* without it a tree hash runs in the caller alone */
+	sbi->hash_wq = alloc_workqueue("wrapfs_hash", WQ_UNBOUND, 0);
+	if(!sbi->hash_wq)
+		printk("wrapfs_init_hash_pools: cannot create the hash workqueue\n");
+}
+
+/* completion callback of the requests of a context */
+static void wrapfs_hash_done(struct crypto_async_request *req, int err) {
+	struct wrapfs_hash_ctx *ctx = req->data;
+
+	/* a backlogged request was queued, the real completion follows */
+	if(err == -EINPROGRESS)
+		return;
+	ctx->err = err;
+	complete(&ctx->done);
+}
+
+/* wait for a request of a context that may have gone asynchronous */
+static int wrapfs_hash_wait(struct wrapfs_hash_ctx *ctx, int retval) {
+	if(retval == -EINPROGRESS || retval == -EBUSY) {
+		wait_for_completion(&ctx->done);
+		INIT_COMPLETION(ctx->done);
+		retval = ctx->err;
+	}
+	return retval;
+}
+
+/* start a new hash on a context */
+int wrapfs_hash_init(struct wrapfs_hash_ctx *ctx) {
+	return wrapfs_hash_wait(ctx, crypto_ahash_init(ctx->req));
+}
+
+/* finish the running hash of a context and write the digest to out */
+int wrapfs_hash_final(struct wrapfs_hash_ctx *ctx, unsigned char *out) {
+	ahash_request_set_crypt(ctx->req, NULL, out, 0);
+	return wrapfs_hash_wait(ctx, crypto_ahash_final(ctx->req));
+}
+
+/* load the state saved by wrapfs_hash_export into a context, the hash goes on from there */
+int wrapfs_hash_import(struct wrapfs_hash_ctx *ctx, const void *state) {
+	return crypto_ahash_import(ctx->req, state);
+}
+
+/* save the state of the running hash of a context into state_size bytes of the pool */
+int wrapfs_hash_export(struct wrapfs_hash_ctx *ctx, void *state) {
+	return crypto_ahash_export(ctx->req, state);
+}
+
+/* hash nbytes of a scatterlist in one go and write the digest to out */
+int wrapfs_hash_digest(struct wrapfs_hash_ctx *ctx, struct scatterlist *sg, unsigned int nbytes,
+	unsigned char *out) {
+	ahash_request_set_crypt(ctx->req, sg, out, nbytes);
+	return wrapfs_hash_wait(ctx, crypto_ahash_digest(ctx->req));
+}
+
+static void wrapfs_free_hash_pool(struct wrapfs_hash_pool *pool) {
+	unsigned int i;
+
+	for(i = 0; i < pool->nr_ctx; i++) {
+		if(pool->ctx[i].req)
+			ahash_request_free(pool->ctx[i].req);
+		if(pool->ctx[i].tfm && !IS_ERR(pool->ctx[i].tfm))
+			crypto_free_ahash(pool->ctx[i].tfm);
+		kfree(pool->ctx[i].buffer);
+	}
+	kfree(pool);
+}
+
+/* Method to free every hash pool of a super block, called at unmount */
+void wrapfs_destroy_hash_pools(struct super_block *sb) {
+	struct wrapfs_sb_info *sbi = WRAPFS_SB(sb);
+	struct wrapfs_hash_pool *pool, *next;
+
+	if(sbi->hash_wq)
+		destroy_workqueue(sbi->hash_wq);
+	list_for_each_entry_safe(pool, next, &sbi->hash_pools, list) {
+		list_del(&pool->list);
+		wrapfs_free_hash_pool(pool);
+	}
+}
+
+static struct wrapfs_hash_pool *wrapfs_find_hash_pool(struct wrapfs_sb_info *sbi, const char *algo) {
+	struct wrapfs_hash_pool *pool;
+
+	spin_lock(&sbi->hash_lock);
+	list_for_each_entry(pool, &sbi->hash_pools, list) {
+		if(!strcmp(pool->algo, algo)) {
+			spin_unlock(&sbi->hash_lock);
+			return pool;
+		}
+	}
+	spin_unlock(&sbi->hash_lock);
+	return NULL;
+}
+
+/* Method to get the pool of contexts for a crypto algo
+ * Input: wrapfs super block, crypto algo name
+ * Output: the pool, or ERR_PTR if the algo is not available
+ * Following are the steps:
+ * 1. look the algo up in the pools of the super block
+ * 2. if it is not there, allocate a transform and a scratch buffer for every possible CPU
+ * 3. publish the new pool, unless another caller created it meanwhile
+ */
+struct wrapfs_hash_pool *wrapfs_hash_pool(struct super_block *sb, const char *algo) {
+	struct wrapfs_sb_info *sbi = WRAPFS_SB(sb);
+	struct wrapfs_hash_pool *pool;
+	struct wrapfs_hash_ctx *ctx;
+	struct scatterlist sg;
+	char driver[CRYPTO_MAX_ALG_NAME];
+	unsigned int i, nr_ctx = num_possible_cpus();
+	long retval = 0;
+
+	pool = wrapfs_find_hash_pool(sbi, algo);
+	if(pool)
+		return pool;
+
+	if(strlen(algo) > MAXLEN_ALGO_NAME)
+		return ERR_PTR(-EINVAL);
+
+	mutex_lock(&sbi->hash_mutex);
+	pool = wrapfs_find_hash_pool(sbi, algo);
+	if(pool)
+		goto out;
+
+	pool = kzalloc(sizeof(*pool) + nr_ctx * sizeof(struct wrapfs_hash_ctx), GFP_KERNEL);
+	if(!pool) {
+		printk("wrapfs_hash_pool: out of memory for pool\n");
+		pool = ERR_PTR(-ENOMEM);
+		goto out;
+	}
+	strcpy(pool->algo, algo);
+	/* the fastest driver of the algo on this machine, else the one the crypto API ranks first */
+	if(wrapfs_bench_pick(algo, driver, sizeof(driver)))
+		strlcpy(driver, algo, sizeof(driver));
+	spin_lock_init(&pool->lock);
+	INIT_LIST_HEAD(&pool->free);
+	init_waitqueue_head(&pool->wait);
+
+	for(i = 0; i < nr_ctx; i++, pool->nr_ctx++) {
+		ctx = &pool->ctx[i];
+		ctx->pool = pool;
+		init_completion(&ctx->done);
+		ctx->tfm = crypto_alloc_ahash(driver, 0, 0);
+		/* the driver picked at module load may have been unloaded since */
+		if(IS_ERR(ctx->tfm) && !i && strcmp(driver, algo)) {
+			strlcpy(driver, algo, sizeof(driver));
+			ctx->tfm = crypto_alloc_ahash(driver, 0, 0);
+		}
+		if(IS_ERR(ctx->tfm)) {
+			printk("wrapfs_hash_pool: error attempting to allocate crypto context\n");
+			retval = PTR_ERR(ctx->tfm);
+			goto out_free;
+		}
+		ctx->req = ahash_request_alloc(ctx->tfm, GFP_KERNEL);
+		ctx->buffer = kmalloc(CHUNKSIZE, GFP_KERNEL);
+		if(!ctx->req || !ctx->buffer) {
+			printk("wrapfs_hash_pool: out of memory for buffer\n");
+			retval = -ENOMEM;
+			goto out_free;
+		}
+		ahash_request_set_callback(ctx->req, CRYPTO_TFM_REQ_MAY_BACKLOG | CRYPTO_TFM_REQ_MAY_SLEEP,
+			wrapfs_hash_done, ctx);
+		list_add_tail(&ctx->list, &pool->free);
+	}
+	pool->digest_size = crypto_ahash_digestsize(pool->ctx[0].tfm);
+	/* the digest of a block of a hole, taken by merkle without hashing the block */
+	if(pool->digest_size <= MAXLEN) {
+		sg_init_table(&sg, 1);
+		sg_set_page(&sg, ZERO_PAGE(0), PAGE_SIZE, 0);
+		pool->zero_page_ok = !wrapfs_hash_digest(&pool->ctx[0], &sg, PAGE_SIZE,
+			pool->zero_page_digest);
+		/* and of an empty file, which a create in a protected directory stores */
+		sg_set_page(&sg, ZERO_PAGE(0), 0, 0);
+		pool->empty_ok = !wrapfs_hash_digest(&pool->ctx[0], &sg, 0, pool->empty_digest);
+	}
+	pool->state_size = crypto_ahash_statesize(pool->ctx[0].tfm);
+	strlcpy(pool->driver, crypto_tfm_alg_driver_name(crypto_ahash_tfm(pool->ctx[0].tfm)),
+		sizeof(pool->driver));
+
+	spin_lock(&sbi->hash_lock);
+	list_add_tail(&pool->list, &sbi->hash_pools);
+	spin_unlock(&sbi->hash_lock);
+	goto out;
+
+out_free:
+	/* the context that failed is counted too, its fields are checked */
+	pool->nr_ctx++;
+	wrapfs_free_hash_pool(pool);
+	pool = ERR_PTR(retval);
+out:
+	mutex_unlock(&sbi->hash_mutex);
+	return pool;
+}
+
+static struct wrapfs_hash_ctx *wrapfs_take_hash(struct wrapfs_hash_pool *pool) {
+	struct wrapfs_hash_ctx *ctx = NULL;
+
+	spin_lock(&pool->lock);
+	if(!list_empty(&pool->free)) {
+		ctx = list_first_entry(&pool->free, struct wrapfs_hash_ctx, list);
+		list_del(&ctx->list);
+	}
+	spin_unlock(&pool->lock);
+	return ctx;
+}
+
+/* Method to get a free context of a pool, waits until one is given back if all are busy */
+struct wrapfs_hash_ctx *wrapfs_get_hash(struct wrapfs_hash_pool *pool) {
+	struct wrapfs_hash_ctx *ctx;
+
+	wait_event(pool->wait, (ctx = wrapfs_take_hash(pool)) != NULL);
+	/* the extents of the last caller may be stale */
+	ctx->holes.filp = NULL;
+	return ctx;
+}
+
+/* Method to get a free context of a pool without waiting, returns NULL if all are busy */
+struct wrapfs_hash_ctx *wrapfs_try_get_hash(struct wrapfs_hash_pool *pool) {
+	struct wrapfs_hash_ctx *ctx;
+
+	ctx = wrapfs_take_hash(pool);
+	if(ctx)
+		ctx->holes.filp = NULL;
+	return ctx;
+}
+
+/* Method to give a context back to its pool */
+void wrapfs_put_hash(struct wrapfs_hash_ctx *ctx) {
+	struct wrapfs_hash_pool *pool = ctx->pool;
+
+	spin_lock(&pool->lock);
+	list_add(&ctx->list, &pool->free);
+	spin_unlock(&pool->lock);
+	wake_up(&pool->wait);
+}
+
+/* Method to give a file opened for hashing a readahead window fit for hashing it whole */
+void wrapfs_hash_readahead(struct file *filp) {
+	filp->f_ra.ra_pages = max_t(unsigned int, filp->f_ra.ra_pages, WRAPFS_HASH_RA_PAGES);
+}
+
+/* a file with fewer blocks than its size says has holes worth looking for */
+static int wrapfs_hash_sparse(struct inode *inode) {
+	return inode->i_op->fiemap && ((loff_t)inode->i_blocks << 9) < i_size_read(inode);
+}
+
+/* Method to ask the lower file system for the extents of a file from pos on
+ * Input: hole map of a context, file, start and end of the range of interest
+ * Output: return 0 if the all steps are successful; else return respective -ERRNO
+ * The map describes [start, end) afterwards: up to end if the last extent of the file is
+ 	in it, else up to the end of the last extent that fit.
+ */
+static int wrapfs_hole_map_fill(struct wrapfs_hole_map *map, struct file *filp, loff_t pos, loff_t end) {
+	struct inode *inode = filp->f_mapping->host;
+	struct fiemap_extent_info fi;
+	struct fiemap_extent *ext;
+	mm_segment_t oldfs;
+	int retval;
+
+	map->filp = NULL;
+	fi.fi_flags = 0;
+	fi.fi_extents_mapped = 0;
+	fi.fi_extents_max = WRAPFS_HOLE_EXTENTS;
+	fi.fi_extents_start = (struct fiemap_extent __user *)map->ext;
+
+	/* fiemap copies the extents out as if to user space */
+	oldfs = get_fs();
+	set_fs(KERNEL_DS);
+	retval = inode->i_op->fiemap(inode, &fi, pos, end - pos);
+	set_fs(oldfs);
+	if(retval)
+		return retval;
+
+	map->nr = fi.fi_extents_mapped;
+	map->start = pos;
+	map->end = end;
+	if(map->nr == WRAPFS_HOLE_EXTENTS) {
+		ext = &map->ext[map->nr - 1];
+		if(!(ext->fe_flags & FIEMAP_EXTENT_LAST))
+			map->end = min_t(loff_t, end, ext->fe_logical + ext->fe_length);
+	}
+	map->filp = filp;
+	return 0;
+}
+
+/* Method to tell whether a byte range of a file reads as zeros without any I/O
+ * Input: context (its hole map is reused while the context is held), file, start and
+ 	length of the range
+ * Output: returns 1 if the range is a hole or a preallocated extent and none of its pages
+ 	is cached; else returns 0, also when the lower file system can't tell
+ * Following are the steps:
+ * 1. only look at files that have fewer blocks than their size
+ * 2. ask fiemap for the extents from pos to the end of the file unless the map has them
+ * 3. any written extent in the range makes it data
+ * 4. so does a cached page, written data may not have blocks on the disk yet
+ */
+int wrapfs_hash_hole(struct wrapfs_hash_ctx *ctx, struct file *filp, loff_t pos, loff_t len) {
+	struct wrapfs_hole_map *map = &ctx->holes;
+	struct inode *inode = filp->f_mapping->host;
+	struct fiemap_extent *ext;
+	struct page *page;
+	loff_t end = pos + len;
+	unsigned int i, found;
+
+	if(len <= 0 || !wrapfs_hash_sparse(inode))
+		return 0;
+
+	if(map->filp != filp || pos < map->start || end > map->end) {
+		if(wrapfs_hole_map_fill(map, filp, pos, max_t(loff_t, end, i_size_read(inode))))
+			return 0;
+		if(end > map->end)
+			return 0;
+	}
+
+	for(i = 0; i < map->nr; i++) {
+		ext = &map->ext[i];
+		if(ext->fe_logical >= end || ext->fe_logical + ext->fe_length <= pos)
+			continue;
+		if(!(ext->fe_flags & FIEMAP_EXTENT_UNWRITTEN))
+			return 0;
+	}
+
+	found = find_get_pages(filp->f_mapping, pos >> PAGE_CACHE_SHIFT, 1, &page);
+	if(found) {
+		found = page->index <= (end - 1) >> PAGE_CACHE_SHIFT;
+		page_cache_release(page);
+	}
+	return !found;
+}
+
+/* Method to get an uptodate page of a file being hashed
+ * Input: context, file, index of the page, index of the last page that will be hashed
+ * Output: referenced page, NULL if the page is a hole that reads as the zero page, or ERR_PTR
+ * Following are the steps:
+ * 1. if the page is not cached and it is in a hole, it is not read at all
+ * 2. else start a readahead for the rest of the range
+ * 3. if it is the readahead marker start the next window before it is needed
+ * 4. wait for the page to be read
+ */
+static struct page *wrapfs_hash_page(struct wrapfs_hash_ctx *ctx, struct file *filp,
+	pgoff_t index, pgoff_t last) {
+	struct address_space *mapping = filp->f_mapping;
+	struct page *page;
+
+	page = find_get_page(mapping, index);
+	if(!page && wrapfs_hash_hole(ctx, filp, (loff_t)index << PAGE_CACHE_SHIFT, PAGE_CACHE_SIZE))
+		return NULL;
+	if(!page) {
+		page_cache_sync_readahead(mapping, &filp->f_ra, filp, index, last - index + 1);
+		page = find_get_page(mapping, index);
+	}
+	if(page && PageReadahead(page))
+		page_cache_async_readahead(mapping, &filp->f_ra, filp, page, index, last - index + 1);
+	if(page && PageUptodate(page))
+		return page;
+
+	if(page)
+		page_cache_release(page);
+	return read_mapping_page(mapping, index, filp);
+}
+
+/* fallback for lower file systems without ->readpage, reads through the scratch buffer */
+static int wrapfs_hash_range_read(struct wrapfs_hash_ctx *ctx, struct file *filp, loff_t pos, loff_t len) {
+	struct scatterlist sg;
+	int bytes, retval = 0;
+
+	while(len) {
+		bytes = kernel_read(filp, pos, ctx->buffer, min_t(loff_t, len, CHUNKSIZE));
+		if(bytes <= 0) {
+			retval = bytes ? bytes : -EIO;
+			break;
+		}
+		sg_init_one(&sg, ctx->buffer, bytes);
+		ahash_request_set_crypt(ctx->req, &sg, NULL, bytes);
+		retval = wrapfs_hash_wait(ctx, crypto_ahash_update(ctx->req));
+		if(retval)
+			break;
+		pos += bytes;
+		len -= bytes;
+	}
+
+	return retval;
+}
+
+/* keep the reads of the WRAPFS_HASH_DEPTH batches after index in flight */
+static void wrapfs_hash_prefetch(struct wrapfs_hash_ctx *ctx, struct file *filp, pgoff_t index, pgoff_t last) {
+	struct address_space *mapping = filp->f_mapping;
+	pgoff_t ahead = min_t(pgoff_t, last, index + WRAPFS_HASH_DEPTH * WRAPFS_HASH_BATCH - 1);
+	struct page *page;
+
+	if(index > last)
+		return;
+	/* reading ahead into a hole would only fill the page cache with zeros */
+	if(wrapfs_hash_hole(ctx, filp, (loff_t)index << PAGE_CACHE_SHIFT, PAGE_CACHE_SIZE))
+		return;
+
+	/* the end of the window is cached or being read: so is the rest, readahead works in order */
+	page = find_get_page(mapping, ahead);
+	if(page) {
+		page_cache_release(page);
+		return;
+	}
+	page_cache_sync_readahead(mapping, &filp->f_ra, filp, index, last - index + 1);
+}
+
+static void wrapfs_hash_release_batch(struct wrapfs_hash_batch *batch) {
+	unsigned int i;
+
+	for(i = 0; i < batch->nr; i++)
+		if(batch->pages[i])
+			page_cache_release(batch->pages[i]);
+	batch->nr = 0;
+	batch->bytes = 0;
+}
+
+/* Method to feed a byte range of a file to the running hash of a context without copying it
+ * Input: context with an initialized hash, file, start and length of the range
+ * Output: return 0 if the all steps are successful; else return respective -ERRNO
+ * Following are the steps:
+ * 1. start the reads of the next WRAPFS_HASH_DEPTH batches
+ * 2. collect the pages of a batch from the page cache, waiting for their reads; the
+ 	pages of holes are not read, the zero page stands in for them
+ * 3. wait until the previous batch is hashed and drop its pages
+ * 4. point the scatterlist of the batch straight at the pages and submit the update;
+ 	an async hash engine works on it while the next batch is collected
+ */
+int wrapfs_hash_range(struct wrapfs_hash_ctx *ctx, struct file *filp, loff_t pos, loff_t len) {
+	struct wrapfs_hash_batch *batch, *busy = NULL;
+	struct page *page;
+	pgoff_t index, last;
+	unsigned int offset, bytes, cur = 0;
+	int pending = 0, retval = 0;
+
+	if(len <= 0)
+		return 0;
+	if(!filp->f_mapping->a_ops->readpage)
+		return wrapfs_hash_range_read(ctx, filp, pos, len);
+
+	index = pos >> PAGE_CACHE_SHIFT;
+	last = (pos + len - 1) >> PAGE_CACHE_SHIFT;
+	offset = pos & (PAGE_CACHE_SIZE - 1);
+
+	while(len) {
+		wrapfs_hash_prefetch(ctx, filp, index + WRAPFS_HASH_BATCH, last);
+
+		batch = &ctx->batch[cur];
+		sg_init_table(batch->sg, WRAPFS_HASH_BATCH);
+		while(len && batch->nr < WRAPFS_HASH_BATCH) {
+			page = wrapfs_hash_page(ctx, filp, index, last);
+			if(IS_ERR(page)) {
+				retval = PTR_ERR(page);
+				goto out;
+			}
+
+			bytes = min_t(loff_t, PAGE_CACHE_SIZE - offset, len);
+			batch->pages[batch->nr] = page;
+			sg_set_page(&batch->sg[batch->nr], page ? page : ZERO_PAGE(0), bytes, offset);
+			batch->bytes += bytes;
+			batch->nr++;
+			len -= bytes;
+			offset = 0;
+			index++;
+		}
+		sg_mark_end(&batch->sg[batch->nr - 1]);
+
+		/* the request takes one update at a time */
+		if(busy) {
+			retval = wrapfs_hash_wait(ctx, pending);
+			wrapfs_hash_release_batch(busy);
+			busy = NULL;
+			if(retval)
+				goto out;
+		}
+
+		ahash_request_set_crypt(ctx->req, batch->sg, NULL, batch->bytes);
+		pending = crypto_ahash_update(ctx->req);
+		if(pending == -EINPROGRESS || pending == -EBUSY)
+			busy = batch;
+		else {
+			retval = pending;
+			wrapfs_hash_release_batch(batch);
+			if(retval)
+				goto out;
+		}
+		cur ^= 1;
+	}
+
+out:
+	if(busy) {
+		if(!retval)
+			retval = wrapfs_hash_wait(ctx, pending);
+		else
+			wrapfs_hash_wait(ctx, pending);
+		wrapfs_hash_release_batch(busy);
+	}
+	wrapfs_hash_release_batch(&ctx->batch[cur]);
+	return retval;
+}
+
+/* Method to start reading a whole small file, so that the reads of a batch of files overlap */
+void wrapfs_hash_prefetch_file(struct file *filp, loff_t len) {
+	struct address_space *mapping = filp->f_mapping;
+
+	if(len <= 0 || !mapping->a_ops->readpage || wrapfs_hash_sparse(mapping->host))
+		return;
+	page_cache_sync_readahead(mapping, &filp->f_ra, filp, 0, ((len - 1) >> PAGE_CACHE_SHIFT) + 1);
+}
+
+/* Method to start hashing a whole small file in a single request, without waiting for it
+ * Input: context, file, its length (at most WRAPFS_HASH_BATCH pages), where to put the digest
+ * Output: the status of the request, to be passed to wrapfs_hash_finish: 0, or -EINPROGRESS
+ 	or -EBUSY if an async engine has it; else respective -ERRNO
+ * Following are the steps:
+ * 1. collect the pages of the file in the first batch of the context, waiting for their
+ 	reads; the pages of holes are not read, the zero page stands in for them
+ * 2. submit one digest of all of them, the caller goes on with the next file meanwhile
+ */
+int wrapfs_hash_start(struct wrapfs_hash_ctx *ctx, struct file *filp, loff_t len, unsigned char *out) {
+	struct wrapfs_hash_batch *batch = &ctx->batch[0];
+	struct page *page;
+	pgoff_t index, last;
+	unsigned int bytes;
+
+	if(len <= 0 || len > WRAPFS_HASH_BATCH * PAGE_CACHE_SIZE || !filp->f_mapping->a_ops->readpage)
+		return -EINVAL;
+
+	last = (len - 1) >> PAGE_CACHE_SHIFT;
+	sg_init_table(batch->sg, WRAPFS_HASH_BATCH);
+	for(index = 0; index <= last; index++) {
+		page = wrapfs_hash_page(ctx, filp, index, last);
+		if(IS_ERR(page)) {
+			wrapfs_hash_release_batch(batch);
+			return PTR_ERR(page);
+		}
+
+		bytes = min_t(loff_t, PAGE_CACHE_SIZE, len);
+		batch->pages[batch->nr] = page;
+		sg_set_page(&batch->sg[batch->nr], page ? page : ZERO_PAGE(0), bytes, 0);
+		batch->bytes += bytes;
+		batch->nr++;
+		len -= bytes;
+	}
+	sg_mark_end(&batch->sg[batch->nr - 1]);
+
+	ahash_request_set_crypt(ctx->req, batch->sg, out, batch->bytes);
+	return crypto_ahash_digest(ctx->req);
+}
+
+/* Method to wait for the request of wrapfs_hash_start and drop the pages of the file
+ * Input: context, status returned by wrapfs_hash_start
+ * Output: return 0 if the digest is written; else return respective -ERRNO
+ */
+int wrapfs_hash_finish(struct wrapfs_hash_ctx *ctx, int pending) {
+	int retval;
+
+	retval = wrapfs_hash_wait(ctx, pending);
+	wrapfs_hash_release_batch(&ctx->batch[0]);
+	return retval;
+}
@@ -11,15 +11,45 @@
 
 #include "wrapfs.h"
 
+/*
+ * A new file or directory inherits has_integrity and the verify policy of its
+ * parent. This is done once the lower parent is unlocked again: hashing the
+ * new file and writing its record don't need the directory, and holding it
+ * would stall every other create, unlink and lookup in there meanwhile.
+ */
+static void wrapfs_inherit_integrity(struct inode *dir, struct dentry *dentry,
+				     struct path lower_path)
+{
+	struct dentry *parent_dentry;
+	struct path parent_lower_path;
+	struct wrapfs_integrity parent_rec;
+	int retval;
+
+	/* find the parent directory dentry in wrapfs */
+	/* we dont need a mutex_lock here */
+	parent_dentry = dget_parent(dentry);
+	wrapfs_get_lower_path(parent_dentry, &parent_lower_path);
+
+	/* check if parent_dentry has integrity or a verify policy, the new inode inherits both */
+	retval = get_integrity_record(dir, parent_lower_path, &parent_rec);
+	if(!retval)
+		retval = integrity_record_flag(&parent_rec);
+	if(retval == 0 || retval == 1 || (retval == -ENODATA && parent_rec.verify)) {
+		retval = set_has_integrity(dentry->d_inode, lower_path, &parent_rec);
+		if(retval<0)
+			printk("wrapfs_inherit_integrity: canont set %s!!\n", ATTR_HAS_INTEGRITY);
+	}
+
+	wrapfs_put_lower_path(parent_dentry, &parent_lower_path);
+	dput(parent_dentry);
+}
+
 static int wrapfs_create(struct inode *dir, struct dentry *dentry, int mode, struct nameidata *nd)
 {
 	int err = 0;
 	struct dentry *lower_dentry;
 	struct dentry *lower_parent_dentry = NULL;
 	struct path lower_path, saved_path;
-	struct dentry *parent_dentry;
-	struct path parent_lower_path;
-	int retval;
 
 
 	wrapfs_get_lower_path(dentry, &lower_path);
@@ -42,36 +72,15 @@ static int wrapfs_create(struct inode *dir, struct dentry *dentry, int mode, str
 		goto out;
 	fsstack_copy_attr_times(dir, wrapfs_lower_inode(dir));
 	fsstack_copy_inode_size(dir, lower_parent_dentry->d_inode);
+	unlock_dir(lower_parent_dentry);
+	lower_parent_dentry = NULL;
 
-
-	/* find the parent directory dentry in wrapfs */
-	/* we dont need a mutex_lock here */
-	parent_dentry = dget_parent(dentry);
-	wrapfs_get_lower_path(parent_dentry, &parent_lower_path);
-
-	/* check if parent_dentry has integrity*/
-	retval = has_integrity(parent_lower_path);
-	if(retval == 0 || retval == 1) {
-		printk("wrapfs_create: parent has attribute has_integrity set %d!!\n", retval);
-		if(retval == 0)
-			retval = set_has_integrity(lower_path, '0');
-		else
-			retval = set_has_integrity(lower_path, '1');
-
-		if(retval<0) {
-			printk("wrapfs_create: canont set %s!!\n", ATTR_INTEGRITY_VAL);
-			goto integrity_out;
-		}
-	}
-	
-
-integrity_out:
-	wrapfs_put_lower_path(parent_dentry, &parent_lower_path);
-	dput(parent_dentry);
+	wrapfs_inherit_integrity(dir, dentry, lower_path);
 out:
 	mnt_drop_write(lower_path.mnt);
 out_unlock:
-	unlock_dir(lower_parent_dentry);
+	if (lower_parent_dentry)
+		unlock_dir(lower_parent_dentry);
 	wrapfs_put_lower_path(dentry, &lower_path);
 	return err;
 }
@@ -153,6 +162,10 @@ static int wrapfs_unlink(struct inode *dir, struct dentry *dentry)
 		  wrapfs_lower_inode(dentry->d_inode)->i_nlink);
 	dentry->d_inode->i_ctime = dir->i_ctime;
 	d_drop(dentry); /* this is needed, else LTP fails (VFS won't do it) */
+
+	/* the last link is gone, so is the hash tree of the file */
+	if (S_ISREG(dentry->d_inode->i_mode) && !dentry->d_inode->i_nlink)
+		merkle_remove_tree(dir->i_sb, wrapfs_lower_inode(dentry->d_inode));
 out:
 	mnt_drop_write(lower_path.mnt);
 out_unlock:
@@ -168,9 +181,6 @@ static int wrapfs_mkdir(struct inode *dir, struct dentry *dentry, int mode)
 	struct dentry *lower_dentry;
 	struct dentry *lower_parent_dentry = NULL;
 	struct path lower_path;
-	struct dentry *parent_dentry;
-	struct path parent_lower_path;
-	int retval;
 
 	wrapfs_get_lower_path(dentry, &lower_path);
 	lower_dentry = lower_path.dentry;
@@ -191,35 +201,15 @@ static int wrapfs_mkdir(struct inode *dir, struct dentry *dentry, int mode)
 	fsstack_copy_inode_size(dir, lower_parent_dentry->d_inode);
 	/* update number of links on parent directory */
 	set_nlink(dir, wrapfs_lower_inode(dir)->i_nlink);
+	unlock_dir(lower_parent_dentry);
+	lower_parent_dentry = NULL;
 
-
-	/* find the parent directory dentry in wrapfs */
-	/* we dont need a mutex_lock here */
-	parent_dentry = dget_parent(dentry);
-	wrapfs_get_lower_path(parent_dentry, &parent_lower_path);
-
-	/* check if parent_dentry has integrity*/
-	retval = has_integrity(parent_lower_path);
-	if(retval == 0 || retval == 1) {
-		if(retval == 0)
-			retval = set_has_integrity(lower_path, '0');
-		else
-			retval = set_has_integrity(lower_path, '1');
-
-		if(retval<0) {
-			printk("wrapfs_mkdir: canont set %s!!\n", ATTR_HAS_INTEGRITY);
-			goto integrity_out;
-		}
-	}
-	
-
-integrity_out:
-	wrapfs_put_lower_path(parent_dentry, &parent_lower_path);
-	dput(parent_dentry);
+	wrapfs_inherit_integrity(dir, dentry, lower_path);
 out:
 	mnt_drop_write(lower_path.mnt);
 out_unlock:
-	unlock_dir(lower_parent_dentry);
+	if (lower_parent_dentry)
+		unlock_dir(lower_parent_dentry);
 	wrapfs_put_lower_path(dentry, &lower_path);
 	return err;
 }
@@ -396,6 +386,7 @@ int wrapfs_readlink(struct dentry *dentry, char __user *buf, int bufsiz)
 	struct path lower_path;
 #ifdef EXTRA_CREDIT
 	int retval;
+	struct wrapfs_integrity rec;
 #endif
 
 	wrapfs_get_lower_path(dentry, &lower_path);
@@ -415,7 +406,9 @@ int wrapfs_readlink(struct dentry *dentry, char __user *buf, int bufsiz)
 	/* if inode is a directory then skip the step of computing/removing integrity_val */
 	if(!S_ISDIR(lower_path.dentry->d_inode->i_mode)) {
 		/* check for integrity and open if only matches */
-		retval = has_integrity(lower_path);
+		retval = get_integrity_record(dentry->d_inode, lower_path, &rec);
+		if(!retval)
+			retval = integrity_record_flag(&rec);
 		if(retval<=0) {
 			if(retval != 0 && retval != -ENODATA) {
 				printk("wrapfs_readlink: Cannot fetch %s\n", ATTR_HAS_INTEGRITY);
@@ -423,8 +416,8 @@ int wrapfs_readlink(struct dentry *dentry, char __user *buf, int bufsiz)
 				goto out;
 			}
 		}
-		else {
-			retval = check_integrity(lower_path);
+		else if(!wrapfs_is_verified(dentry->d_inode)) {
+			retval = check_integrity_shared(dentry->d_inode, lower_path, &rec, NULL, 0);
 			if(retval<0) {
 				printk("wrapfs_readlink: Integrity check failed!!\n");
 				retval = err;
@@ -534,7 +527,17 @@ static int wrapfs_setattr(struct dentry *dentry, struct iattr *ia)
 		err = inode_newsize_ok(inode, ia->ia_size);
 		if (err)
 			goto out;
+		/* the bytes between the old and the new eof change */
+		if (S_ISREG(inode->i_mode)) {
+			wrapfs_mark_pending(inode, &lower_path);
+			wrapfs_stream_break(inode);
+			wrapfs_mark_dirty(inode,
+					  min(i_size_read(inode), ia->ia_size),
+					  max(i_size_read(inode), ia->ia_size));
+		}
 		truncate_setsize(inode, ia->ia_size);
+		/* the hash tree checked at open no longer describes the file */
+		merkle_release(inode);
 	}
 
 	/*
@@ -6,293 +6,1402 @@
 
 #include "wrapfs.h"
 
+/*
+ * All the integrity attributes of a file are kept in one binary xattr,
+ * ATTR_INTEGRITY, so that an open reads one xattr and an update writes one
+ * (every setxattr is a journaled transaction on ext3/ext4). The record is
+ * small enough to stay inline in the lower inode:
+ *
+ *	version | has_integrity | length of integrity_type | length of integrity_val |
+ *	integrity_type | integrity_val
+ *
+ * A file with a verify policy of its own (ATTR_INTEGRITY_VERIFY) has a version 2
+ * record, which goes on with the policy in its text form:
+ *
+ *	... | length of the policy | policy, e.g. "periodic=60"
+ *
+ * Every field is a byte, so the record doesn't depend on the endianness.
+ * has_integrity, integrity_val and integrity_type are still shown through
+ * getxattr/listxattr as virtual attributes, see xattr.c. Files written by
+ * an older wrapfs keep the three separate xattrs until their record is
+ * first written.
+ */
+struct integrity_record {
+	__u8 version;
+	__u8 flag;
+	__u8 type_len;
+	__u8 ilen;
+	char data[0];
+} __attribute__((packed));
+
+#define INTEGRITY_RECORD_VERSION 1
+#define INTEGRITY_RECORD_VERIFY 2	/* version with a verify policy */
+#define INTEGRITY_RECORD_MAX (sizeof(struct integrity_record) + MAXLEN_ALGO_NAME + MAXLEN + \
+	1 + WRAPFS_VERIFY_MAXLEN)
+
+/* text forms of the verify policies, periodic takes "=<seconds>" */
+static const char *verify_names[] = {
+	[WRAPFS_VERIFY_OPEN] = "open",
+	[WRAPFS_VERIFY_FIRST_READ] = "first-read",
+	[WRAPFS_VERIFY_BACKGROUND] = "background",
+	[WRAPFS_VERIFY_PERIODIC] = "periodic",
+	[WRAPFS_VERIFY_OFF] = "off",
+};
+
+/* Method to parse a verify policy
+ * Input: NUL terminated text form, e.g. "first-read" or "periodic=60", where to put the
+ 	policy and the period in seconds
+ * Output: return 0 if the policy is valid; else return -EINVAL
+ */
+int wrapfs_parse_verify(const char *value, unsigned char *mode, unsigned int *period) {
+	unsigned long n;
+	unsigned int i;
+	size_t len;
+
+	for(i = WRAPFS_VERIFY_OPEN; i <= WRAPFS_VERIFY_OFF; i++) {
+		len = strlen(verify_names[i]);
+		if(strncmp(value, verify_names[i], len))
+			continue;
+		if(i == WRAPFS_VERIFY_PERIODIC) {
+			if(value[len] != '=' || kstrtoul(value + len + 1, 10, &n) || !n || n > UINT_MAX)
+				return -EINVAL;
+			*period = n;
+		}
+		else if(value[len])
+			continue;
+		else
+			*period = 0;
+		*mode = i;
+		return 0;
+	}
+	return -EINVAL;
+}
+
+/* Method to write the text form of a verify policy
+ * Input: policy, period, buffer of at least WRAPFS_VERIFY_MAXLEN + 1 bytes
+ * Output: returns the length of the text form
+ */
+int wrapfs_format_verify(unsigned char mode, unsigned int period, char *buf) {
+	if(mode < WRAPFS_VERIFY_OPEN || mode > WRAPFS_VERIFY_OFF)
+		mode = WRAPFS_VERIFY_OPEN;
+	if(mode == WRAPFS_VERIFY_PERIODIC)
+		return snprintf(buf, WRAPFS_VERIFY_MAXLEN + 1, "%s=%u", verify_names[mode], period);
+	return snprintf(buf, WRAPFS_VERIFY_MAXLEN + 1, "%s", verify_names[mode]);
+}
+
+/* Method to read the integrity attributes of a file written by an older wrapfs
+ * Input: lower_path, record to fill
+ * Output: return 0, the fields that are not found are left empty
+ * Without has_integrity the file never had integrity, only EXTRA_CREDIT lets root
+ * set an integrity_type on such a file, so otherwise no more lookups are spent on it.
+ */
+static long get_legacy_record(struct path lower_path, struct wrapfs_integrity *rec) {
+	long retval = 0;
+
+	retval = vfs_getxattr(lower_path.dentry, ATTR_HAS_INTEGRITY, &rec->flag, 1);
+	if(retval == 1)
+		rec->legacy = 1;
+	else {
+		rec->flag = 0;
+#ifndef EXTRA_CREDIT
+		return 0;
+#endif
+	}
+
+	retval = vfs_getxattr(lower_path.dentry, ATTR_INTEGRITY_VAL, rec->ival, MAXLEN);
+	if(retval > 0) {
+		rec->ilen = retval;
+		rec->legacy = 1;
+	}
+
+	retval = vfs_getxattr(lower_path.dentry, ATTR_INTEGRITY_TYPE, rec->type, MAXLEN_ALGO_NAME);
+	if(retval > 0) {
+		rec->type[retval] = '\0';
+		rec->legacy = 1;
+	}
+	else
+		rec->type[0] = '\0';
+
+	return 0;
+}
+
+/* Method to read the integrity attributes of a file from the lower file system
+ * Input: lower_path, record to fill
+ * Output: return 0 if the all steps are successful; else return respective -ERRNO
+ * A file without integrity attributes gives an empty record.
+ * Following are the steps:
+ * 1. call vfs_getxattr to fetch ATTR_INTEGRITY
+ * 2. if it doesn't exist fall back to the xattrs of an older wrapfs
+ * 3. check the record and unpack it
+ */
+static long read_integrity_record(struct path lower_path, struct wrapfs_integrity *rec) {
+	char buf[INTEGRITY_RECORD_MAX];
+	struct integrity_record *r = (struct integrity_record *)buf;
+	char verify[WRAPFS_VERIFY_MAXLEN + 1];
+	unsigned int vlen = 0;
+	long retval = 0;
+
+	memset(rec, 0, sizeof(*rec));
+
+	retval = vfs_getxattr(lower_path.dentry, ATTR_INTEGRITY, buf, sizeof(buf));
+	if(retval == -ENODATA) {
+		retval = get_legacy_record(lower_path, rec);
+		goto out;
+	}
+	if(retval<0) {
+		printk("read_integrity_record: not able to fetch %s\n", ATTR_INTEGRITY);
+		goto out;
+	}
+
+	if(retval < sizeof(*r) || r->type_len > MAXLEN_ALGO_NAME || r->ilen > MAXLEN)
+		goto malformed;
+	if(r->version == INTEGRITY_RECORD_VERIFY && retval > sizeof(*r) + r->type_len + r->ilen)
+		vlen = r->data[r->type_len + r->ilen];
+	else if(r->version != INTEGRITY_RECORD_VERSION)
+		goto malformed;
+	if(vlen > WRAPFS_VERIFY_MAXLEN ||
+		retval != sizeof(*r) + r->type_len + r->ilen + (vlen ? 1 + vlen : 0))
+		goto malformed;
+
+	rec->flag = r->flag;
+	memcpy(rec->type, r->data, r->type_len);
+	rec->ilen = r->ilen;
+	memcpy(rec->ival, r->data + r->type_len, r->ilen);
+	if(vlen) {
+		memcpy(verify, r->data + r->type_len + r->ilen + 1, vlen);
+		verify[vlen] = '\0';
+		if(wrapfs_parse_verify(verify, &rec->verify, &rec->verify_period))
+			goto malformed;
+	}
+	retval = 0;
+	goto out;
+
+malformed:
+	printk("read_integrity_record: %s is malformed\n", ATTR_INTEGRITY);
+	retval = -EIO;
+
+out:
+	return retval;
+}
+
+/* Method to remember the integrity record of a file in its wrapfs inode
+ * Input: wrapfs inode, record, generation of the cache the record was read at
+ * Output: none, a record read before the cache changed is not kept
+ */
+static void cache_integrity_record(struct inode *inode, const struct wrapfs_integrity *rec,
+	unsigned long gen) {
+	struct wrapfs_inode_info *info = WRAPFS_I(inode);
+
+	spin_lock(&info->integrity_lock);
+	if(info->integrity_gen == gen) {
+		info->integrity = *rec;
+		info->integrity_cached = 1;
+	}
+	spin_unlock(&info->integrity_lock);
+}
+
+/* Method to forget the cached integrity record of a file
+ * Input: wrapfs inode
+ * Output: none, the next get_integrity_record reads the lower xattr again
+ */
+static void wrapfs_uncache_integrity(struct inode *inode) {
+	struct wrapfs_inode_info *info = WRAPFS_I(inode);
+
+	spin_lock(&info->integrity_lock);
+	info->integrity_cached = 0;
+	info->integrity_gen++;
+	spin_unlock(&info->integrity_lock);
+}
+
+/* Method to get the integrity attributes of a file
+ * Input: wrapfs inode (NULL if there is none yet), lower_path, record to fill
+ * Output: return 0 if the all steps are successful; else return respective -ERRNO
+ * Following are the steps:
+ * 1. copy the record out of the wrapfs inode if it is cached there
+ * 2. else read it from the lower file system and cache it, unless a put_integrity_record
+ 	ran meanwhile
+ */
+long get_integrity_record(struct inode *inode, struct path lower_path, struct wrapfs_integrity *rec) {
+	struct wrapfs_inode_info *info;
+	unsigned long gen = 0;
+	long retval = 0;
+
+	if(inode) {
+		info = WRAPFS_I(inode);
+		spin_lock(&info->integrity_lock);
+		if(info->integrity_cached) {
+			*rec = info->integrity;
+			spin_unlock(&info->integrity_lock);
+			return 0;
+		}
+		gen = info->integrity_gen;
+		spin_unlock(&info->integrity_lock);
+	}
+
+	retval = read_integrity_record(lower_path, rec);
+	if(!retval && inode)
+		cache_integrity_record(inode, rec, gen);
+	return retval;
+}
+
+/* Method to save the integrity attributes of a file with a single setxattr
+ * Input: wrapfs inode (NULL if there is none yet), lower_path, record
+ * Output: return 0 if the all steps are successful; else return respective -ERRNO
+ * Following are the steps:
+ * 1. pack the record and set it against ATTR_INTEGRITY, remove it if the record is empty
+ * 2. once the record is saved drop the xattrs of an older wrapfs
+ * 3. keep the record cached in the wrapfs inode, forget it if the lower xattr is in doubt
+ Note: vfs_setxattr will take care of mutex lock on the inode
+ */
+long put_integrity_record(struct inode *inode, struct path lower_path, struct wrapfs_integrity *rec) {
+	char buf[INTEGRITY_RECORD_MAX];
+	struct integrity_record *r = (struct integrity_record *)buf;
+	unsigned int type_len = strlen(rec->type);
+	unsigned int vlen = 0;
+	long retval = 0;
+
+	if(!rec->flag && !type_len && !rec->ilen && !rec->verify) {
+		retval = vfs_removexattr(lower_path.dentry, ATTR_INTEGRITY);
+		if(retval == -ENODATA)
+			retval = 0;
+	}
+	else {
+		r->version = INTEGRITY_RECORD_VERSION;
+		r->flag = rec->flag;
+		r->type_len = type_len;
+		r->ilen = rec->ilen;
+		memcpy(r->data, rec->type, type_len);
+		memcpy(r->data + type_len, rec->ival, rec->ilen);
+		/* only a file with a verify policy needs the newer record */
+		if(rec->verify) {
+			r->version = INTEGRITY_RECORD_VERIFY;
+			vlen = wrapfs_format_verify(rec->verify, rec->verify_period,
+				r->data + type_len + rec->ilen + 1);
+			r->data[type_len + rec->ilen] = vlen;
+			vlen++;
+		}
+		retval = vfs_setxattr(lower_path.dentry, ATTR_INTEGRITY, buf,
+			sizeof(*r) + type_len + rec->ilen + vlen, 0);
+	}
+	if(retval<0) {
+		printk("put_integrity_record: not able to set %s\n", ATTR_INTEGRITY);
+		if(inode)
+			wrapfs_uncache_integrity(inode);
+		goto out;
+	}
+
+	if(rec->legacy) {
+		vfs_removexattr(lower_path.dentry, ATTR_HAS_INTEGRITY);
+		vfs_removexattr(lower_path.dentry, ATTR_INTEGRITY_VAL);
+		vfs_removexattr(lower_path.dentry, ATTR_INTEGRITY_TYPE);
+		rec->legacy = 0;
+	}
+
+	if(inode) {
+		struct wrapfs_inode_info *info = WRAPFS_I(inode);
+
+		spin_lock(&info->integrity_lock);
+		info->integrity = *rec;
+		info->integrity_cached = 1;
+		info->integrity_gen++;
+		spin_unlock(&info->integrity_lock);
+	}
+
+out:
+	return retval;
+}
+
+/* Method to get has_integrity out of a record
+ * Output: returns 1 or 0 as has_integrity is set, -ENODATA if it is not set,
+ 	-EPERM if it has an unexpected value
+ */
+int integrity_record_flag(const struct wrapfs_integrity *rec) {
+	if(rec->flag == '0')
+		return 0;
+	if(rec->flag == '1')
+		return 1;
+	if(!rec->flag)
+		return -ENODATA;
+	return -EPERM;
+}
+
+/* tell whether this build hashes with an integrity_type: the merkle(...) and tree(...) families
+ 	and the checksums always, any other plain algo than the default only with EXTRA_CREDIT */
+static int integrity_type_allowed(int family, const char *algo) {
+#ifdef EXTRA_CREDIT
+	return 1;
+#else
+	static const char *flat[] = { ATTR_DEFAULTALGO, "crc32c", "xxhash64" };
+	int i;
+
+	if(family == INTEGRITY_FAMILY_MERKLE || family == INTEGRITY_FAMILY_TREE)
+		return 1;
+	if(family != INTEGRITY_FAMILY_FLAT)
+		return 0;
+	for(i = 0; i < ARRAY_SIZE(flat); i++) {
+		if(!strcmp(algo, flat[i]))
+			return 1;
+	}
+	return 0;
+#endif
+}
+
+/* Method to get the integrity_type a record asks for, the default algo if it has none
+ 	or if this build doesn't hash with the one it has */
+const char *integrity_record_type(const struct wrapfs_integrity *rec) {
+	char algo[MAXLEN_ALGO_NAME + 1];
+
+	if(rec->type[0] && integrity_type_allowed(parse_integrity_type(rec->type, algo, sizeof(algo)), algo))
+		return rec->type;
+	return ATTR_DEFAULTALGO;
+}
+
 /* Method to get the saved has_integrity
- * Input: lower_path
+ * Input: wrapfs inode, lower_path
  * Output: returns the has_integrity flag or error incase of unssuccessful
  * Following are the steps:
- * 1. call vfs_getxattr to fetch the has_integrity
+ * 1. fetch the integrity record of the file
  * 2. corrently set the return value
  */
-int has_integrity(struct path lower_path) {
+int has_integrity(struct inode *inode, struct path lower_path) {
 
 	long retval = 0;
-	unsigned char ibuf;
+	struct wrapfs_integrity rec;
 
-	/* get the existing has_integrity */
-	retval = vfs_getxattr(lower_path.dentry, ATTR_HAS_INTEGRITY, &ibuf, 1);
-    if(retval<0)
-    	retval = 0;
-	
-	if(ibuf == '0')
-		retval = 0;
-	else if(ibuf == '1')
-		retval = 1;
-	else
-		retval = -EPERM;
+	retval = get_integrity_record(inode, lower_path, &rec);
+	if(retval<0)
+		return retval;
 
-	return retval;
+	return integrity_record_flag(&rec);
 }
 
 /* Method to get the saved crypto hash value
- * Input: lower_path, buffer to store integrity value, size of integrity value
+ * Input: wrapfs inode, lower_path, buffer to store integrity value, size of integrity value
  * Output: return 0 if the all steps are successful; else return respective -ERRNO
  * Following are the steps:
- * 1. call vfs_getxattr to fetch the integrity value
+ * 1. fetch the integrity record and copy the integrity value out of it
  */
-long get_integrity(struct path lower_path, unsigned char *ibuf, unsigned int ilen) {
+long get_integrity(struct inode *inode, struct path lower_path, unsigned char *ibuf, unsigned int ilen) {
 	long retval = 0;
+	struct wrapfs_integrity rec;
 
-    retval = vfs_getxattr(lower_path.dentry, ATTR_INTEGRITY_VAL, ibuf, ilen);
-    if(retval<0) {
-    	printk("get_integrity: not able to fetch existing integrity value\n");
-    	goto normal_exit;
-    }
+	retval = get_integrity_record(inode, lower_path, &rec);
+	if(retval<0)
+		goto normal_exit;
+	if(!rec.ilen) {
+		printk("get_integrity: not able to fetch existing integrity value\n");
+		retval = -ENODATA;
+		goto normal_exit;
+	}
 
-    retval = 0;
+	memcpy(ibuf, rec.ival, min(ilen, rec.ilen));
+	retval = 0;
 
 normal_exit:
 	return retval;
 }
 
 /* Method to set the has_integrity xattr and in turn integrity_val
- * Input: lower_path, char to store against has_integrity xattr key
+ * Input: inode, lower_path, integrity record of the parent directory
  * Output: return 0 if the all steps are successful; else return respective -ERRNO
  * Following are the steps:
- * 1. call vfs_setxattr to set the has_integrity xattr
+ * 1. start an empty integrity record with the has_integrity and the verify policy of
+ 	the parent, the file has just been created
  * 2. check whether lower_path represents a directory
- * 3. if it is a regular file and has_integrity=1 then compute the crypto hash
- * 4. store the computed crypto hash against integrity_val (call to the function takes care of dynamic algo type)
- Note: make sure that the lower_parent_dentry is locked before this method is called
+ * 3. if it is a regular file and has_integrity=1 then compute the crypto hash into the record
+ * 4. save the record with a single setxattr
+ Note: called once the lower parent is unlocked again, the directory isn't held while the
+ file is hashed
  */
-long set_has_integrity(struct path lower_path, unsigned char buf) {
+long set_has_integrity(struct inode *inode, struct path lower_path, const struct wrapfs_integrity *parent) {
 
 	long retval = 0;
+	struct wrapfs_integrity rec;
 
-	retval = vfs_setxattr(lower_path.dentry, ATTR_HAS_INTEGRITY, &buf, 1, XATTR_CREATE);
-	if(retval<0) {
-		printk("set_has_integrity: canont set %s!!\n", ATTR_HAS_INTEGRITY);
-		goto out;
-	}
+	memset(&rec, 0, sizeof(rec));
+	if(integrity_record_flag(parent) >= 0)
+		rec.flag = parent->flag;
+	rec.verify = parent->verify;
+	rec.verify_period = parent->verify_period;
 
 	/* if inode is a directory then skip the step of computing/removing integrity_val */
-	if(S_ISDIR(lower_path.dentry->d_inode->i_mode))
-		goto out;
-
-	if(buf == '1') {
-		set_integrity_val(lower_path);
+	if(!S_ISDIR(lower_path.dentry->d_inode->i_mode) && rec.flag == '1') {
+		rec.ilen = MAXLEN;
+		retval = compute_integrity(inode, lower_path, rec.ival, &rec.ilen, 0, integrity_record_type(&rec), NULL);
 		if(retval<0) {
 			printk("set_has_integrity: canont set %s!!\n", ATTR_INTEGRITY_VAL);
 			goto out;
 		}
 	}
 
+	retval = put_integrity_record(inode, lower_path, &rec);
+	if(retval<0)
+		printk("set_has_integrity: canont set %s!!\n", ATTR_HAS_INTEGRITY);
+
 out:
 	return retval;
 }
 
+/* Method to split an integrity_type into its family and the crypto algo
+ * Input: integrity_type string, buffer to store the algo name, size of the buffer
+ * Output: returns the INTEGRITY_FAMILY_* of the type or -EINVAL if it is malformed
+ * e.g. "sha1" gives (INTEGRITY_FAMILY_FLAT, "sha1"), "merkle(md5)" gives
+ * (INTEGRITY_FAMILY_MERKLE, "md5") and "tree(sha1)" gives (INTEGRITY_FAMILY_TREE, "sha1")
+ */
+int parse_integrity_type(const char *type, char *algo, unsigned int len) {
+	static const struct {
+		const char *prefix;
+		int family;
+	} families[] = {
+		{ MERKLE_PREFIX, INTEGRITY_FAMILY_MERKLE },
+		{ TREE_PREFIX, INTEGRITY_FAMILY_TREE },
+	};
+	size_t tlen = strlen(type);
+	size_t plen;
+	int i, family = INTEGRITY_FAMILY_FLAT;
+
+	for(i = 0; i < ARRAY_SIZE(families); i++) {
+		plen = strlen(families[i].prefix);
+		if(tlen > plen && !strncmp(type, families[i].prefix, plen) && type[tlen - 1] == ')') {
+			family = families[i].family;
+			type += plen;
+			tlen -= plen + 1;
+			break;
+		}
+	}
 
-/* Code method to save the crypto hash value against integrity_val xattr key
- * Input: lower_path
- * Output: return 0 if the all steps are successful; else return respective -ERRNO
+	if(tlen == 0 || tlen >= len)
+		return -EINVAL;
+
+	memcpy(algo, type, tlen);
+	algo[tlen] = '\0';
+	return family;
+}
+
+/* Method to check an integrity_type before it is stored
+ * Input: integrity_type string
+ * Output: return 0 if compute_integrity hashes with it; else return respective -ERRNO
  * Following are the steps:
- * 1. allocate memory for buffer to store the hash value
- * 2. allocate memory for storing algo name
- * 3. fetch algo name using vfs_getxattr
- * 4. call compute_integrity with update flag so that it saves the hash value to xattr
- Note: make sure that the lower_parent_dentry is locked before this method is called
+ * 1. split the type into its family and crypto algo, -EINVAL if it is malformed
+ * 2. -EOPNOTSUPP if this build doesn't hash with the type, see integrity_type_allowed
+ * 3. -EINVAL if the crypto API doesn't have the algo
  */
-long set_integrity_val(struct path lower_path) {
+int check_integrity_type(const char *type) {
+	char algo[MAXLEN_ALGO_NAME + 1];
+	int family;
+
+	/* "merkle(<algo>)" and "tree(<algo>)" are validated through their inner algo */
+	family = parse_integrity_type(type, algo, sizeof(algo));
+	if(family<0) {
+		printk("check_integrity_type: integrity type [%s] is malformed\n", type);
+		return -EINVAL;
+	}
 
-	long retval = 0;
-	unsigned char *ibuf = NULL;
-	unsigned int ilen = MAXLEN;
-	unsigned char *algo = ATTR_DEFAULTALGO;
-
-	ibuf = (unsigned char*)kmalloc(ilen, GFP_KERNEL);
-	if(!ibuf) {
-		printk("set_integrity_val: out of memory for ibuf\n");
-		retval = -ENOMEM;
-		goto out;
+	if(!integrity_type_allowed(family, algo)) {
+		printk("check_integrity_type: integrity type [%s] is not supported by this build\n", type);
+		return -EOPNOTSUPP;
 	}
-	memset(ibuf, '\0', ilen);
 
-#ifdef EXTRA_CREDIT
-	/* allocate memory for algo */
-	algo = (unsigned char*)kmalloc(MAXLEN_ALGO_NAME, GFP_KERNEL);
-	if(!algo) {
-		printk("check_integrity: out of memory for algo\n");
-		retval = -ENOMEM;
-		goto out_free_ibuf;
+	if(!crypto_has_alg(algo, 1, 1)) {
+		printk("check_integrity_type: crypto algo [%s] not supported\n", algo);
+		return -EINVAL;
 	}
-	memset(algo, '\0', MAXLEN_ALGO_NAME);
+	return 0;
+}
 
-	/* get the existing integrity */
-	retval = vfs_getxattr(lower_path.dentry, ATTR_INTEGRITY_TYPE, algo, MAXLEN_ALGO_NAME);
-    if(retval<0) {
-    	if(retval == -ENODATA) {
-	    	printk("set_integrity_val: algo name not available, computing integrity with default algo\n");
-	    	strcpy(algo, ATTR_DEFAULTALGO);
-	    }
-	    else {
-	    	printk("set_integrity_val: error while fetching algo name\n");
-	    	goto out_free_algo;
-	    }
-    }
+/* Method to get the integrity_type of a file
+ * Input: wrapfs inode, lower_path, buffer to store the type, size of the buffer (at least MAXLEN_ALGO_NAME + 1)
+ * Output: return 0 if the all steps are successful; else return respective -ERRNO
+ * The default algo is returned when the file doesn't have an integrity_type.
+ */
+long get_integrity_type(struct inode *inode, struct path lower_path, char *type, unsigned int len) {
+	long retval = 0;
+#ifdef EXTRA_CREDIT
+	struct wrapfs_integrity rec;
 #endif
 
-	/* call compute_integrity with update flag */
-	retval = compute_integrity(lower_path, ibuf, ilen, 1, algo);
+	memset(type, '\0', len);
+	strcpy(type, ATTR_DEFAULTALGO);
 
 #ifdef EXTRA_CREDIT
-out_free_algo:
-	kfree(algo);
-out_free_ibuf:
+	retval = get_integrity_record(inode, lower_path, &rec);
+	if(retval<0) {
+		printk("get_integrity_type: error while fetching algo name\n");
+		goto out;
+	}
+	if(!rec.type[0])
+		printk("get_integrity_type: algo name not available, computing integrity with default algo\n");
+	strlcpy(type, integrity_record_type(&rec), len);
+out:
 #endif
-	kfree(ibuf);
+	return retval;
+}
+
+/* Method to save a crypto hash value against integrity_val xattr key
+ * Input: wrapfs inode, lower_path, integrity value, size of integrity value
+ * Output: return 0 if the all steps are successful; else return respective -ERRNO
+ */
+static long store_integrity_val(struct inode *inode, struct path lower_path, unsigned char *ibuf, unsigned int ilen) {
+	long retval = 0;
+	struct wrapfs_integrity rec;
+
+	/* the other attributes of the record are kept as they are */
+	retval = get_integrity_record(inode, lower_path, &rec);
+	if(retval<0)
+		goto out;
+
+	memcpy(rec.ival, ibuf, ilen);
+	rec.ilen = ilen;
+	retval = put_integrity_record(inode, lower_path, &rec);
+	if(retval<0)
+		printk("store_integrity_val: not able to set integrity value\n");
+
 out:
 	return retval;
 }
 
+/* Code method to save the crypto hash value against integrity_val xattr key
+ * Input: wrapfs inode, lower_path
+ * Output: return 0 if the all steps are successful; else return respective -ERRNO
+ * Following are the steps:
+ * 1. fetch the integrity record, its integrity_type (default algo if it is not set) is used
+ * 2. call compute_integrity to compute the hash value into the record
+ * 3. save the record
+ Note: the lower parent doesn't need to be locked, the file is hashed by its dentry
+ */
+long set_integrity_val(struct inode *inode, struct path lower_path) {
+
+	long retval = 0;
+	struct wrapfs_integrity rec;
+
+	retval = get_integrity_record(inode, lower_path, &rec);
+	if(retval<0)
+		goto out;
+
+	/* compute into the record, so that it is written back with a single setxattr */
+	memset(rec.ival, '\0', MAXLEN);
+	rec.ilen = MAXLEN;
+	retval = compute_integrity(inode, lower_path, rec.ival, &rec.ilen, 0, integrity_record_type(&rec), NULL);
+	if(retval<0)
+		goto out;
+
+	retval = put_integrity_record(inode, lower_path, &rec);
 
-long update_md5(const char *src, unsigned int len, struct hash_desc *desc) {
+out:
+	return retval;
+}
+
+/* Method to compute the integrity_val of a file into its record without holding its lower parent
+ * Input: wrapfs inode, lower_path, record to compute the integrity_val into, lower parent
+ 	locked by the caller with lock_parent
+ * Output: return 0 if the all steps are successful; -EBUSY if the file kept changing while
+ 	it was hashed; else return respective -ERRNO. *lower_parent is locked again on return,
+ 	it is the new parent if the file was renamed meanwhile
+ * Following are the steps:
+ * 1. take the stamp of the lower inode and unlock the lower parent, so that creates,
+ 	unlinks and lookups in the directory don't wait for the hash
+ * 2. compute the integrity_val into the record
+ * 3. lock the parent again; if the lower inode changed meanwhile the value may be stale,
+ 	hash it again, at most WRAPFS_HASH_RETRIES times
+ Note: the caller holds i_mutex of the wrapfs inode, so the record itself can't be changed
+ by another setxattr meanwhile; the caller stores it once this returns
+ */
+long compute_integrity_unlocked(struct inode *inode, struct path lower_path,
+	struct wrapfs_integrity *rec, struct dentry **lower_parent) {
+	struct inode *lower_inode = lower_path.dentry->d_inode;
+	struct wrapfs_stamp before, after;
+	unsigned int tries = 0;
 	long retval = 0;
-	struct scatterlist sg;
 
-	sg_init_one(&sg, src, len);
-    retval = crypto_hash_update(desc, &sg, len);
-	if(retval) {
-		printk("Error updating crypto hash\n");
-		goto normal_exit;
+	do {
+		wrapfs_get_stamp(lower_inode, &before);
+		unlock_dir(*lower_parent);
+
+		rec->ilen = MAXLEN;
+		retval = compute_integrity(inode, lower_path, rec->ival, &rec->ilen, 0,
+			integrity_record_type(rec), NULL);
+
+		*lower_parent = lock_parent(lower_path.dentry);
+		if(retval<0)
+			goto out;
+		wrapfs_get_stamp(lower_inode, &after);
+	} while(!wrapfs_same_stamp(&before, &after) && ++tries < WRAPFS_HASH_RETRIES);
+
+	if(!wrapfs_same_stamp(&before, &after)) {
+		printk("compute_integrity_unlocked: the file keeps changing, giving up\n");
+		retval = -EBUSY;
 	}
-   
-normal_exit:
+
+out:
 	return retval;
 }
 
-/* Core method used for running the crypto hash algorithm
- * Input: lower_path, buffer to store integrity value, size of integrity value, 
- 	flag to tell whether to update the integrity value, algo to be used
+/* Method to bring integrity_val up to date after the file was written
+ * Input: wrapfs inode, lower_path, byte ranges written since the last update,
+ 	flag telling that the file was written outside of those ranges
  * Output: return 0 if the all steps are successful; else return respective -ERRNO
  * Following are the steps:
- * 1. allocate for crypto transform
- * 2. initialize the crypto hash
- * 3. open the file using dentry_open
- * 4. check if the read/write permissions exist
- * 5. allocate memory for temp buffer to store the chunks of the file
- * 6. read CHUNKSIZE bytes from the file and update the hash value
- * 7. finalize the hash value and write it to ibuf
- * 8. use vfs_setxattr to set the appropriate extended attribute value
- * 9. free the allocated memory accordingly
- */
-long compute_integrity(struct path lower_path, unsigned char *ibuf, unsigned int ilen, 
-	unsigned int flag, const char *algo) {
+ * 1. fetch the integrity record, its integrity_type (default algo if it is not set) is used
+ * 2. for a flat integrity_type go on from the hash state saved at the last update when
+ 	only bytes past it were written (see resume.c), small files are rehashed whole
+ * 3. for the merkle family take the saved root from the record and rehash only the tree
+ 	blocks above the written ranges
+ * 4. otherwise, or if the tree can't be updated in place, recompute the integrity_val
+ 	over the whole file with set_integrity_val
+ */
+long update_integrity_val(struct inode *inode, struct path lower_path,
+	struct list_head *dirty, unsigned int dirty_all) {
+
+	long retval = 0;
+	struct wrapfs_integrity rec;
+	char algo[MAXLEN_ALGO_NAME + 1];
+	int family;
+
+	if(!S_ISREG(lower_path.dentry->d_inode->i_mode))
+		goto full;
+
+	retval = get_integrity_record(inode, lower_path, &rec);
+	if(retval<0)
+		goto out;
+	family = parse_integrity_type(integrity_record_type(&rec), algo, sizeof(algo));
+	if(family == INTEGRITY_FAMILY_FLAT) {
+		retval = wrapfs_resume_rehash(inode, lower_path, &rec, algo, dirty, dirty_all);
+		if(retval == -EAGAIN)
+			goto full;
+		goto out;
+	}
+	if(family != INTEGRITY_FAMILY_MERKLE || dirty_all || !rec.ilen)
+		goto full;
+
+	/* the old root in the record is replaced by the new one */
+	retval = merkle_update(inode, lower_path, algo, dirty, rec.ival, &rec.ilen);
+	if(retval == -EAGAIN)
+		goto full;
+	if(retval<0)
+		goto out;
+
+	retval = put_integrity_record(inode, lower_path, &rec);
+	goto out;
+
+full:
+	retval = set_integrity_val(inode, lower_path);
+out:
+	return retval;
+}
+
+/* Method to remember that a byte range of a file was written
+ * Input: wrapfs inode, start and end of the range
+ * Output: none, if memory runs out the whole file is marked as written
+ * Following are the steps:
+ * 1. extend the last range in place for sequential writes
+ * 2. otherwise merge every range overlapping or touching [start, end) into a new one
+ * 3. if there are too many ranges collapse them into a single one
+ */
+void wrapfs_mark_dirty(struct inode *inode, loff_t start, loff_t end) {
+	struct wrapfs_inode_info *info = WRAPFS_I(inode);
+	struct wrapfs_dirty_range *range, *next, *new;
+
+	if(start >= end)
+		return;
+
+	spin_lock(&info->dirty_lock);
+	write_seqcount_begin(&info->verified_seq);
+	info->verified = 0;
+	write_seqcount_end(&info->verified_seq);
+	if(!list_empty(&info->dirty_ranges)) {
+		range = list_entry(info->dirty_ranges.prev, struct wrapfs_dirty_range, list);
+		if(start >= range->start && start <= range->end) {
+			range->end = max(range->end, end);
+			spin_unlock(&info->dirty_lock);
+			return;
+		}
+	}
+	spin_unlock(&info->dirty_lock);
+
+	new = kmalloc(sizeof(*new), GFP_KERNEL);
+	if(!new) {
+		printk("wrapfs_mark_dirty: out of memory, the whole file will be rehashed\n");
+		wrapfs_mark_dirty_all(inode);
+		return;
+	}
+
+	spin_lock(&info->dirty_lock);
+	list_for_each_entry_safe(range, next, &info->dirty_ranges, list) {
+		if(range->end < start)
+			continue;
+		if(range->start > end)
+			break;
+		start = min(start, range->start);
+		end = max(end, range->end);
+		list_del(&range->list);
+		kfree(range);
+		info->nr_dirty_ranges--;
+	}
+	new->start = start;
+	new->end = end;
+	/* range is the first one past the new range, or the list head */
+	list_add_tail(&new->list, &range->list);
+	info->nr_dirty_ranges++;
+
+	if(info->nr_dirty_ranges > WRAPFS_MAX_DIRTY_RANGES) {
+		new = list_first_entry(&info->dirty_ranges, struct wrapfs_dirty_range, list);
+		new->end = list_entry(info->dirty_ranges.prev, struct wrapfs_dirty_range, list)->end;
+		list_for_each_entry_safe_continue(new, next, &info->dirty_ranges, list) {
+			list_del(&new->list);
+			kfree(new);
+		}
+		info->nr_dirty_ranges = 1;
+	}
+	spin_unlock(&info->dirty_lock);
+}
+
+/* Method to remember that a file was written in a way the ranges can't describe (e.g. mmap) */
+void wrapfs_mark_dirty_all(struct inode *inode) {
+	struct wrapfs_inode_info *info = WRAPFS_I(inode);
+
+	spin_lock(&info->dirty_lock);
+	write_seqcount_begin(&info->verified_seq);
+	info->dirty_all = 1;
+	info->verified = 0;
+	write_seqcount_end(&info->verified_seq);
+	spin_unlock(&info->dirty_lock);
+	/* a running hash of the writes misses whatever this was */
+	wrapfs_stream_break(inode);
+}
+
+/* Method to take a snapshot of what a lower inode looks like
+ * Input: lower inode, stamp to fill
+ * Size, times and i_version change with every write to the lower file, also one that
+ * doesn't go through wrapfs. Without i_version on the lower mount that only holds for the
+ * times once they are older than the clock: a write in the same tick of the timestamp
+ * granularity leaves them as they are. Such a stamp is racy, like an index entry is in git,
+ * and contents hashed after it must not be remembered against it.
+ */
+void wrapfs_get_stamp(struct inode *lower_inode, struct wrapfs_stamp *stamp) {
+	struct timespec now = current_fs_time(lower_inode->i_sb);
+
+	stamp->size = i_size_read(lower_inode);
+	stamp->mtime = lower_inode->i_mtime;
+	stamp->ctime = lower_inode->i_ctime;
+	stamp->version = lower_inode->i_version;
+	stamp->racy = !IS_I_VERSION(lower_inode) &&
+		(timespec_compare(&stamp->mtime, &now) >= 0 || timespec_compare(&stamp->ctime, &now) >= 0);
+}
+
+/* Method to compare two stamps, returns 1 if the lower inode looks the same in both */
+int wrapfs_same_stamp(const struct wrapfs_stamp *a, const struct wrapfs_stamp *b) {
+	return a->size == b->size && timespec_equal(&a->mtime, &b->mtime) &&
+		timespec_equal(&a->ctime, &b->ctime) && a->version == b->version;
+}
+
+/* Method to check whether the contents of a file were verified and haven't changed since
+ * Input: wrapfs inode, how long a check holds in seconds (0 for as long as the file
+ 	doesn't change)
+ * Output: returns 1 if the integrity check can be skipped; else returns 0
+ * Every open of a file asks this, so it doesn't take dirty_lock: the verified* fields
+ * are read under verified_seq and read again if a writer changed them meanwhile. A
+ * write drops verified under verified_seq before it adds its range. A racy stamp is
+ * never trusted, a write that didn't change it can't be told apart.
+ */
+int wrapfs_is_verified_within(struct inode *inode, unsigned int period) {
+	struct wrapfs_inode_info *info = WRAPFS_I(inode);
+	struct wrapfs_stamp now;
+	unsigned int seq;
+	int retval;
+
+	wrapfs_get_stamp(wrapfs_lower_inode(inode), &now);
+
+	do {
+		seq = read_seqcount_begin(&info->verified_seq);
+		retval = info->verified && !wrapfs_get_dirty_flag(inode) &&
+			!info->verified_stamp.racy && wrapfs_same_stamp(&info->verified_stamp, &now) &&
+			(!period || time_before(jiffies, info->verified_at + period * HZ));
+	} while(read_seqcount_retry(&info->verified_seq, seq));
+	return retval;
+}
+
+int wrapfs_is_verified(struct inode *inode) {
+	return wrapfs_is_verified_within(inode, 0);
+}
+
+/* Method to remember that a file was verified
+ * Input: wrapfs inode, stamp of the lower inode taken before its contents were hashed
+ * Output: returns 1 if it is remembered; nothing is remembered (returns 0) if the file
+ 	changed while it was being hashed or if the stamp is racy (see wrapfs_get_stamp), the
+ 	next open checks the file again then.
+ */
+int wrapfs_set_verified(struct inode *inode, const struct wrapfs_stamp *stamp) {
+	struct wrapfs_inode_info *info = WRAPFS_I(inode);
+	struct wrapfs_stamp now;
+	int retval = 0;
+
+	wrapfs_get_stamp(wrapfs_lower_inode(inode), &now);
+
+	spin_lock(&info->dirty_lock);
+	if(!wrapfs_get_dirty_flag(inode) && !stamp->racy && wrapfs_same_stamp(stamp, &now)) {
+		write_seqcount_begin(&info->verified_seq);
+		info->verified_stamp = *stamp;
+		info->verified_at = jiffies;
+		info->verified = 1;
+		write_seqcount_end(&info->verified_seq);
+		clear_bit(WRAPFS_VSTATE_DUE, &info->verify_state);
+		clear_bit(WRAPFS_VSTATE_FAILED, &info->verify_state);
+		retval = 1;
+	}
+	spin_unlock(&info->dirty_lock);
+	return retval;
+}
+
+/* Method to forget that a file was verified, the next open checks it again
+ * A check left to the first read or a failed background check is forgotten too, the
+ * file is being changed through wrapfs.
+ */
+void wrapfs_clear_verified(struct inode *inode) {
+	struct wrapfs_inode_info *info = WRAPFS_I(inode);
+
+	spin_lock(&info->dirty_lock);
+	write_seqcount_begin(&info->verified_seq);
+	info->verified = 0;
+	write_seqcount_end(&info->verified_seq);
+	spin_unlock(&info->dirty_lock);
+	clear_bit(WRAPFS_VSTATE_DUE, &info->verify_state);
+	clear_bit(WRAPFS_VSTATE_FAILED, &info->verify_state);
+}
+
+/* keep a reference to the lower path for the worker and mark the inode as pending, open
+ * looks at it (see wrapfs_pending_rehash) */
+static void rehash_set_path(struct inode *inode, struct path *lower_path) {
+	struct wrapfs_inode_info *info = WRAPFS_I(inode);
+	struct path old;
+
+	path_get(lower_path);
+	spin_lock(&info->dirty_lock);
+	old = info->rehash_path;
+	info->rehash_path = *lower_path;
+	info->rehash_pending = 1;
+	spin_unlock(&info->dirty_lock);
+	if(old.dentry)
+		path_put(&old);
+}
+
+/* Method to leave the rehash of a written file to the rehash workqueue (rehash=deferred)
+ * Input: wrapfs inode, lower path of the file being released
+ * Output: returns 1 if the rehash was queued; returns 0 if the caller has to rehash the file
+ */
+int wrapfs_defer_rehash(struct inode *inode, struct path *lower_path) {
+	struct wrapfs_sb_info *sbi = WRAPFS_SB(inode->i_sb);
+
+	if(sbi->rehash_mode != WRAPFS_REHASH_DEFERRED || !sbi->rehash_wq)
+		return 0;
+
+	/* small files are rehashed in batches, see batch.c */
+	if(wrapfs_batch_fits(lower_path)) {
+		rehash_set_path(inode, lower_path);
+		wrapfs_batch_add(inode);
+		return 1;
+	}
+
+	wrapfs_queue_rehash(inode, lower_path, sbi->rehash_wq);
+	return 1;
+}
+
+/* Method to queue the rehash of a dirty file, used by a deferred release and the recovery
+ 	at mount (see pending.c)
+ * Input: wrapfs inode, lower path of the file, workqueue or NULL to rehash it now
+ * Following are the steps:
+ * 1. keep a reference to the lower path for the worker
+ * 2. mark the inode as pending, open looks at it (see wrapfs_pending_rehash)
+ * 3. queue the work of the inode, a rehash already queued picks up the new ranges
+ */
+void wrapfs_queue_rehash(struct inode *inode, struct path *lower_path, struct workqueue_struct *wq) {
+	struct wrapfs_inode_info *info = WRAPFS_I(inode);
+
+	rehash_set_path(inode, lower_path);
+	if(wq)
+		queue_work(wq, &info->rehash_work);
+	else
+		wrapfs_rehash_work(&info->rehash_work);
+}
+
+/* Method to take the lower path queued for the rehash of a file
+ * Input: wrapfs inode, path to fill
+ * Output: returns 1 if it is taken; returns 0 if another worker took it already
+ */
+int wrapfs_rehash_take(struct inode *inode, struct path *lower_path) {
+	struct wrapfs_inode_info *info = WRAPFS_I(inode);
+
+	spin_lock(&info->dirty_lock);
+	*lower_path = info->rehash_path;
+	info->rehash_path.dentry = NULL;
+	info->rehash_path.mnt = NULL;
+	spin_unlock(&info->dirty_lock);
+	return lower_path->dentry != NULL;
+}
+
+/* Method to end a rehash taken with wrapfs_rehash_take
+ * The marker goes unless the file is dirty or open for writing again, and the pending
+ * state is cleared unless another release queued a rehash meanwhile.
+ */
+void wrapfs_rehash_done(struct inode *inode, struct path *lower_path) {
+	struct wrapfs_inode_info *info = WRAPFS_I(inode);
+
+	wrapfs_clear_pending(inode, lower_path, 0);
+	path_put(lower_path);
+
+	spin_lock(&info->dirty_lock);
+	if(!info->rehash_path.dentry)
+		info->rehash_pending = 0;
+	spin_unlock(&info->dirty_lock);
+}
+
+/* Method run on the rehash workqueue to update the integrity_val of a released file
+ * Input: rehash_work of a wrapfs inode
+ * Output: none, on failure the file stays dirty so that the next release tries again
+ * Following are the steps:
+ * 1. take the lower path queued by wrapfs_defer_rehash
+ * 2. take the written ranges and rehash them as wrapfs_file_release does in rehash=sync
+ * 3. clear the pending state unless another release queued the work again
+ */
+void wrapfs_rehash_work(struct work_struct *work) {
+	struct wrapfs_inode_info *info = container_of(work, struct wrapfs_inode_info, rehash_work);
+	struct inode *inode = &info->vfs_inode;
+	struct path lower_path;
+	LIST_HEAD(dirty);
+	unsigned int dirty_all;
+	long retval;
+
+	if(!wrapfs_rehash_take(inode, &lower_path))
+		return;
+
+	wrapfs_take_dirty(inode, &dirty, &dirty_all);
+	if(!list_empty(&dirty) || dirty_all) {
+		retval = has_integrity(inode, lower_path);
+		if(retval == 1) {
+			retval = update_integrity_val(inode, lower_path, &dirty, dirty_all);
+			if(retval<0) {
+				printk("wrapfs_rehash_work: cannot set %s!!\n", ATTR_INTEGRITY_VAL);
+				wrapfs_mark_dirty_all(inode);
+			}
+		}
+	}
+	wrapfs_free_dirty(&dirty);
+	wrapfs_rehash_done(inode, &lower_path);
+}
+
+/* Method to deal with a deferred rehash when a file is opened
+ * Input: wrapfs inode
+ * Output: returns 1 if integrity_val is still being recomputed and the check has to be
+ 	skipped (pending=open); else returns 0, after waiting for the rehash (pending=wait)
+ */
+int wrapfs_pending_rehash(struct inode *inode) {
+	struct wrapfs_inode_info *info = WRAPFS_I(inode);
+
+	if(!info->rehash_pending)
+		return 0;
+	if(WRAPFS_SB(inode->i_sb)->pending_mode == WRAPFS_PENDING_OPEN)
+		return 1;
+
+	flush_work_sync(&info->rehash_work);
+	/* a small file waits in a batch */
+	if(info->rehash_pending)
+		wrapfs_flush_batch(inode->i_sb);
+	return 0;
+}
+
+/* Method to leave the integrity check of a file to the verify workqueue
+ * Input: wrapfs inode, lower path of the file, flag to hash the file even if the vcache
+ 	knows it
+ * Output: returns 1 if the check is queued; returns 0 if the caller has to check the file
+ */
+static int wrapfs_queue_verify(struct inode *inode, struct path *lower_path, unsigned int fresh) {
+	struct wrapfs_sb_info *sbi = WRAPFS_SB(inode->i_sb);
+	struct wrapfs_inode_info *info = WRAPFS_I(inode);
+
+	if(!sbi->verify_wq)
+		return 0;
+
+	path_get(lower_path);
+	spin_lock(&info->dirty_lock);
+	if(info->verify_path.dentry) {
+		/* a check of the file is queued already */
+		spin_unlock(&info->dirty_lock);
+		path_put(lower_path);
+		return 1;
+	}
+	info->verify_path = *lower_path;
+	info->verify_fresh = fresh;
+	spin_unlock(&info->dirty_lock);
+
+	queue_work(sbi->verify_wq, &info->verify_work);
+	return 1;
+}
+
+/* Method to get the verify policy of a file
+ * Input: wrapfs inode, integrity record of the file, where to put the period
+ * Output: returns the WRAPFS_VERIFY_* policy, the one of the file if it has one,
+ 	else the one of the mount
+ */
+static unsigned char wrapfs_verify_policy(struct inode *inode, const struct wrapfs_integrity *rec,
+	unsigned int *period) {
+	struct wrapfs_sb_info *sbi = WRAPFS_SB(inode->i_sb);
+	unsigned char mode;
+
+	if(rec->verify) {
+		*period = rec->verify_period;
+		return rec->verify;
+	}
+
+	/* verify= can be changed by a remount at any time */
+	spin_lock(&sbi->verify_lock);
+	mode = sbi->verify_mode;
+	*period = sbi->verify_period;
+	spin_unlock(&sbi->verify_lock);
+	return mode;
+}
+
+/* Method to check the integrity of a file being opened as its verify policy says
+ * Input: wrapfs inode, lower file opened for it, integrity record of the file
+ * Output: returns 0 or 1 if the open can go ahead; else returns respective -ERRNO
+ * Following are the steps:
+ * 1. off: nothing is checked
+ * 2. a file whose background check or first read failed is checked now, whatever the policy,
+ 	and can be read again if it passes
+ * 3. first-read: the check is left to wrapfs_verify_read
+ * 4. background and periodic=N: the check is queued on the verify workqueue, unless the
+ 	file was verified (in the last N seconds for periodic)
+ * 5. open: the file is checked now, unless it was verified and didn't change since
+ */
+int wrapfs_verify_open(struct inode *inode, struct file *lower_file, const struct wrapfs_integrity *rec) {
+	struct wrapfs_inode_info *info = WRAPFS_I(inode);
+	unsigned int period;
+	unsigned char mode;
+	int verified, retval;
+
+	mode = wrapfs_verify_policy(inode, rec, &period);
+	if(mode == WRAPFS_VERIFY_OFF)
+		return 0;
+
+	/* the vcache may still know the contents from before they went bad */
+	if(test_bit(WRAPFS_VSTATE_FAILED, &info->verify_state)) {
+		retval = check_integrity_shared(inode, lower_file->f_path, rec, lower_file, 1);
+		/* set_verified leaves the bits alone for a racy stamp, and a merkle file doesn't get there */
+		if(retval == 1) {
+			clear_bit(WRAPFS_VSTATE_FAILED, &info->verify_state);
+			clear_bit(WRAPFS_VSTATE_DUE, &info->verify_state);
+		}
+		return retval;
+	}
+
+	switch(mode) {
+	case WRAPFS_VERIFY_FIRST_READ:
+		if(!wrapfs_is_verified(inode))
+			set_bit(WRAPFS_VSTATE_DUE, &info->verify_state);
+		return 0;
+
+	case WRAPFS_VERIFY_BACKGROUND:
+	case WRAPFS_VERIFY_PERIODIC:
+		if(mode == WRAPFS_VERIFY_BACKGROUND)
+			period = 0;
+		if(wrapfs_is_verified_within(inode, period))
+			return 0;
+		/* a periodic check is due although the file didn't change, so the vcache
+		 * can't answer it */
+		verified = wrapfs_is_verified(inode);
+		if(wrapfs_queue_verify(inode, &lower_file->f_path, verified))
+			return 0;
+		return check_integrity_shared(inode, lower_file->f_path, rec, lower_file, verified);
+
+	default:
+		if(wrapfs_is_verified(inode))
+			return 0;
+		/* concurrent openers share a single check of the file */
+		return check_integrity_shared(inode, lower_file->f_path, rec, lower_file, 0);
+	}
+}
+
+/* Method to run the integrity check that was left to the first access to the data of a file
+ * Input: wrapfs inode, lower file being read, mmapped or spliced
+ * Output: return 0 if the file can be read; else return respective -ERRNO
+ * Following are the steps:
+ * 1. nothing to do unless a check is due (verify=first-read) or a check failed, this
+ 	is a single load of verify_state, so a file that needs nothing pays nothing
+ * 2. a failed check fails the access with -EPERM
+ * 3. else check the file through the lower file being accessed, the first reader does
+ 	the work and the others wait for it on the mutex of check_integrity_shared
+ Note: called by read, mmap, splice and page fault before any data is handed out
+ */
+int wrapfs_verify_read(struct inode *inode, struct file *lower_file) {
+	struct wrapfs_inode_info *info = WRAPFS_I(inode);
+	struct wrapfs_integrity rec;
+	unsigned long state;
+	int retval;
+
+	state = ACCESS_ONCE(info->verify_state);
+	if(likely(!state))
+		return 0;
+	if(test_bit(WRAPFS_VSTATE_FAILED, &state))
+		return -EPERM;
+
+	retval = get_integrity_record(inode, lower_file->f_path, &rec);
+	if(retval<0)
+		return retval;
+	if(integrity_record_flag(&rec) != 1 || wrapfs_get_dirty_flag(inode)) {
+		/* integrity was turned off or the file written since it was opened */
+		clear_bit(WRAPFS_VSTATE_DUE, &info->verify_state);
+		return 0;
+	}
+
+	retval = check_integrity_shared(inode, lower_file->f_path, &rec, lower_file, 0);
+	if(retval<0) {
+		printk("wrapfs_verify_read: Integrity check failed!!\n");
+		if(retval != -EINTR) {
+			set_bit(WRAPFS_VSTATE_FAILED, &info->verify_state);
+			clear_bit(WRAPFS_VSTATE_DUE, &info->verify_state);
+		}
+		return retval;
+	}
+
+	/* set_verified does this too, unless the file changed while it was hashed */
+	clear_bit(WRAPFS_VSTATE_DUE, &info->verify_state);
+	return 0;
+}
+
+/* Method run on the verify workqueue for a queued integrity check
+ * Input: verify_work of the wrapfs inode
+ * Output: none, a failure marks the file so that it can't be read (see wrapfs_verify_read)
+ 	and the next open checks it again
+ */
+void wrapfs_verify_work(struct work_struct *work) {
+	struct wrapfs_inode_info *info = container_of(work, struct wrapfs_inode_info, verify_work);
+	struct inode *inode = &info->vfs_inode;
+	struct wrapfs_integrity rec;
+	struct path lower_path;
+	unsigned int fresh;
+	int retval;
+
+	spin_lock(&info->dirty_lock);
+	lower_path = info->verify_path;
+	fresh = info->verify_fresh;
+	info->verify_path.dentry = NULL;
+	info->verify_path.mnt = NULL;
+	spin_unlock(&info->dirty_lock);
+	if(!lower_path.dentry)
+		return;
+
+	/* a file being written gets a new integrity_val on release, there is nothing to check */
+	if(wrapfs_get_dirty_flag(inode))
+		goto out;
+	retval = get_integrity_record(inode, lower_path, &rec);
+	if(retval<0 || integrity_record_flag(&rec) != 1)
+		goto out;
+
+	retval = check_integrity_shared(inode, lower_path, &rec, NULL, fresh);
+	if(retval<0 && retval != -EINTR) {
+		printk("wrapfs_verify_work: Integrity check failed!!\n");
+		set_bit(WRAPFS_VSTATE_FAILED, &info->verify_state);
+	}
+
+out:
+	path_put(&lower_path);
+}
+
+/* Method to stop the queued integrity check of an inode being evicted */
+void wrapfs_cancel_verify(struct inode *inode) {
+	struct wrapfs_inode_info *info = WRAPFS_I(inode);
+
+	cancel_work_sync(&info->verify_work);
+	if(info->verify_path.dentry) {
+		path_put(&info->verify_path);
+		info->verify_path.dentry = NULL;
+		info->verify_path.mnt = NULL;
+	}
+}
+
+/* Method to take over the written ranges of an inode, the inode is clean afterwards
+ * Input: wrapfs inode, list to move the ranges to, flag to store dirty_all in
+ * The ranges have to be freed with wrapfs_free_dirty.
+ */
+void wrapfs_take_dirty(struct inode *inode, struct list_head *dirty, unsigned int *dirty_all) {
+	struct wrapfs_inode_info *info = WRAPFS_I(inode);
+
+	spin_lock(&info->dirty_lock);
+	list_splice_init(&info->dirty_ranges, dirty);
+	info->nr_dirty_ranges = 0;
+	*dirty_all = info->dirty_all;
+	info->dirty_all = 0;
+	spin_unlock(&info->dirty_lock);
+}
+
+void wrapfs_free_dirty(struct list_head *dirty) {
+	struct wrapfs_dirty_range *range, *next;
+
+	list_for_each_entry_safe(range, next, dirty, list) {
+		list_del(&range->list);
+		kfree(range);
+	}
+}
+
+
+/* Method to compute the crypto hash of len bytes of src into dest with a hash context */
+static int hash_buffer(struct wrapfs_hash_ctx *ctx, char *dest, char *src, int len) {
+    struct scatterlist sg;
+    int retval = 0;
+
+    sg_init_one(&sg, src, len);
+
+    retval = wrapfs_hash_digest(ctx, &sg, len, dest);
+    if(retval)
+        printk("hash_buffer: error computing crypto hash\n");
+
+    return retval;
+}
+
+/* Core method used for running the crypto hash algorithm
+ * Input: wrapfs inode, lower_path, buffer to store integrity value, size of the buffer,
+ 	flag to tell whether to update the integrity value, integrity_type to be used,
+ 	lower file already opened by the caller (NULL if there is none)
+ * Output: return 0 if the all steps are successful; else return respective -ERRNO,
+ 	*ilen is set to the length of the integrity value
+ * Following are the steps:
+ * 1. split the integrity_type into its family and crypto algo
+ * 2. for the merkle family build the block hash tree and take its root as integrity value
+ * 3. otherwise take a crypto context of the algo from the pool of the mount and initialize the crypto hash
+ * 4. reuse the lower file of the caller if it was opened for reading, else open the file using dentry_open
+ * 5. feed the pages of the file to the hash straight from the lower page cache
+ * 6. finalize the hash value and write it to ibuf
+ * 7. if the flag is set save the integrity value in the integrity record of the file
+ * 8. give the context back to the pool
+ */
+long compute_integrity(struct inode *inode, struct path lower_path, unsigned char *ibuf,
+	unsigned int *ilen, unsigned int flag, const char *type, struct file *lower_file) {
 	
 	long retval = 0;
-	struct file *filp; /* for opening the file */
-    mm_segment_t oldfs; /* used to restore fs */
-    int bytes; 
-    char *buffer; /* to store a chunk of a file */
-    struct hash_desc desc; /* to compute and update integrity value */
-    // int i;
-    int digest_size;
+	struct file *filp = NULL; /* for opening the file */
+	unsigned int ra_pages = 0; /* readahead window of the file of the caller */
+    mm_segment_t oldfs = get_fs(); /* used to restore fs */
+    struct wrapfs_hash_pool *pool;
+    struct wrapfs_hash_ctx *ctx = NULL; /* to compute and update integrity value */
+    char algo[MAXLEN_ALGO_NAME + 1];
+    int family;
+
+	family = parse_integrity_type(type, algo, sizeof(algo));
+	if(family<0) {
+		printk("compute_integrity: invalid integrity type [%s]\n", type);
+		retval = family;
+		goto normal_exit;
+	}
 	
-	if(S_ISREG(lower_path.dentry->d_inode->i_mode)) {
+	if(S_ISREG(lower_path.dentry->d_inode->i_mode) && family == INTEGRITY_FAMILY_MERKLE) {
+		/* the tree goes to the sidecar, the root is the integrity value */
+		retval = merkle_build(inode, lower_path, algo, ibuf, ilen);
+		if(retval)
+			goto normal_exit;
+	}
+	else if(S_ISREG(lower_path.dentry->d_inode->i_mode) && family == INTEGRITY_FAMILY_TREE) {
+		/* the chunks are hashed on all CPUs, the root is the integrity value */
+		retval = tree_hash(inode, lower_path, algo, ibuf, ilen);
+		if(retval)
+			goto normal_exit;
+	}
+	else if(S_ISREG(lower_path.dentry->d_inode->i_mode)) {
 
-		desc.flags = 0;
-		desc.tfm = crypto_alloc_hash(algo, 0, CRYPTO_ALG_ASYNC);
-		if(IS_ERR(desc.tfm)) {
+		pool = wrapfs_hash_pool(inode->i_sb, algo);
+		if(IS_ERR(pool)) {
 			printk("compute_integrity: error attempting to allocate crypto context\n");
-			retval = PTR_ERR(desc.tfm);
+			retval = PTR_ERR(pool);
 			goto normal_exit;
 		}
-		
-		/* initialize the crypto hash */
-	    retval = crypto_hash_init(&desc);
-		if(retval) {
-			printk("compute_integrity: error initializing crypto hash\n");
-			goto free_hash;
-		}
 
 		/* check whether ilen > integrity value len */
-		digest_size = crypto_hash_digestsize(desc.tfm);
-		if(digest_size > ilen) {
+		if(pool->digest_size > *ilen) {
 			printk("compute_integrity: buf length is too short to store integrity value\n");
 			retval = -EINVAL;
-			goto free_hash;
+			goto normal_exit;
 		}
 		else
-			ilen = digest_size;
-		
-	    filp = dentry_open(lower_path.dentry, lower_path.mnt, O_RDONLY, current_cred());
-	    if (!filp || IS_ERR(filp)) {
-	    	printk("compute_integrity: cannot open the file in O_RDONLY mode\n");
-	    	retval = (int) PTR_ERR(filp);
-			goto free_hash;
-	    }
+			*ilen = pool->digest_size;
 
-	    filp->f_pos = 0;
-		oldfs = get_fs();
-		set_fs(KERNEL_DS);
+		/* an empty file, e.g. one just created in a protected directory, is not opened */
+		if(pool->empty_ok && !i_size_read(lower_path.dentry->d_inode)) {
+			memcpy(ibuf, pool->empty_digest, *ilen);
+			goto normal_exit;
+		}
 
-		// // /* check whether read/write is available on the file */
-		// // if (!filp->f_op->write) {
-		// //    printk("compute_integrity: cannot read/write the file\n");
-		// // 	retval = -ENOENT;
-		// // 	goto filp_exit;
-		// // }
-
-		buffer = (char *)kmalloc(CHUNKSIZE, GFP_KERNEL);
-		if(!buffer) {
-			printk("compute_integrity: out of memory for buffer\n");
-			retval = -ENOMEM;
-			goto filp_exit;
+		ctx = wrapfs_get_hash(pool);
+
+		/* initialize the crypto hash */
+	    retval = wrapfs_hash_init(ctx);
+		if(retval) {
+			printk("compute_integrity: error initializing crypto hash\n");
+			goto free_hash;
+		}
+		
+		if(lower_file && (lower_file->f_mode & FMODE_READ)) {
+			/* wrapfs_open already has the lower file, no need for a second one */
+			get_file(lower_file);
+			filp = lower_file;
+			ra_pages = filp->f_ra.ra_pages;
+		}
+		else {
+			/* dentry_open consumes the references, so take our own */
+			path_get(&lower_path);
+		    filp = dentry_open(lower_path.dentry, lower_path.mnt, O_RDONLY | O_LARGEFILE, current_cred());
+		    if (IS_ERR(filp)) {
+		    	printk("compute_integrity: cannot open the file in O_RDONLY mode\n");
+		    	retval = PTR_ERR(filp);
+		    	filp = NULL;
+				goto free_hash;
+		    }
 		}
 
-		/* read in chunks till the end and keep updating the hash */
-		bytes =  filp->f_op->read(filp, buffer, CHUNKSIZE, &filp->f_pos);
-		while(bytes>0) {
-			retval = update_md5(buffer, bytes, &desc);
-			if(retval)
-				goto free_buffer;
-			
-			// buffer[bytes] = '\0';
-			// printk("%s\n", buffer);
-			bytes =  filp->f_op->read(filp, buffer, CHUNKSIZE, &filp->f_pos);
+		/* hash the pages of the lower page cache in place, reading ahead of the hash */
+		wrapfs_hash_readahead(filp);
+		retval = wrapfs_hash_range(ctx, filp, 0, i_size_read(lower_path.dentry->d_inode));
+		if(retval) {
+			printk("compute_integrity: error reading the file\n");
+			goto filp_exit;
 		}
 
 		/* finalize the integrity value */
-		retval = crypto_hash_final(&desc, ibuf);
+		retval = wrapfs_hash_final(ctx, ibuf);
 		if(retval) {
 			printk("compute_integrity: error finalizing crypto hash\n");
-			goto free_buffer;
+			goto filp_exit;
 		}
 	}
 #ifdef EXTRA_CREDIT
 	else if(S_ISLNK(lower_path.dentry->d_inode->i_mode)) {
+		char *buffer; /* to store the link target */
 
-		oldfs = get_fs();
-		set_fs(KERNEL_DS);
-
-		/* This is freed by the put_link method assuming a successful call. */
-		buffer = (char *)kmalloc(CHUNKSIZE, GFP_KERNEL);
-		if(!buffer) {
-			printk("compute_integrity: out of memory for buffer\n");
-			retval = -ENOMEM;
-			goto filp_exit;
+		pool = wrapfs_hash_pool(inode->i_sb, algo);
+		if(IS_ERR(pool)) {
+			printk("compute_integrity: error attempting to allocate crypto context\n");
+			retval = PTR_ERR(pool);
+			goto normal_exit;
+		}
+		if(pool->digest_size > *ilen) {
+			printk("compute_integrity: buf length is too short to store integrity value\n");
+			retval = -EINVAL;
+			goto normal_exit;
 		}
+		*ilen = pool->digest_size;
+
+		ctx = wrapfs_get_hash(pool);
+		buffer = ctx->buffer;
+		set_fs(KERNEL_DS);
 
 		/* read the symlink */
-		retval = lower_path.dentry->d_inode->i_op->readlink(lower_path.dentry, buffer, CHUNKSIZE);
+		retval = lower_path.dentry->d_inode->i_op->readlink(lower_path.dentry, buffer, CHUNKSIZE - 1);
 		if (retval < 0) {
 			printk("compute_integrity: cannot read link\n");
-			goto free_buffer;
+			goto filp_exit;
 		}
 		buffer[retval] = '\0';
 		// printk("compute_integrity: %s\n", buffer);
 
-		retval = calculate_integrity(ibuf, buffer, retval, algo);
+		retval = hash_buffer(ctx, ibuf, buffer, retval);
 		if(retval) {
-			goto free_buffer;
+			goto filp_exit;
 		}
 
 	}
@@ -304,40 +1413,26 @@ long compute_integrity(struct path lower_path, unsigned char *ibuf, unsigned int
 	}
 
 
-	// printk("%d\n", digest_size);
-	// for(i=0;i<ilen;i++)
-	// 	printk("%x", ibuf[i]);
-
 	//* update the integrity value if flag is set */
 	if(flag) {
-		/* set the xattr, if there exists one already replace it */
-		/* vfs_setxattr will take care of mutex lock on the inode */
-		retval = vfs_setxattr(lower_path.dentry, ATTR_INTEGRITY_VAL, ibuf, ilen, XATTR_CREATE);
-	    if(retval<0) {
-	    	if(retval == -EEXIST) {
-	    		printk("compute_integrity: xattr already exists, replacing the value\n");
-	    		retval = vfs_setxattr(lower_path.dentry, ATTR_INTEGRITY_VAL, ibuf, ilen, XATTR_REPLACE);
-	    		if(retval<0){
-		    		printk("compute_integrity: not able to replace integrity value\n");
-		    		goto free_buffer;
-		    	}
-	    	}
-	    	else {
-	    		printk("compute_integrity: not able to set integrity value\n");
-	    		goto free_buffer;
-	    	}
-	    }
+		retval = store_integrity_val(inode, lower_path, ibuf, *ilen);
+		if(retval<0)
+			goto filp_exit;
 	}
 
     retval = 0;
 
-free_buffer:
- 	kfree(buffer);
 filp_exit:
 	set_fs(oldfs);
-    // fput(filp);
+	if(filp) {
+		/* the file of the caller goes back with the readahead window it had */
+		if(filp == lower_file)
+			filp->f_ra.ra_pages = ra_pages;
+		fput(filp);
+	}
 free_hash:
-    crypto_free_hash(desc.tfm);
+	if(ctx)
+		wrapfs_put_hash(ctx);
 normal_exit:
 	return retval;
 }
@@ -345,108 +1440,125 @@ normal_exit:
 /* Method to check the integrity of file
  * Compare integrity value with already existing integrity value, if they both match return 1
  * else return respective -EPERM
- * Input: lower_path of the file
- * Output: return 0 if the all steps are successful; else return respective -ERRNO
+ * Input: wrapfs inode, lower_path of the file, its integrity record as read by the caller,
+ 	lower file already opened by the caller (NULL if there is none), flag to hash the file
+ 	even if the vcache knows it
+ * Output: return 1 if the integrity matches; else return respective -ERRNO
  * Following are the steps:
- * 1. allocate memory for buffer to store the saved hash value
- * 2. allocate memory for storing algo name
- * 3. fetch algo name using vfs_getxattr
- * 4. compute the integrity using helper compute_integrity function
+ * 1. take the saved hash value from the record
+ * 2. take the integrity_type from the record (default algo if it is not set)
+ * 3. for the merkle family only check the root, the blocks are checked as they are read
+ * 4. otherwise compute the integrity using helper compute_integrity function
  * 5. compare integrity values: if match return 1; else return -EPERM
- * 6. free the allocated memory accordingly
+ * 6. on a match remember the state of the lower inode, so that the next open can skip
+ 	the check while the file doesn't change (see wrapfs_is_verified), in the inode and
+ 	in the vcache of the mount, which outlives the inode
+ Note: the vcache is looked up before the file is hashed
  */
-int check_integrity(struct path lower_path) {
+int check_integrity(struct inode *inode, struct path lower_path, const struct wrapfs_integrity *rec,
+	struct file *lower_file, unsigned int fresh) {
 
 	long retval = 0;
-	unsigned char *ibuf1;
-	unsigned char *ibuf2;
-	char *algo = ATTR_DEFAULTALGO;
-
-	/* allocate memory for ibuf1 */
-	ibuf1 = (unsigned char*)kmalloc(MAXLEN, GFP_KERNEL);
-	if(!ibuf1) {
-		printk("check_integrity: out of memory for ibuf1\n");
-		retval = -ENOMEM;
-		goto normal_exit;
-	}
-	memset(ibuf1, '\0', MAXLEN);
+	unsigned char ibuf1[MAXLEN];
+	unsigned char ibuf2[MAXLEN];
+	unsigned int ilen2 = MAXLEN;
+	const char *type = integrity_record_type(rec);
+	char algo[MAXLEN_ALGO_NAME + 1];
+	struct wrapfs_stamp stamp;
+
+	/* taken before the contents are read, a change while hashing is not missed */
+	wrapfs_get_stamp(lower_path.dentry->d_inode, &stamp);
 
 	/* get the existing integrity */
-	retval = vfs_getxattr(lower_path.dentry, ATTR_INTEGRITY_VAL, ibuf1, MAXLEN);
-    if(retval<0) {
+    if(!rec->ilen) {
     	printk("check_integrity: not able to fetch integrity value\n");
-    	goto free_ibuf1;
+    	retval = -ENODATA;
+    	goto normal_exit;
     }
+	memset(ibuf1, '\0', MAXLEN);
+	memcpy(ibuf1, rec->ival, rec->ilen);
 
-	/* allocate memory for ibuf2 */
-	ibuf2 = (unsigned char*)kmalloc(MAXLEN, GFP_KERNEL);
-	if(!ibuf2) {
-		printk("check_integrity: out of memory for ibuf2\n");
-		retval = -ENOMEM;
-		goto free_ibuf1;
-	}
 	memset(ibuf2, '\0', MAXLEN);
 
-
-#ifdef EXTRA_CREDIT
-	/* allocate memory for algo */
-	algo = (unsigned char*)kmalloc(MAXLEN_ALGO_NAME, GFP_KERNEL);
-	if(!algo) {
-		printk("check_integrity: out of memory for algo\n");
-		retval = -ENOMEM;
-		goto free_ibuf2;
+	if(S_ISREG(lower_path.dentry->d_inode->i_mode) &&
+		parse_integrity_type(type, algo, sizeof(algo)) == INTEGRITY_FAMILY_MERKLE) {
+		retval = merkle_open(inode, lower_path, algo, ibuf1, rec->ilen);
+		goto normal_exit;
 	}
-	memset(algo, '\0', MAXLEN_ALGO_NAME);
-
-	/* get the existing integrity */
-	retval = vfs_getxattr(lower_path.dentry, ATTR_INTEGRITY_TYPE, algo, MAXLEN_ALGO_NAME);
-    if(retval<0) {
-    	if(retval == -ENODATA) {
-	    	printk("set_integrity_val: algo name not available, computing integrity with default algo\n");
-	    	strcpy(algo, ATTR_DEFAULTALGO);
-	    }
-	    else {
-	    	printk("set_integrity_val: error while fetching algo name\n");
-	    	goto out_free_algo;
-	    }
-    }
-#endif
 
 	/* compute the integrity of the file */
 	/* call compute_integrity with no update flag */
-	// ??? need to fetch the algo from the stored attribute
-	retval = compute_integrity(lower_path, ibuf2, MAXLEN, 0, algo);
+	/* an inode evicted since its last check may still be known to the vcache */
+	if(!fresh && wrapfs_vcache_lookup(inode, &stamp, rec)) {
+		wrapfs_set_verified(inode, &stamp);
+		retval = 1;
+		goto normal_exit;
+	}
+
+	retval = compute_integrity(inode, lower_path, ibuf2, &ilen2, 0, type, lower_file);
 	if(retval<0) {
 		printk("check_integrity: not able to compute integrity value\n");
-		goto out_free_algo;
+		goto normal_exit;
 	}
 
-	// for(i=0;i<ilen;i++)
-	// 	printk("%x", ibuf[i]);
-
-	// for(i=0;i<ilen;i++)
-	// 	printk("%x", ibuf[i]);
-
 	/* compare the integrity */
-	if(compare_integrity(ibuf1, ibuf2, MAXLEN))
+	if(compare_integrity(ibuf1, ibuf2, MAXLEN)) {
+		if(wrapfs_set_verified(inode, &stamp))
+			wrapfs_vcache_insert(inode, &stamp, rec->ival, rec->ilen);
 		retval = 1;
+	}
 	else
 		retval = -EPERM;
 
-
-out_free_algo:
-#ifdef EXTRA_CREDIT
-	kfree(algo);
-free_ibuf2:
-#endif
-	kfree(ibuf2);
-free_ibuf1:
-	kfree(ibuf1);
 normal_exit:
 	return retval;
 }
 
 
+/* Method to check the integrity of a file once for all the processes opening it at the same time
+ * Input: wrapfs inode, lower_path of the file, its integrity record, lower file of the caller or NULL,
+ 	flag to hash the file even if the vcache knows it
+ * Output: same as check_integrity, -EINTR if the caller is killed while waiting
+ * Following are the steps:
+ * 1. note how many checks of the inode were started before waiting for the mutex
+ * 2. if the last check started after that, compared against the same integrity_val and
+ 	hashed the file at least when we would have, reuse its result, success or -EPERM alike
+ * 3. else run check_integrity and publish its result for the waiters
+ Note: a check that was already running when we came may have read the file before a
+ 	change we have to see, so its result is never reused
+ */
+int check_integrity_shared(struct inode *inode, struct path lower_path,
+	const struct wrapfs_integrity *rec, struct file *lower_file, unsigned int fresh) {
+	struct wrapfs_inode_info *info = WRAPFS_I(inode);
+	unsigned long seq;
+	int retval;
+
+	/* the mutex orders the rest, this is only a snapshot */
+	seq = ACCESS_ONCE(info->verify_seq);
+
+	if(mutex_lock_killable(&info->verify_mutex))
+		return -EINTR;
+
+	if(info->verify_seq != seq && info->verify_result != -EINTR &&
+		info->verify_fresh_last >= fresh && info->verify_ilen == rec->ilen &&
+		!memcmp(info->verify_ival, rec->ival, rec->ilen)) {
+		retval = info->verify_result;
+		goto unlock;
+	}
+
+	/* counted before the file is read, see the snapshot above */
+	info->verify_seq++;
+	retval = check_integrity(inode, lower_path, rec, lower_file, fresh);
+	info->verify_result = retval;
+	info->verify_fresh_last = fresh;
+	info->verify_ilen = rec->ilen;
+	memcpy(info->verify_ival, rec->ival, rec->ilen);
+
+unlock:
+	mutex_unlock(&info->verify_mutex);
+	return retval;
+}
+
 /* Function checks whether two integrity values match nor not.
  * Input: pointer to first integrity value, pointer to second integrity value
  * Output: return 1 if integrity values match; else return 0
@@ -466,50 +1578,30 @@ int compare_integrity(unsigned char *ibuf1, unsigned char *ibuf2, unsigned int i
 
 /* Method to compute the crpto hash using string src of len and using algo as crypto algo, 
  * the crypto hash is saved in the dest string
- * Input: destination char string to store hash value, source char string on which
+ * Input: wrapfs super block, destination char string to store hash value, source char string on which
  * integirty is computed, length of the source char string, algo to be used
  * Output: return 0 if the all steps are successful; else return respective -ERRNO
  * Following are the steps:
- * 1. initialize the crypto hash
- * 2. open the file using filp_open
- * 3. check if the read/write permissions exist
- * 4. call crypto_hash_update to compute the hash of the src string
- * 5. finalize the hash value and write it to dest
+ * 1. take a crypto context of the algo from the pool of the mount
+ * 2. compute the hash of the src string and write it to dest
+ * 3. give the context back to the pool
  */
-int calculate_integrity(char *dest, char *src, int len, const char *algo) {
-    struct scatterlist sg;
-    struct hash_desc desc;
+int calculate_integrity(struct super_block *sb, char *dest, char *src, int len, const char *algo) {
+    struct wrapfs_hash_pool *pool;
+    struct wrapfs_hash_ctx *ctx;
     int retval = 0;
 
-    desc.flags = 0;
-    desc.tfm = crypto_alloc_hash(algo, 0, CRYPTO_ALG_ASYNC);
-    if(IS_ERR(desc.tfm)) {
+    pool = wrapfs_hash_pool(sb, algo);
+    if(IS_ERR(pool)) {
         printk("calculate_integrity: error attempting to allocate crypto context\n");
-        retval= PTR_ERR(desc.tfm);
-        goto normal_exit;
-    }
-
-	retval= crypto_hash_init(&desc);
-    if(retval) {
-        printk("calculate_integrity: error initializing crypto hash\n");
+        retval = PTR_ERR(pool);
         goto normal_exit;
     }
 
-    sg_init_one(&sg, src, len);
-     
-    retval= crypto_hash_update(&desc, &sg, len);
-    if(retval) {
-        printk("calculate_integrity: error updating crypto hash\n");
-        goto normal_exit;
-    }
-     
-    retval= crypto_hash_final(&desc, dest);
-    if(retval) {
-        printk("calculate_integrity: error finalizing crypto hash\n");
-        goto normal_exit;
-    }
+    ctx = wrapfs_get_hash(pool);
+    retval = hash_buffer(ctx, dest, src, len);
+    wrapfs_put_hash(ctx);
 
 normal_exit:
     return retval;
 }
-
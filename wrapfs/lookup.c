@@ -158,6 +158,7 @@ int wrapfs_interpose(struct dentry *dentry, struct super_block *sb,
 	struct inode *inode;
 	struct inode *lower_inode;
 	struct super_block *lower_sb;
+	struct wrapfs_integrity rec;
 
 	lower_inode = lower_path->dentry->d_inode;
 	lower_sb = wrapfs_lower_super(sb);
@@ -180,6 +181,13 @@ int wrapfs_interpose(struct dentry *dentry, struct super_block *sb,
 		goto out;
 	}
 
+	/*
+	 * Cache the integrity record along with the inode, so that open
+	 * doesn't have to read it.  Nothing is read if the inode already
+	 * has it; errors are left for the first user of the record.
+	 */
+	get_integrity_record(inode, *lower_path, &rec);
+
 	d_add(dentry, inode);
 
 out:
@@ -211,6 +219,12 @@ static struct dentry *__wrapfs_lookup(struct dentry *dentry, int flags,
 
 	name = dentry->d_name.name;
 
+	/* the sidecar store in the lower root is not part of our namespace */
+	if (IS_ROOT(dentry->d_parent) && !strcmp(name, WRAPFS_SIDECAR_DIR)) {
+		err = -ENOENT;
+		goto out;
+	}
+
 	/* now start the actual lookup procedure */
 	lower_dir_dentry = lower_parent_path->dentry;
 	lower_dir_mnt = lower_parent_path->mnt;
@@ -274,7 +288,6 @@ struct dentry *wrapfs_lookup(struct inode *dir, struct dentry *dentry,
 	struct path lower_parent_path;
 	int err = 0;
 
-	BUG_ON(!nd);
 	parent = dget_parent(dentry);
 
 	wrapfs_get_lower_path(parent, &lower_parent_path);
@@ -285,7 +298,8 @@ struct dentry *wrapfs_lookup(struct inode *dir, struct dentry *dentry,
 		ret = ERR_PTR(err);
 		goto out;
 	}
-	ret = __wrapfs_lookup(dentry, nd->flags, &lower_parent_path);
+	/* lookup_one_len (the scrubber) has no nameidata */
+	ret = __wrapfs_lookup(dentry, nd ? nd->flags : 0, &lower_parent_path);
 	if (IS_ERR(ret))
 		goto out;
 	if (ret)
@@ -12,6 +12,155 @@
 #include "wrapfs.h"
 #include <linux/module.h>
 
+/* what wrapfs_mount passes to wrapfs_read_super */
+struct wrapfs_mount_data {
+	const char *dev_name;
+	char *options;
+};
+
+enum {
+	Opt_rehash_sync, Opt_rehash_deferred,
+	Opt_pending_wait, Opt_pending_open,
+	Opt_vcache, Opt_verify,
+	Opt_scrub_start, Opt_scrub_stop, Opt_scrub_restart,
+	Opt_scrub_bps, Opt_scrub_iops,
+	Opt_err
+};
+
+static const match_table_t wrapfs_tokens = {
+	{Opt_rehash_sync, "rehash=sync"},
+	{Opt_rehash_deferred, "rehash=deferred"},
+	{Opt_pending_wait, "pending=wait"},
+	{Opt_pending_open, "pending=open"},
+	{Opt_vcache, "vcache=%u"},
+	{Opt_verify, "verify=%s"},
+	{Opt_scrub_start, "scrub=start"},
+	{Opt_scrub_stop, "scrub=stop"},
+	{Opt_scrub_restart, "scrub=restart"},
+	{Opt_scrub_bps, "scrub_bps=%u"},
+	{Opt_scrub_iops, "scrub_iops=%u"},
+	{Opt_err, NULL}
+};
+
+/*
+ * rehash=sync|deferred: rehash a written file in close() or on the
+ * rehash workqueue of the mount.
+ * pending=wait|open: whether an open of a file whose deferred rehash is
+ * not done yet waits for it, or goes ahead without an integrity check.
+ * vcache=<entries>: size of the verified digest cache of the mount, 0
+ * turns it off.
+ * verify=open|first-read|background|periodic=<seconds>|off: when files
+ * without a verify policy of their own are checked.
+ * scrub=start|stop|restart: start the scrubber (going on from where it
+ * stopped), stop it, or start it again from the root; see scrub.c.
+ * scrub_bps=<bytes/s>, scrub_iops=<I/Os/s>: pace of the scrubber, 0 for
+ * no limit.
+ *
+ * On remount only pending=, verify= and the scrub options can be changed,
+ * the others are left as they are.
+ */
+int wrapfs_parse_options(struct super_block *sb, char *options, int remount)
+{
+	struct wrapfs_sb_info *sbi = WRAPFS_SB(sb);
+	substring_t args[MAX_OPT_ARGS];
+	unsigned char verify_mode;
+	unsigned int verify_period;
+	char *p, *value;
+	int n, token, err;
+
+	if (!remount) {
+		sbi->rehash_mode = WRAPFS_REHASH_SYNC;
+		sbi->pending_mode = WRAPFS_PENDING_WAIT;
+		sbi->vcache_max = WRAPFS_VCACHE_DEFAULT;
+		spin_lock_init(&sbi->verify_lock);
+		sbi->verify_mode = WRAPFS_VERIFY_OPEN;
+		sbi->verify_period = 0;
+		mutex_init(&sbi->scrub_mutex);
+		spin_lock_init(&sbi->scrub_lock);
+		sbi->scrub_bps = WRAPFS_SCRUB_BPS_DEFAULT;
+		sbi->scrub_iops = WRAPFS_SCRUB_IOPS_DEFAULT;
+	}
+	sbi->scrub_cmd = WRAPFS_SCRUB_NONE;
+	if (!options)
+		return 0;
+
+	while ((p = strsep(&options, ",")) != NULL) {
+		if (!*p)
+			continue;
+		token = match_token(p, wrapfs_tokens, args);
+		if (remount && (token == Opt_rehash_sync ||
+				token == Opt_rehash_deferred ||
+				token == Opt_vcache)) {
+			printk(KERN_WARNING "wrapfs: '%s' can't be changed "
+			       "on remount\n", p);
+			continue;
+		}
+		switch (token) {
+		case Opt_rehash_sync:
+			sbi->rehash_mode = WRAPFS_REHASH_SYNC;
+			break;
+		case Opt_rehash_deferred:
+			sbi->rehash_mode = WRAPFS_REHASH_DEFERRED;
+			break;
+		case Opt_pending_wait:
+			sbi->pending_mode = WRAPFS_PENDING_WAIT;
+			break;
+		case Opt_pending_open:
+			sbi->pending_mode = WRAPFS_PENDING_OPEN;
+			break;
+		case Opt_vcache:
+			if (match_int(&args[0], &n) || n < 0) {
+				printk(KERN_ERR "wrapfs: bad value in '%s'\n", p);
+				return -EINVAL;
+			}
+			sbi->vcache_max = n;
+			break;
+		case Opt_verify:
+			value = match_strdup(&args[0]);
+			if (!value)
+				return -ENOMEM;
+			err = wrapfs_parse_verify(value, &verify_mode,
+						  &verify_period);
+			kfree(value);
+			if (err) {
+				printk(KERN_ERR "wrapfs: bad value in '%s'\n", p);
+				return err;
+			}
+			spin_lock(&sbi->verify_lock);
+			sbi->verify_mode = verify_mode;
+			sbi->verify_period = verify_period;
+			spin_unlock(&sbi->verify_lock);
+			break;
+		case Opt_scrub_start:
+			sbi->scrub_cmd = WRAPFS_SCRUB_START;
+			break;
+		case Opt_scrub_stop:
+			sbi->scrub_cmd = WRAPFS_SCRUB_STOP;
+			break;
+		case Opt_scrub_restart:
+			sbi->scrub_cmd = WRAPFS_SCRUB_RESTART;
+			break;
+		case Opt_scrub_bps:
+		case Opt_scrub_iops:
+			if (match_int(&args[0], &n) || n < 0) {
+				printk(KERN_ERR "wrapfs: bad value in '%s'\n", p);
+				return -EINVAL;
+			}
+			/* the scrubber reads them as it goes */
+			if (token == Opt_scrub_bps)
+				sbi->scrub_bps = n;
+			else
+				sbi->scrub_iops = n;
+			break;
+		default:
+			/* options used to be ignored, e.g. user_xattr */
+			printk(KERN_WARNING "wrapfs: ignoring option '%s'\n", p);
+			break;
+		}
+	}
+	return 0;
+}
+
 /*
  * There is no need to lock the wrapfs_super_info's rwsem as there is no
  * way anyone can have a reference to the superblock at this point in time.
@@ -21,7 +170,8 @@ static int wrapfs_read_super(struct super_block *sb, void *raw_data, int silent)
 	int err = 0;
 	struct super_block *lower_sb;
 	struct path lower_path;
-	char *dev_name = (char *) raw_data;
+	struct wrapfs_mount_data *data = raw_data;
+	const char *dev_name = data->dev_name;
 	struct inode *inode;
 
 	if (!dev_name) {
@@ -47,6 +197,38 @@ static int wrapfs_read_super(struct super_block *sb, void *raw_data, int silent)
 		goto out_free;
 	}
 
+	err = wrapfs_parse_options(sb, data->options, 0);
+	if (err)
+		goto out_free_sbi;
+
+	/* the sidecar store is accessed as the kernel, not as the caller */
+	WRAPFS_SB(sb)->kernel_cred = prepare_kernel_cred(NULL);
+	if (!WRAPFS_SB(sb)->kernel_cred) {
+		printk(KERN_CRIT "wrapfs: read_super: out of memory\n");
+		err = -ENOMEM;
+		goto out_free_sbi;
+	}
+
+	/* crypto contexts are set up once per mount, not per hash */
+	wrapfs_init_hash_pools(sb);
+	wrapfs_init_vcache(sb);
+
+	/* without the workqueue written files are rehashed in close() */
+	if (WRAPFS_SB(sb)->rehash_mode == WRAPFS_REHASH_DEFERRED) {
+		WRAPFS_SB(sb)->rehash_wq = alloc_workqueue("wrapfs_rehash",
+							   WQ_UNBOUND, 0);
+		if (!WRAPFS_SB(sb)->rehash_wq)
+			printk(KERN_WARNING "wrapfs: cannot create the rehash "
+			       "workqueue, using rehash=sync\n");
+	}
+	wrapfs_init_batch(sb);
+
+	/* verify= and the verify policy of a file can change at any time */
+	WRAPFS_SB(sb)->verify_wq = alloc_workqueue("wrapfs_verify", WQ_UNBOUND, 0);
+	if (!WRAPFS_SB(sb)->verify_wq)
+		printk(KERN_WARNING "wrapfs: cannot create the verify "
+		       "workqueue, background checks are done in open\n");
+
 	/* set the lower superblock field of upper superblock */
 	lower_sb = lower_path.dentry->d_sb;
 	atomic_inc(&lower_sb->s_active);
@@ -93,6 +275,18 @@ static int wrapfs_read_super(struct super_block *sb, void *raw_data, int silent)
 	 * d_rehash it.
 	 */
 	d_rehash(sb->s_root);
+
+	/* merkle integrity is not available if the lower root is read-only */
+	if (wrapfs_init_sidecar(sb))
+		printk(KERN_WARNING "wrapfs: cannot set up %s, "
+		       "merkle integrity disabled\n", WRAPFS_SIDECAR_DIR);
+
+	/* files left marked by an unclean unmount are rehashed in the background */
+	wrapfs_init_pending(sb);
+
+	/* the scrubber goes on from the position saved in the sidecar */
+	wrapfs_init_scrub(sb);
+
 	if (!silent)
 		printk(KERN_INFO
 		       "wrapfs: mounted on top of %s type %s\n",
@@ -107,6 +301,14 @@ out_iput:
 out_sput:
 	/* drop refs we took earlier */
 	atomic_dec(&lower_sb->s_active);
+	if (WRAPFS_SB(sb)->rehash_wq)
+		destroy_workqueue(WRAPFS_SB(sb)->rehash_wq);
+	if (WRAPFS_SB(sb)->verify_wq)
+		destroy_workqueue(WRAPFS_SB(sb)->verify_wq);
+	wrapfs_destroy_vcache(sb);
+	wrapfs_destroy_hash_pools(sb);
+	put_cred(WRAPFS_SB(sb)->kernel_cred);
+out_free_sbi:
 	kfree(WRAPFS_SB(sb));
 	sb->s_fs_info = NULL;
 out_free:
@@ -119,17 +321,34 @@ out:
 struct dentry *wrapfs_mount(struct file_system_type *fs_type, int flags,
 			    const char *dev_name, void *raw_data)
 {
-	void *lower_path_name = (void *) dev_name;
+	struct wrapfs_mount_data data = {
+		.dev_name = dev_name,
+		.options = raw_data,
+	};
+
+	return mount_nodev(fs_type, flags, &data, wrapfs_read_super);
+}
 
-	return mount_nodev(fs_type, flags, lower_path_name,
-			   wrapfs_read_super);
+/*
+ * The scrubber holds dentries of the mount, the rehash batches and the
+ * recovery hold inodes, they have to be gone before the dentries are
+ * shrunk and the inodes evicted.
+ */
+static void wrapfs_kill_super(struct super_block *sb)
+{
+	if (WRAPFS_SB(sb)) {
+		wrapfs_scrub_ctl(sb, WRAPFS_SCRUB_STOP);
+		wrapfs_flush_batch(sb);
+		wrapfs_flush_pending(sb);
+	}
+	generic_shutdown_super(sb);
 }
 
 static struct file_system_type wrapfs_fs_type = {
 	.owner		= THIS_MODULE,
 	.name		= WRAPFS_NAME,
 	.mount		= wrapfs_mount,
-	.kill_sb	= generic_shutdown_super,
+	.kill_sb	= wrapfs_kill_super,
 	.fs_flags	= FS_REVAL_DOT,
 };
 
@@ -145,9 +364,14 @@ static int __init init_wrapfs_fs(void)
 	err = wrapfs_init_dentry_cache();
 	if (err)
 		goto out;
+	/* before any mount can ask for integrity_type=xxhash64 */
+	wrapfs_init_xxhash();
+	/* and before any mount makes a pool of contexts */
+	wrapfs_bench_init();
 	err = register_filesystem(&wrapfs_fs_type);
 out:
 	if (err) {
+		wrapfs_exit_xxhash();
 		wrapfs_destroy_inode_cache();
 		wrapfs_destroy_dentry_cache();
 	}
@@ -159,6 +383,7 @@ static void __exit exit_wrapfs_fs(void)
 	wrapfs_destroy_inode_cache();
 	wrapfs_destroy_dentry_cache();
 	unregister_filesystem(&wrapfs_fs_type);
+	wrapfs_exit_xxhash();
 	pr_info("Completed wrapfs module unload\n");
 }
 
@@ -0,0 +1,1231 @@
+/*
+ * This file contains the block hash tree (merkle tree) used by the
+ * "merkle(<algo>)" integrity_type family.
+ *
+ * The file is split into MERKLE_BLOCKSIZE data blocks. Level 0 of the tree
+ * holds the digest of every data block, packed into MERKLE_BLOCKSIZE tree
+ * blocks. Every higher level holds the digests of the tree blocks of the
+ * level below, until a level fits in a single tree block. The root, which
+ * is what gets stored against integrity_val, is
+ *
+ *	root = H(le64 file size || top tree block)
+ *
+ * The tree is kept in a sidecar file named after the lower inode number in
+ * the hidden WRAPFS_SIDECAR_DIR of the lower root. Block 0 of the sidecar
+ * is a header, the levels follow starting with level 0. Every level gets
+ * room for a power of two number of blocks, so that a file can grow up to
+ * twice its size before the levels have to move and the tree can be updated
+ * in place when the file is written (see merkle_update).
+ *
+ * Open only checks the top tree block against the root. Every other tree
+ * block and every data block is checked on its first read, and the result
+ * is remembered in the bitmaps of struct wrapfs_merkle. A read of blocks that
+ * are all verified only looks at the bitmap under RCU, merkle_mutex is taken
+ * for the blocks that still have to be hashed. A tree detached from its inode
+ * is therefore freed after a grace period, from a work item since the file
+ * and the bitmaps can't be let go of in the RCU callback.
+ */
+
+#include "wrapfs.h"
+
+#define MERKLE_MAGIC 0x4b4d5257 /* "WRMK" */
+#define MERKLE_VERSION 1
+
+/* ways to open a sidecar */
+#define MERKLE_TREE_READ 0	/* live tree, read only */
+#define MERKLE_TREE_WRITE 1	/* live tree, for an update in place */
+#define MERKLE_TREE_CREATE 2	/* new temporary tree, for a rebuild */
+
+/* on-disk header, stored at the start of block 0 of the sidecar */
+struct merkle_header {
+	__le32 magic;
+	__le32 version;
+	__le32 block_size;
+	__le32 digest_size;
+	__le64 data_size;
+	char algo[MAXLEN_ALGO_NAME + 1];
+};
+
+/* layout of a tree, derived from the data size and the digest size */
+struct merkle_geometry {
+	loff_t data_size;
+	unsigned int digest_size;
+	unsigned int hashes_per_block;
+	unsigned int levels;
+	pgoff_t data_blocks;
+	pgoff_t tree_blocks; /* including the header block */
+	pgoff_t level_start[MERKLE_MAX_LEVELS]; /* first block of each level */
+	pgoff_t level_blocks[MERKLE_MAX_LEVELS];
+};
+
+/* run [first, last] of block indices changed by a write */
+struct merkle_span {
+	pgoff_t first;
+	pgoff_t last;
+};
+
+/* in-memory state of a tree whose root matched at open */
+struct wrapfs_merkle {
+	struct file *tree_file;
+	struct merkle_geometry geo;
+	struct wrapfs_hash_pool *pool;
+	struct wrapfs_hash_ctx *ctx;	/* held while hashing, its buffer holds a data block */
+	unsigned char root[MAXLEN];
+	unsigned long *data_verified;
+	unsigned long *tree_verified;
+	char *node;	/* tree block being verified */
+	char *leaf;	/* last verified level 0 block */
+	pgoff_t leaf_index;
+	struct rcu_head rcu;
+	struct list_head freed;	/* in merkle_freed, once the grace period is over */
+};
+
+/* trees detached from their inode whose grace period is over, see merkle_free_detached */
+static LIST_HEAD(merkle_freed);
+static DEFINE_SPINLOCK(merkle_freed_lock);	/* also taken in the RCU callback */
+
+/* Method to compute the layout of a tree
+ * Input: geometry to fill, size of the data, digest size of the algo
+ * Output: return 0 if the all steps are successful; else return respective -ERRNO
+ */
+static int merkle_geometry(struct merkle_geometry *geo, loff_t size, unsigned int digest_size) {
+	pgoff_t entries;
+	unsigned int level = 0;
+
+	memset(geo, 0, sizeof(*geo));
+	geo->data_size = size;
+	geo->digest_size = digest_size;
+	geo->hashes_per_block = MERKLE_BLOCKSIZE / digest_size;
+	geo->data_blocks = (size + MERKLE_BLOCKSIZE - 1) >> PAGE_SHIFT;
+	geo->tree_blocks = 1;
+
+	entries = geo->data_blocks;
+	while(entries) {
+		if(level == MERKLE_MAX_LEVELS) {
+			printk("merkle_geometry: file is too large for the hash tree\n");
+			return -EFBIG;
+		}
+		geo->level_start[level] = geo->tree_blocks;
+		geo->level_blocks[level] = DIV_ROUND_UP(entries, geo->hashes_per_block);
+		geo->tree_blocks += roundup_pow_of_two(geo->level_blocks[level]);
+		entries = geo->level_blocks[level];
+		level++;
+		if(entries == 1)
+			break;
+	}
+	geo->levels = level;
+
+	return 0;
+}
+
+/* check whether the levels of two trees start at the same blocks */
+static int merkle_same_layout(const struct merkle_geometry *a, const struct merkle_geometry *b) {
+	unsigned int level;
+
+	for(level = 0; level < a->levels && level < b->levels; level++)
+		if(a->level_start[level] != b->level_start[level])
+			return 0;
+	return 1;
+}
+
+/* Method to compute H(prefix || buf)
+ * Input: hash context, optional prefix, buffer, output digest
+ * Output: return 0 if the all steps are successful; else return respective -ERRNO
+ */
+static int merkle_hash(struct wrapfs_hash_ctx *ctx, const void *prefix, unsigned int plen,
+	const void *buf, unsigned int len, unsigned char *out) {
+	struct scatterlist sg[2];
+	int n = 0;
+
+	sg_init_table(sg, 2);
+	if(plen)
+		sg_set_buf(&sg[n++], prefix, plen);
+	if(len)
+		sg_set_buf(&sg[n++], buf, len);
+	if(n)
+		sg_mark_end(&sg[n - 1]);
+
+	return wrapfs_hash_digest(ctx, sg, plen + len, out);
+}
+
+/* root = H(le64 data size || top tree block) */
+static int merkle_hash_root(struct wrapfs_hash_ctx *ctx, loff_t size, const char *top, unsigned char *out) {
+	__le64 lsize = cpu_to_le64(size);
+
+	return merkle_hash(ctx, &lsize, sizeof(lsize), top, top ? MERKLE_BLOCKSIZE : 0, out);
+}
+
+static int merkle_read_block(struct file *filp, pgoff_t block, char *buf) {
+	int bytes;
+
+	bytes = kernel_read(filp, (loff_t)block << PAGE_SHIFT, buf, MERKLE_BLOCKSIZE);
+	if(bytes < 0)
+		return bytes;
+	return bytes == MERKLE_BLOCKSIZE ? 0 : -EIO;
+}
+
+static int merkle_write_block(struct file *filp, pgoff_t block, const char *buf) {
+	mm_segment_t oldfs;
+	loff_t pos = (loff_t)block << PAGE_SHIFT;
+	ssize_t bytes;
+
+	oldfs = get_fs();
+	set_fs(KERNEL_DS);
+	bytes = vfs_write(filp, (const char __user *)buf, MERKLE_BLOCKSIZE, &pos);
+	set_fs(oldfs);
+	if(bytes < 0)
+		return bytes;
+	return bytes == MERKLE_BLOCKSIZE ? 0 : -EIO;
+}
+
+/* leaf digest of data block index of the lower file, hashed straight from its page cache;
+ * a whole block of a hole has the digest of the zero page, which the pool knows already */
+static int merkle_hash_data(struct wrapfs_hash_ctx *ctx, struct file *filp,
+	const struct merkle_geometry *geo, pgoff_t index, unsigned char *out) {
+	loff_t pos = (loff_t)index << PAGE_SHIFT;
+	int retval;
+
+	if(ctx->pool->zero_page_ok && pos + MERKLE_BLOCKSIZE <= geo->data_size &&
+		wrapfs_hash_hole(ctx, filp, pos, MERKLE_BLOCKSIZE)) {
+		memcpy(out, ctx->pool->zero_page_digest, ctx->pool->digest_size);
+		return 0;
+	}
+
+	retval = wrapfs_hash_init(ctx);
+	if(!retval)
+		retval = wrapfs_hash_range(ctx, filp, pos, min_t(loff_t, MERKLE_BLOCKSIZE, geo->data_size - pos));
+	if(!retval)
+		retval = wrapfs_hash_final(ctx, out);
+	return retval;
+}
+
+/* Method to set up the lower directory holding the hash trees, called at mount
+ * Input: wrapfs super block whose s_root is already linked to the lower root
+ * Output: return 0 if the all steps are successful; else return respective -ERRNO
+ * Following are the steps:
+ * 1. look up WRAPFS_SIDECAR_DIR in the lower root
+ * 2. create it if it doesn't exist yet
+ * 3. keep a reference to it in the super block private data
+ */
+int wrapfs_init_sidecar(struct super_block *sb) {
+	struct wrapfs_sb_info *sbi = WRAPFS_SB(sb);
+	const struct cred *old_cred;
+	struct path root;
+	struct dentry *dentry;
+	int retval = 0;
+
+	old_cred = override_creds(sbi->kernel_cred);
+	wrapfs_get_lower_path(sb->s_root, &root);
+	mutex_lock_nested(&root.dentry->d_inode->i_mutex, I_MUTEX_PARENT);
+	dentry = lookup_one_len(WRAPFS_SIDECAR_DIR, root.dentry, strlen(WRAPFS_SIDECAR_DIR));
+	if(IS_ERR(dentry)) {
+		retval = PTR_ERR(dentry);
+		goto unlock_root;
+	}
+
+	if(!dentry->d_inode) {
+		retval = mnt_want_write(root.mnt);
+		if(!retval) {
+			retval = vfs_mkdir(root.dentry->d_inode, dentry, S_IRWXU);
+			mnt_drop_write(root.mnt);
+		}
+	}
+	else if(!S_ISDIR(dentry->d_inode->i_mode))
+		retval = -ENOTDIR;
+
+	if(retval) {
+		dput(dentry);
+		goto unlock_root;
+	}
+
+	sbi->sidecar.dentry = dentry;
+	sbi->sidecar.mnt = mntget(root.mnt);
+
+unlock_root:
+	mutex_unlock(&root.dentry->d_inode->i_mutex);
+	wrapfs_put_lower_path(sb->s_root, &root);
+	revert_creds(old_cred);
+	return retval;
+}
+
+/* Method to get the lower directory holding the hash trees
+ * Input: wrapfs super block, path to fill (caller must path_put it)
+ * Output: return 0 if the all steps are successful; else return respective -ERRNO
+ * Note: the directory is locked with I_MUTEX_XATTR, it is private to wrapfs and
+ * callers may already hold the i_mutex of a parent directory.
+ */
+int wrapfs_sidecar_dir(struct super_block *sb, struct path *dir) {
+	struct wrapfs_sb_info *sbi = WRAPFS_SB(sb);
+
+	if(!sbi->sidecar.dentry)
+		return -EOPNOTSUPP;
+
+	pathcpy(dir, &sbi->sidecar);
+	path_get(dir);
+	return 0;
+}
+
+static void merkle_tree_name(char *name, size_t len, struct inode *lower_inode, int tmp) {
+	snprintf(name, len, "%lu%s", lower_inode->i_ino, tmp ? ".tmp" : "");
+}
+
+/* Method to open the sidecar of a lower inode
+ * Input: wrapfs super block, lower inode, MERKLE_TREE_* mode
+ * Output: opened file or ERR_PTR
+ * Note: the caller has to run with the kernel credentials of the mount
+ */
+static struct file *merkle_open_tree(struct super_block *sb, struct inode *lower_inode, int mode) {
+	struct path dir;
+	struct dentry *dentry;
+	struct file *filp;
+	char name[32];
+	int retval;
+
+	retval = wrapfs_sidecar_dir(sb, &dir);
+	if(retval)
+		return ERR_PTR(retval);
+
+	merkle_tree_name(name, sizeof(name), lower_inode, mode == MERKLE_TREE_CREATE);
+	mutex_lock_nested(&dir.dentry->d_inode->i_mutex, I_MUTEX_XATTR);
+	dentry = lookup_one_len(name, dir.dentry, strlen(name));
+	if(IS_ERR(dentry)) {
+		filp = ERR_CAST(dentry);
+		goto unlock;
+	}
+
+	if(mode == MERKLE_TREE_CREATE) {
+		retval = mnt_want_write(dir.mnt);
+		if(retval)
+			goto dput_out;
+		/* start from scratch if a previous rebuild left its temporary behind */
+		if(dentry->d_inode) {
+			retval = vfs_unlink(dir.dentry->d_inode, dentry);
+			dput(dentry);
+			dentry = NULL;
+			if(!retval) {
+				dentry = lookup_one_len(name, dir.dentry, strlen(name));
+				if(IS_ERR(dentry)) {
+					retval = PTR_ERR(dentry);
+					dentry = NULL;
+				}
+			}
+		}
+		if(!retval)
+			retval = vfs_create(dir.dentry->d_inode, dentry, S_IFREG | S_IRUSR | S_IWUSR, NULL);
+		mnt_drop_write(dir.mnt);
+	}
+	else if(!dentry->d_inode)
+		retval = -ENOENT;
+
+	if(retval)
+		goto dput_out;
+	mutex_unlock(&dir.dentry->d_inode->i_mutex);
+
+	/* dentry_open consumes the references of the dentry and mnt */
+	filp = dentry_open(dentry, mntget(dir.mnt),
+		(mode == MERKLE_TREE_READ ? O_RDONLY : O_RDWR) | O_LARGEFILE, current_cred());
+	path_put(&dir);
+	return filp;
+
+dput_out:
+	filp = ERR_PTR(retval);
+	if(dentry)
+		dput(dentry);
+unlock:
+	mutex_unlock(&dir.dentry->d_inode->i_mutex);
+	path_put(&dir);
+	return filp;
+}
+
+/* Method to move a rebuilt temporary sidecar over the live one */
+static int merkle_publish_tree(struct super_block *sb, struct inode *lower_inode) {
+	struct path dir;
+	struct dentry *old_dentry, *new_dentry;
+	char old_name[32], new_name[32];
+	int retval;
+
+	retval = wrapfs_sidecar_dir(sb, &dir);
+	if(retval)
+		return retval;
+
+	merkle_tree_name(old_name, sizeof(old_name), lower_inode, 1);
+	merkle_tree_name(new_name, sizeof(new_name), lower_inode, 0);
+
+	mutex_lock_nested(&dir.dentry->d_inode->i_mutex, I_MUTEX_XATTR);
+	old_dentry = lookup_one_len(old_name, dir.dentry, strlen(old_name));
+	if(IS_ERR(old_dentry)) {
+		retval = PTR_ERR(old_dentry);
+		goto unlock;
+	}
+	new_dentry = lookup_one_len(new_name, dir.dentry, strlen(new_name));
+	if(IS_ERR(new_dentry)) {
+		retval = PTR_ERR(new_dentry);
+		goto put_old;
+	}
+
+	retval = mnt_want_write(dir.mnt);
+	if(!retval) {
+		retval = vfs_rename(dir.dentry->d_inode, old_dentry, dir.dentry->d_inode, new_dentry);
+		mnt_drop_write(dir.mnt);
+	}
+
+	dput(new_dentry);
+put_old:
+	dput(old_dentry);
+unlock:
+	mutex_unlock(&dir.dentry->d_inode->i_mutex);
+	path_put(&dir);
+	return retval;
+}
+
+/* Method to remove the sidecar of a lower inode, used when the file loses its integrity
+ * Input: wrapfs super block, lower inode
+ * Output: none, a missing sidecar is not an error
+ */
+void merkle_remove_tree(struct super_block *sb, struct inode *lower_inode) {
+	struct wrapfs_sb_info *sbi = WRAPFS_SB(sb);
+	const struct cred *old_cred;
+	struct path dir;
+	struct dentry *dentry;
+	char name[32];
+	int tmp;
+
+	old_cred = override_creds(sbi->kernel_cred);
+	if(wrapfs_sidecar_dir(sb, &dir))
+		goto out;
+
+	mutex_lock_nested(&dir.dentry->d_inode->i_mutex, I_MUTEX_XATTR);
+	for(tmp = 0; tmp <= 1; tmp++) {
+		merkle_tree_name(name, sizeof(name), lower_inode, tmp);
+		dentry = lookup_one_len(name, dir.dentry, strlen(name));
+		if(IS_ERR(dentry))
+			continue;
+		if(dentry->d_inode && !mnt_want_write(dir.mnt)) {
+			vfs_unlink(dir.dentry->d_inode, dentry);
+			mnt_drop_write(dir.mnt);
+		}
+		dput(dentry);
+	}
+	mutex_unlock(&dir.dentry->d_inode->i_mutex);
+	path_put(&dir);
+out:
+	revert_creds(old_cred);
+}
+
+/* Method to write the header describing a tree to block 0 of its sidecar */
+static int merkle_write_header(struct file *tree_file, const struct merkle_geometry *geo,
+	const char *algo, char *buf) {
+	struct merkle_header *header = (struct merkle_header *)buf;
+
+	memset(buf, 0, MERKLE_BLOCKSIZE);
+	header->magic = cpu_to_le32(MERKLE_MAGIC);
+	header->version = cpu_to_le32(MERKLE_VERSION);
+	header->block_size = cpu_to_le32(MERKLE_BLOCKSIZE);
+	header->digest_size = cpu_to_le32(geo->digest_size);
+	header->data_size = cpu_to_le64(geo->data_size);
+	strncpy(header->algo, algo, MAXLEN_ALGO_NAME);
+	return merkle_write_block(tree_file, 0, buf);
+}
+
+/* check the header of a sidecar, the data size it describes is returned in *size */
+static int merkle_check_header(const char *buf, unsigned int digest_size, const char *algo, loff_t *size) {
+	const struct merkle_header *header = (const struct merkle_header *)buf;
+
+	if(le32_to_cpu(header->magic) != MERKLE_MAGIC ||
+		le32_to_cpu(header->version) != MERKLE_VERSION ||
+		le32_to_cpu(header->block_size) != MERKLE_BLOCKSIZE ||
+		le32_to_cpu(header->digest_size) != digest_size ||
+		strncmp(header->algo, algo, MAXLEN_ALGO_NAME))
+		return 0;
+
+	*size = le64_to_cpu(header->data_size);
+	return 1;
+}
+
+/* Method to hash every block of a level and pack the digests into the next level
+ * Input: hash context, geometry, sidecar, level to build, scratch buffers
+ * Output: return 0 if the all steps are successful; else return respective -ERRNO
+ */
+static int merkle_build_level(struct wrapfs_hash_ctx *ctx, const struct merkle_geometry *geo,
+	struct file *tree_file, unsigned int level, char *buf, char *node) {
+	pgoff_t index, count, block;
+	unsigned int slot;
+	int retval = 0;
+
+	count = geo->level_blocks[level - 1];
+	memset(node, 0, MERKLE_BLOCKSIZE);
+	for(index = 0; index < count; index++) {
+		retval = merkle_read_block(tree_file, geo->level_start[level - 1] + index, buf);
+		if(retval)
+			break;
+
+		slot = index % geo->hashes_per_block;
+		retval = merkle_hash(ctx, NULL, 0, buf, MERKLE_BLOCKSIZE, node + slot * geo->digest_size);
+		if(retval)
+			break;
+
+		if(slot == geo->hashes_per_block - 1 || index == count - 1) {
+			block = geo->level_start[level] + index / geo->hashes_per_block;
+			retval = merkle_write_block(tree_file, block, node);
+			if(retval)
+				break;
+			memset(node, 0, MERKLE_BLOCKSIZE);
+		}
+	}
+
+	return retval;
+}
+
+/* Core method to build the hash tree of a file and store it in the sidecar
+ * Input: wrapfs inode, lower_path, inner crypto algo, buffer for the root, size of the buffer
+ * Output: return 0 if the all steps are successful; else return respective -ERRNO,
+ 	*rlen is set to the length of the root
+ * Following are the steps:
+ * 1. allocate the crypto transform and compute the layout of the tree
+ * 2. create a temporary sidecar
+ * 3. hash every data block into level 0, then every level into the next one
+ * 4. compute the root from the top block and write the header
+ * 5. move the temporary sidecar over the live one
+ */
+long merkle_build(struct inode *inode, struct path lower_path, const char *algo,
+	unsigned char *root, unsigned int *rlen) {
+
+	long retval = 0;
+	struct wrapfs_sb_info *sbi = WRAPFS_SB(inode->i_sb);
+	struct inode *lower_inode = lower_path.dentry->d_inode;
+	const struct cred *old_cred;
+	struct merkle_geometry geo;
+	struct wrapfs_hash_pool *pool;
+	struct wrapfs_hash_ctx *ctx;
+	struct file *filp, *tree_file;
+	char *buf, *node;
+	pgoff_t index;
+	unsigned int slot, level;
+
+	pool = wrapfs_hash_pool(inode->i_sb, algo);
+	if(IS_ERR(pool)) {
+		printk("merkle_build: error attempting to allocate crypto context\n");
+		retval = PTR_ERR(pool);
+		goto out;
+	}
+
+	if(pool->digest_size > *rlen) {
+		printk("merkle_build: buf length is too short to store the root\n");
+		retval = -EINVAL;
+		goto out;
+	}
+	*rlen = pool->digest_size;
+
+	/* the in-memory tree of the inode is stale from now on; merkle_mutex is
+	 * taken before the context, the way merkle_verify_range does */
+	merkle_release(inode);
+
+	ctx = wrapfs_get_hash(pool);
+	buf = ctx->buffer;
+
+	retval = merkle_geometry(&geo, i_size_read(lower_inode), *rlen);
+	if(retval)
+		goto free_hash;
+
+	/* an empty file has no tree, the root only covers the size */
+	if(!geo.levels) {
+		retval = merkle_hash_root(ctx, 0, NULL, root);
+		merkle_remove_tree(inode->i_sb, lower_inode);
+		goto free_hash;
+	}
+
+	node = kzalloc(MERKLE_BLOCKSIZE, GFP_KERNEL);
+	if(!node) {
+		printk("merkle_build: out of memory for buffers\n");
+		retval = -ENOMEM;
+		goto free_buf;
+	}
+
+	path_get(&lower_path);
+	filp = dentry_open(lower_path.dentry, lower_path.mnt, O_RDONLY | O_LARGEFILE, current_cred());
+	if(IS_ERR(filp)) {
+		printk("merkle_build: cannot open the file in O_RDONLY mode\n");
+		retval = PTR_ERR(filp);
+		goto free_buf;
+	}
+	wrapfs_hash_readahead(filp);
+
+	old_cred = override_creds(sbi->kernel_cred);
+	tree_file = merkle_open_tree(inode->i_sb, lower_inode, MERKLE_TREE_CREATE);
+	revert_creds(old_cred);
+	if(IS_ERR(tree_file)) {
+		printk("merkle_build: cannot create the sidecar\n");
+		retval = PTR_ERR(tree_file);
+		goto put_filp;
+	}
+
+	/* level 0: digests of the data blocks */
+	for(index = 0; index < geo.data_blocks; index++) {
+		slot = index % geo.hashes_per_block;
+		retval = merkle_hash_data(ctx, filp, &geo, index, node + slot * geo.digest_size);
+		if(retval)
+			goto put_tree;
+
+		if(slot == geo.hashes_per_block - 1 || index == geo.data_blocks - 1) {
+			retval = merkle_write_block(tree_file, geo.level_start[0] + index / geo.hashes_per_block, node);
+			if(retval)
+				goto put_tree;
+			memset(node, 0, MERKLE_BLOCKSIZE);
+		}
+	}
+
+	/* higher levels: digests of the tree blocks below */
+	for(level = 1; level < geo.levels; level++) {
+		retval = merkle_build_level(ctx, &geo, tree_file, level, buf, node);
+		if(retval)
+			goto put_tree;
+	}
+
+	retval = merkle_read_block(tree_file, geo.level_start[geo.levels - 1], node);
+	if(retval)
+		goto put_tree;
+	retval = merkle_hash_root(ctx, geo.data_size, node, root);
+	if(retval)
+		goto put_tree;
+
+	retval = merkle_write_header(tree_file, &geo, algo, buf);
+	if(retval)
+		goto put_tree;
+
+	retval = vfs_fsync(tree_file, 0);
+	if(retval)
+		goto put_tree;
+
+	old_cred = override_creds(sbi->kernel_cred);
+	retval = merkle_publish_tree(inode->i_sb, lower_inode);
+	revert_creds(old_cred);
+
+put_tree:
+	fput(tree_file);
+put_filp:
+	fput(filp);
+free_buf:
+	kfree(node);
+free_hash:
+	wrapfs_put_hash(ctx);
+out:
+	if(retval)
+		printk("merkle_build: cannot build the hash tree, err=%ld\n", retval);
+	return retval;
+}
+
+static void merkle_free(struct wrapfs_merkle *m) {
+	if(!m)
+		return;
+	if(m->tree_file)
+		fput(m->tree_file);
+	if(m->ctx)
+		wrapfs_put_hash(m->ctx);
+	vfree(m->data_verified);
+	vfree(m->tree_verified);
+	kfree(m->node);
+	kfree(m->leaf);
+	kfree(m);
+}
+
+static void merkle_free_work(struct work_struct *work) {
+	struct wrapfs_merkle *m, *next;
+	unsigned long flags;
+	LIST_HEAD(list);
+
+	spin_lock_irqsave(&merkle_freed_lock, flags);
+	list_splice_init(&merkle_freed, &list);
+	spin_unlock_irqrestore(&merkle_freed_lock, flags);
+
+	list_for_each_entry_safe(m, next, &list, freed)
+		merkle_free(m);
+}
+
+static DECLARE_WORK(merkle_freed_work, merkle_free_work);
+
+static void merkle_free_rcu(struct rcu_head *rcu) {
+	struct wrapfs_merkle *m = container_of(rcu, struct wrapfs_merkle, rcu);
+	unsigned long flags;
+
+	spin_lock_irqsave(&merkle_freed_lock, flags);
+	list_add_tail(&m->freed, &merkle_freed);
+	spin_unlock_irqrestore(&merkle_freed_lock, flags);
+	schedule_work(&merkle_freed_work);
+}
+
+/* free a tree that was attached to an inode, merkle_verify_range may still look at it without the lock */
+static void merkle_free_detached(struct wrapfs_merkle *m) {
+	if(m)
+		call_rcu(&m->rcu, merkle_free_rcu);
+}
+
+/* Method to wait until the trees detached so far are freed, called at unmount */
+void merkle_flush_freed(void) {
+	rcu_barrier();
+	flush_work_sync(&merkle_freed_work);
+}
+
+/* Method to drop the in-memory tree of an inode, used when its data changes or it is evicted */
+void merkle_release(struct inode *inode) {
+	struct wrapfs_inode_info *info = WRAPFS_I(inode);
+	struct wrapfs_merkle *m;
+
+	mutex_lock(&info->merkle_mutex);
+	m = info->merkle;
+	rcu_assign_pointer(info->merkle, NULL);
+	mutex_unlock(&info->merkle_mutex);
+
+	merkle_free_detached(m);
+}
+
+/* Method to check the root of a file at open and keep the tree for the reads
+ * Input: wrapfs inode, lower_path, inner crypto algo, stored root, length of the stored root
+ * Output: return 1 if the root matches, -EPERM if it doesn't; else return respective -ERRNO
+ * Following are the steps:
+ * 1. compute the layout of the tree from the current file size
+ * 2. open the sidecar and validate its header
+ * 3. hash the top tree block together with the size and compare it against the root
+ * 4. attach the tree to the inode, no data block has been verified yet
+ */
+int merkle_open(struct inode *inode, struct path lower_path, const char *algo,
+	unsigned char *root, unsigned int rlen) {
+
+	int retval = 0;
+	struct wrapfs_inode_info *info = WRAPFS_I(inode);
+	struct wrapfs_sb_info *sbi = WRAPFS_SB(inode->i_sb);
+	struct wrapfs_merkle *m, *old;
+	const struct cred *old_cred;
+	unsigned char digest[MAXLEN];
+	unsigned int digest_size;
+	loff_t size;
+
+	m = kzalloc(sizeof(*m), GFP_KERNEL);
+	if(!m) {
+		printk("merkle_open: out of memory for tree\n");
+		return -ENOMEM;
+	}
+	m->leaf_index = ULONG_MAX;
+
+	m->pool = wrapfs_hash_pool(inode->i_sb, algo);
+	if(IS_ERR(m->pool)) {
+		printk("merkle_open: error attempting to allocate crypto context\n");
+		retval = PTR_ERR(m->pool);
+		goto out_free;
+	}
+
+	digest_size = m->pool->digest_size;
+	if(digest_size != rlen) {
+		printk("merkle_open: stored root has length %u, expected %u\n", rlen, digest_size);
+		retval = -EPERM;
+		goto out_free;
+	}
+	memcpy(m->root, root, rlen);
+	m->ctx = wrapfs_get_hash(m->pool);
+
+	retval = merkle_geometry(&m->geo, i_size_read(lower_path.dentry->d_inode), digest_size);
+	if(retval)
+		goto out_free;
+
+	if(!m->geo.levels) {
+		retval = merkle_hash_root(m->ctx, 0, NULL, digest);
+		if(retval)
+			goto out_free;
+		goto compare;
+	}
+
+	m->node = kmalloc(MERKLE_BLOCKSIZE, GFP_KERNEL);
+	m->leaf = kmalloc(MERKLE_BLOCKSIZE, GFP_KERNEL);
+	m->data_verified = vzalloc(BITS_TO_LONGS(m->geo.data_blocks) * sizeof(long));
+	m->tree_verified = vzalloc(BITS_TO_LONGS(m->geo.tree_blocks) * sizeof(long));
+	if(!m->node || !m->leaf || !m->data_verified || !m->tree_verified) {
+		printk("merkle_open: out of memory for buffers\n");
+		retval = -ENOMEM;
+		goto out_free;
+	}
+
+	old_cred = override_creds(sbi->kernel_cred);
+	m->tree_file = merkle_open_tree(inode->i_sb, lower_path.dentry->d_inode, MERKLE_TREE_READ);
+	revert_creds(old_cred);
+	if(IS_ERR(m->tree_file)) {
+		printk("merkle_open: cannot open the sidecar\n");
+		retval = PTR_ERR(m->tree_file) == -ENOENT ? -EPERM : PTR_ERR(m->tree_file);
+		m->tree_file = NULL;
+		goto out_free;
+	}
+
+	retval = merkle_read_block(m->tree_file, 0, m->node);
+	if(retval)
+		goto out_mismatch;
+	if(!merkle_check_header(m->node, digest_size, algo, &size) || size != m->geo.data_size) {
+		printk("merkle_open: sidecar doesn't describe the current file\n");
+		goto out_mismatch;
+	}
+
+	retval = merkle_read_block(m->tree_file, m->geo.level_start[m->geo.levels - 1], m->node);
+	if(retval)
+		goto out_mismatch;
+	retval = merkle_hash_root(m->ctx, m->geo.data_size, m->node, digest);
+	if(retval)
+		goto out_free;
+	set_bit(m->geo.level_start[m->geo.levels - 1], m->tree_verified);
+
+compare:
+	if(!compare_integrity(digest, m->root, digest_size))
+		goto out_mismatch;
+
+	/* reads take a context of the pool only while they hash */
+	wrapfs_put_hash(m->ctx);
+	m->ctx = NULL;
+
+	mutex_lock(&info->merkle_mutex);
+	old = info->merkle;
+	rcu_assign_pointer(info->merkle, m);
+	mutex_unlock(&info->merkle_mutex);
+	merkle_free_detached(old);
+	return 1;
+
+out_mismatch:
+	retval = -EPERM;
+out_free:
+	merkle_free(m);
+	return retval;
+}
+
+/* Method to read tree block index of a level into out, checked against the root
+ * Following are the steps:
+ * 1. walk up from the block to the lowest ancestor whose parent is verified
+ * 2. walk down again, checking every block against the digest in its parent
+ */
+static int merkle_load_node(struct wrapfs_merkle *m, unsigned int level, pgoff_t block, char *out) {
+	struct merkle_geometry *geo = &m->geo;
+	unsigned char expected[MAXLEN];
+	pgoff_t index[MERKLE_MAX_LEVELS];
+	unsigned int l, start, top = geo->levels - 1;
+	unsigned char digest[MAXLEN];
+	char *buf;
+	int retval;
+
+	index[level] = block;
+	for(l = level + 1; l <= top; l++)
+		index[l] = index[l - 1] / geo->hashes_per_block;
+
+	start = level;
+	while(start < top && !test_bit(geo->level_start[start] + index[start], m->tree_verified) &&
+		!test_bit(geo->level_start[start + 1] + index[start + 1], m->tree_verified))
+		start++;
+
+	if(start < top && !test_bit(geo->level_start[start] + index[start], m->tree_verified)) {
+		retval = merkle_read_block(m->tree_file, geo->level_start[start + 1] + index[start + 1], m->node);
+		if(retval)
+			return retval;
+		memcpy(expected, m->node + (index[start] % geo->hashes_per_block) * geo->digest_size,
+			geo->digest_size);
+	}
+
+	for(l = start; ; l--) {
+		buf = l == level ? out : m->node;
+		retval = merkle_read_block(m->tree_file, geo->level_start[l] + index[l], buf);
+		if(retval)
+			return retval;
+
+		if(!test_bit(geo->level_start[l] + index[l], m->tree_verified)) {
+			if(l == top)
+				retval = merkle_hash_root(m->ctx, geo->data_size, buf, digest);
+			else
+				retval = merkle_hash(m->ctx, NULL, 0, buf, MERKLE_BLOCKSIZE, digest);
+			if(retval)
+				return retval;
+			if(!compare_integrity(digest, l == top ? m->root : expected, geo->digest_size)) {
+				printk("merkle_load_node: tree block %lu of level %u is corrupted\n",
+					index[l], l);
+				return -EPERM;
+			}
+			set_bit(geo->level_start[l] + index[l], m->tree_verified);
+		}
+
+		if(l == level)
+			break;
+		memcpy(expected, buf + (index[l - 1] % geo->hashes_per_block) * geo->digest_size,
+			geo->digest_size);
+	}
+
+	return 0;
+}
+
+/* Method to make m->leaf hold the verified level 0 tree block leaf_index */
+static int merkle_load_leaf(struct wrapfs_merkle *m, pgoff_t leaf_index) {
+	int retval;
+
+	if(m->leaf_index == leaf_index)
+		return 0;
+	m->leaf_index = ULONG_MAX;
+
+	retval = merkle_load_node(m, 0, leaf_index, m->leaf);
+	if(!retval)
+		m->leaf_index = leaf_index;
+	return retval;
+}
+
+/* Method to check the data blocks covering a read against the tree
+ * Input: wrapfs inode, lower file to read the blocks from, position and length of the read
+ * Output: return 0 if every block matches or the inode has no tree, -EPERM if a block
+ 	doesn't match; else return respective -ERRNO
+ * Following are the steps:
+ * 1. without the lock, return if the blocks are all in data_verified already
+ * 2. else take merkle_mutex and hash every block that is not, checking it up the tree
+ */
+int merkle_verify_range(struct inode *inode, struct file *lower_file, loff_t pos, size_t count) {
+	struct wrapfs_inode_info *info = WRAPFS_I(inode);
+	struct wrapfs_merkle *m;
+	unsigned char digest[MAXLEN];
+	pgoff_t index, last;
+	loff_t end;
+	int retval = 0, verified;
+
+	if(!count)
+		return 0;
+
+	/* a read of blocks read before doesn't touch the lock */
+	rcu_read_lock();
+	m = rcu_dereference(info->merkle);
+	verified = !m;
+	if(m && i_size_read(lower_file->f_path.dentry->d_inode) == m->geo.data_size) {
+		end = min_t(loff_t, pos + count, m->geo.data_size);
+		verified = pos >= end || find_next_zero_bit(m->data_verified, ((end - 1) >> PAGE_SHIFT) + 1,
+			pos >> PAGE_SHIFT) > (end - 1) >> PAGE_SHIFT;
+	}
+	rcu_read_unlock();
+	if(verified)
+		return 0;
+
+	mutex_lock(&info->merkle_mutex);
+	m = info->merkle;
+	if(!m)
+		goto out;
+
+	/* the file changed below us since the root was checked */
+	if(i_size_read(lower_file->f_path.dentry->d_inode) != m->geo.data_size) {
+		printk("merkle_verify_range: file size doesn't match the hash tree\n");
+		retval = -EPERM;
+		goto out;
+	}
+
+	end = min_t(loff_t, pos + count, m->geo.data_size);
+	if(pos >= end)
+		goto out;
+
+	last = (end - 1) >> PAGE_SHIFT;
+	for(index = pos >> PAGE_SHIFT; index <= last; index++) {
+		if(test_bit(index, m->data_verified))
+			continue;
+
+		/* reads of verified blocks don't need a context at all */
+		if(!m->ctx)
+			m->ctx = wrapfs_get_hash(m->pool);
+
+		retval = merkle_load_leaf(m, index / m->geo.hashes_per_block);
+		if(retval)
+			break;
+
+		retval = merkle_hash_data(m->ctx, lower_file, &m->geo, index, digest);
+		if(retval)
+			break;
+
+		if(!compare_integrity(digest, m->leaf + (index % m->geo.hashes_per_block) * m->geo.digest_size,
+			m->geo.digest_size)) {
+			printk("merkle_verify_range: data block %lu is corrupted\n", index);
+			retval = -EPERM;
+			break;
+		}
+		set_bit(index, m->data_verified);
+	}
+
+out:
+	if(m && m->ctx) {
+		wrapfs_put_hash(m->ctx);
+		m->ctx = NULL;
+	}
+	mutex_unlock(&info->merkle_mutex);
+	return retval;
+}
+
+/* Method to add the run [first, last] to a sorted array of runs, merging the ones it touches
+ * The array must have room for one more run.
+ */
+static void merkle_insert_span(struct merkle_span *spans, unsigned int *nr, pgoff_t first, pgoff_t last) {
+	unsigned int i, j;
+
+	for(i = 0; i < *nr && spans[i].last + 1 < first; i++)
+		;
+	for(j = i; j < *nr && spans[j].first <= last + 1; j++) {
+		first = min(first, spans[j].first);
+		last = max(last, spans[j].last);
+	}
+
+	memmove(&spans[i + 1], &spans[j], (*nr - j) * sizeof(*spans));
+	spans[i].first = first;
+	spans[i].last = last;
+	*nr = *nr - (j - i) + 1;
+}
+
+/* add the data blocks covering bytes [start, end) that are still in the file */
+static void merkle_insert_range(struct merkle_span *spans, unsigned int *nr, loff_t start, loff_t end,
+	const struct merkle_geometry *geo) {
+	end = min(end, geo->data_size);
+	if(start >= end)
+		return;
+	merkle_insert_span(spans, nr, start >> PAGE_SHIFT, (end - 1) >> PAGE_SHIFT);
+}
+
+static int merkle_span_contains(const struct merkle_span *spans, unsigned int nr, pgoff_t index) {
+	unsigned int i;
+
+	for(i = 0; i < nr; i++)
+		if(index >= spans[i].first && index <= spans[i].last)
+			return 1;
+	return 0;
+}
+
+/* Method to rehash the changed blocks of one level of a tree being updated
+ * Input: state of the old tree, geometry for the new size, level to update, lower file,
+ 	changed blocks of the level below (data blocks for level 0), changed blocks of this level
+ * Output: return 0 if the all steps are successful; else return respective -ERRNO
+ * A block that is in the old tree is checked against it first and only the slots of the changed
+ * children are rehashed. A block that is new is hashed from all of its children, which are new
+ * as well apart from the old top block that was checked against the root. When the file shrank
+ * the slots past the last child are cleared, as merkle_build leaves them.
+ */
+static int merkle_update_level(struct wrapfs_merkle *m, const struct merkle_geometry *geo,
+	unsigned int level, struct file *filp, const struct merkle_span *children, unsigned int nr_children,
+	const struct merkle_span *blocks, unsigned int nr_blocks) {
+
+	pgoff_t index, child, first, last, count;
+	unsigned char *slot;
+	unsigned int i;
+	int existing, retval = 0;
+
+	count = level ? geo->level_blocks[level - 1] : geo->data_blocks;
+	for(i = 0; i < nr_blocks; i++) {
+		for(index = blocks[i].first; index <= blocks[i].last; index++) {
+			existing = level < m->geo.levels && index < m->geo.level_blocks[level];
+			if(existing) {
+				retval = merkle_load_node(m, level, index, m->leaf);
+				if(retval)
+					return retval;
+			}
+			else
+				memset(m->leaf, 0, MERKLE_BLOCKSIZE);
+
+			first = index * geo->hashes_per_block;
+			last = min_t(pgoff_t, first + geo->hashes_per_block, count) - 1;
+			for(child = first; child <= last; child++) {
+				if(existing && !merkle_span_contains(children, nr_children, child))
+					continue;
+
+				slot = m->leaf + (child - first) * geo->digest_size;
+				if(level) {
+					retval = merkle_read_block(m->tree_file, geo->level_start[level - 1] + child,
+						m->ctx->buffer);
+					if(!retval)
+						retval = merkle_hash(m->ctx, NULL, 0, m->ctx->buffer, MERKLE_BLOCKSIZE, slot);
+				}
+				else
+					retval = merkle_hash_data(m->ctx, filp, geo, child, slot);
+				if(retval)
+					return retval;
+			}
+
+			/* the old children past the new end still have their digests in the block */
+			if(existing && geo->data_size < m->geo.data_size)
+				memset(m->leaf + (last - first + 1) * geo->digest_size, 0,
+					MERKLE_BLOCKSIZE - (last - first + 1) * geo->digest_size);
+
+			retval = merkle_write_block(m->tree_file, geo->level_start[level] + index, m->leaf);
+			if(retval)
+				return retval;
+		}
+	}
+
+	return 0;
+}
+
+/* Core method to update the hash tree of a file in place after parts of it were written
+ * Input: wrapfs inode, lower_path, inner crypto algo, written byte ranges (sorted), buffer holding
+ 	the saved root on input and the new root on output, length of the root
+ * Output: return 0 if the all steps are successful, -EAGAIN if the tree has to be rebuilt
+ 	with merkle_build; else return respective -ERRNO
+ * Following are the steps:
+ * 1. open the live sidecar, check its header and its top block against the saved root
+ * 2. compute the layout for the current size, the levels must not have moved
+ * 3. turn the written ranges, and the blocks changed by a new size, into runs of data blocks
+ * 4. for every level, rehash the changed children of each changed block; every old tree block
+ 	is checked against the old root before it is changed, so the untouched digests are trusted
+ * 5. compute the new root from the top block and write the header
+ * The cost is a few tree blocks per level for each written range, not the size of the file.
+ */
+long merkle_update(struct inode *inode, struct path lower_path, const char *algo,
+	struct list_head *dirty, unsigned char *root, unsigned int *rlen) {
+
+	long retval = 0;
+	struct wrapfs_sb_info *sbi = WRAPFS_SB(inode->i_sb);
+	struct inode *lower_inode = lower_path.dentry->d_inode;
+	struct wrapfs_dirty_range *range;
+	struct merkle_geometry geo;
+	struct merkle_span *spans = NULL, *parents = NULL;
+	struct wrapfs_merkle *m;
+	const struct cred *old_cred;
+	struct file *filp;
+	unsigned char digest[MAXLEN];
+	unsigned int nr_ranges = 1, nr_spans = 0, nr_parents, digest_size, level, i;
+	loff_t old_size;
+
+	/* the in-memory tree of the inode is stale from now on */
+	merkle_release(inode);
+
+	m = kzalloc(sizeof(*m), GFP_KERNEL);
+	if(!m) {
+		printk("merkle_update: out of memory for tree\n");
+		return -ENOMEM;
+	}
+	m->leaf_index = ULONG_MAX;
+
+	m->pool = wrapfs_hash_pool(inode->i_sb, algo);
+	if(IS_ERR(m->pool)) {
+		printk("merkle_update: error attempting to allocate crypto context\n");
+		retval = PTR_ERR(m->pool);
+		goto out_free;
+	}
+
+	/* a root of another algo can't be updated */
+	digest_size = m->pool->digest_size;
+	if(digest_size != *rlen) {
+		retval = -EAGAIN;
+		goto out_free;
+	}
+	memcpy(m->root, root, *rlen);
+	m->ctx = wrapfs_get_hash(m->pool);
+
+	m->node = kmalloc(MERKLE_BLOCKSIZE, GFP_KERNEL);
+	m->leaf = kmalloc(MERKLE_BLOCKSIZE, GFP_KERNEL);
+	if(!m->node || !m->leaf) {
+		printk("merkle_update: out of memory for buffers\n");
+		retval = -ENOMEM;
+		goto out_free;
+	}
+
+	old_cred = override_creds(sbi->kernel_cred);
+	m->tree_file = merkle_open_tree(inode->i_sb, lower_inode, MERKLE_TREE_WRITE);
+	revert_creds(old_cred);
+	if(IS_ERR(m->tree_file)) {
+		/* e.g. the file was empty and has no sidecar yet */
+		m->tree_file = NULL;
+		retval = -EAGAIN;
+		goto out_free;
+	}
+
+	retval = merkle_read_block(m->tree_file, 0, m->ctx->buffer);
+	if(retval || !merkle_check_header(m->ctx->buffer, digest_size, algo, &old_size)) {
+		retval = -EAGAIN;
+		goto out_free;
+	}
+
+	retval = merkle_geometry(&m->geo, old_size, digest_size);
+	if(retval || !m->geo.levels) {
+		retval = -EAGAIN;
+		goto out_free;
+	}
+	retval = merkle_geometry(&geo, i_size_read(lower_inode), digest_size);
+	if(retval)
+		goto out_free;
+	if(!geo.levels || !merkle_same_layout(&m->geo, &geo)) {
+		retval = -EAGAIN;
+		goto out_free;
+	}
+
+	m->tree_verified = vzalloc(BITS_TO_LONGS(m->geo.tree_blocks) * sizeof(long));
+	if(!m->tree_verified) {
+		printk("merkle_update: out of memory for buffers\n");
+		retval = -ENOMEM;
+		goto out_free;
+	}
+
+	/* nothing of the old tree is reused unless it matches the saved root */
+	retval = merkle_read_block(m->tree_file, m->geo.level_start[m->geo.levels - 1], m->node);
+	if(retval) {
+		retval = -EAGAIN;
+		goto out_free;
+	}
+	retval = merkle_hash_root(m->ctx, m->geo.data_size, m->node, digest);
+	if(retval)
+		goto out_free;
+	if(!compare_integrity(digest, m->root, digest_size)) {
+		printk("merkle_update: hash tree doesn't match the saved root, rebuilding it\n");
+		retval = -EAGAIN;
+		goto out_free;
+	}
+	set_bit(m->geo.level_start[m->geo.levels - 1], m->tree_verified);
+
+	/* one run per written range, plus one for the blocks around the old and new eof */
+	list_for_each_entry(range, dirty, list)
+		nr_ranges++;
+	spans = kmalloc(nr_ranges * sizeof(*spans), GFP_KERNEL);
+	parents = kmalloc(nr_ranges * sizeof(*parents), GFP_KERNEL);
+	if(!spans || !parents) {
+		printk("merkle_update: out of memory for buffers\n");
+		retval = -ENOMEM;
+		goto out_free;
+	}
+
+	list_for_each_entry(range, dirty, list)
+		merkle_insert_range(spans, &nr_spans, range->start, range->end, &geo);
+	/* the old last block was extended or the new last block was cut */
+	if(old_size != geo.data_size)
+		merkle_insert_range(spans, &nr_spans, min(old_size, geo.data_size) ?
+			min(old_size, geo.data_size) - 1 : 0, max(old_size, geo.data_size), &geo);
+
+	path_get(&lower_path);
+	filp = dentry_open(lower_path.dentry, lower_path.mnt, O_RDONLY | O_LARGEFILE, current_cred());
+	if(IS_ERR(filp)) {
+		printk("merkle_update: cannot open the file in O_RDONLY mode\n");
+		retval = PTR_ERR(filp);
+		goto out_free;
+	}
+	wrapfs_hash_readahead(filp);
+
+	/* spans holds the changed blocks of the level below, parents those of the level */
+	for(level = 0; level < geo.levels; level++) {
+		nr_parents = 0;
+		for(i = 0; i < nr_spans; i++)
+			merkle_insert_span(parents, &nr_parents, spans[i].first / geo.hashes_per_block,
+				spans[i].last / geo.hashes_per_block);
+
+		retval = merkle_update_level(m, &geo, level, filp, spans, nr_spans, parents, nr_parents);
+		if(retval)
+			goto put_filp;
+
+		swap(spans, parents);
+		nr_spans = nr_parents;
+	}
+
+	retval = merkle_read_block(m->tree_file, geo.level_start[geo.levels - 1], m->node);
+	if(retval)
+		goto put_filp;
+	retval = merkle_hash_root(m->ctx, geo.data_size, m->node, root);
+	if(retval)
+		goto put_filp;
+
+	retval = merkle_write_header(m->tree_file, &geo, algo, m->ctx->buffer);
+	if(retval)
+		goto put_filp;
+	retval = vfs_fsync(m->tree_file, 0);
+
+put_filp:
+	fput(filp);
+out_free:
+	kfree(parents);
+	kfree(spans);
+	merkle_free(m);
+	if(retval && retval != -EAGAIN)
+		printk("merkle_update: cannot update the hash tree, err=%ld\n", retval);
+	return retval;
+}
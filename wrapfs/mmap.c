@@ -24,6 +24,17 @@ static int wrapfs_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
 	BUG_ON(!lower_vm_ops);
 
 	lower_file = wrapfs_lower_file(file);
+
+	/* verify=first-read checks the file on its first fault as well */
+	if (wrapfs_verify_read(file->f_path.dentry->d_inode, lower_file))
+		return VM_FAULT_SIGBUS;
+
+	/* blocks of a merkle protected file are checked on their first fault */
+	if (WRAPFS_I(file->f_path.dentry->d_inode)->merkle &&
+	    merkle_verify_range(file->f_path.dentry->d_inode, lower_file,
+				(loff_t)vmf->pgoff << PAGE_SHIFT, PAGE_SIZE))
+		return VM_FAULT_SIGBUS;
+
 	/*
 	 * XXX: vm_ops->fault may be called in parallel.  Because we have to
 	 * resort to temporarily changing the vma->vm_file to point to the
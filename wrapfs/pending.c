@@ -0,0 +1,438 @@
+/*
+ * This file contains the crash-safe markers of the files being written.
+ *
+ * What was written to a file since its integrity_val was last updated is only
+ * known in memory, in the dirty ranges of its wrapfs inode. After a crash the
+ * files that were being written are left with a stale integrity_val and fail
+ * every open, and the only way to find them was to rehash the whole tree.
+ *
+ * Before a protected file is first changed, an empty marker is created for it
+ * in the WRAPFS_PENDING_DIR directory of the sidecar store and synced. It is
+ * removed once the integrity_val has been updated and nobody has the file
+ * open for writing anymore. At mount every marker left behind queues a rehash
+ * of its file, the same rehash a release does with rehash=deferred, so that
+ * recovery takes as long as the number of files that were being written, not
+ * the size of the tree, and happens in the background. An open of one of these
+ * files meanwhile waits for it or goes ahead unchecked, as pending= says.
+ *
+ * A marker is named after the file handle exportfs gives for the lower inode,
+ * the type and then the handle in hex, e.g. "1-0c000000a2e1f05b".
+ */
+
+#include "wrapfs.h"
+
+/* longest file handle a marker is made for, in 32-bit words */
+#define PENDING_FH_WORDS 24
+
+/* a file being recovered, its inode is held until its rehash is done */
+struct pending_recover {
+	struct list_head list;
+	struct inode *inode;
+};
+
+/* a marker found at mount */
+struct pending_entry {
+	struct list_head list;
+	char name[0];
+};
+
+/* Method to get the name of the marker of a lower file
+ * Input: lower dentry, buffer for the name and its size
+ * Output: return 0 if the all steps are successful; else return -EOVERFLOW if the handle
+ 	of the file is too long for a name
+ */
+static int pending_name(struct dentry *lower_dentry, char *name, size_t size) {
+	u32 fh[PENDING_FH_WORDS];
+	int len = PENDING_FH_WORDS;
+	int type, i, n;
+	u8 *p = (u8 *)fh;
+
+	type = exportfs_encode_fh(lower_dentry, (struct fid *)fh, &len, 0);
+	/* 255 is what encode_fh returns when the handle doesn't fit */
+	if(type < 0 || type == 255 || len > PENDING_FH_WORDS)
+		return -EOVERFLOW;
+
+	n = snprintf(name, size, "%d-", type);
+	for(i = 0; i < len * 4 && n + 2 < size; i++)
+		n += snprintf(name + n, size - n, "%02x", p[i]);
+	return i == len * 4 ? 0 : -EOVERFLOW;
+}
+
+/* Method to read a marker name back into a file handle
+ * Input: name, where to put the handle, its length in words and its type
+ * Output: return 0 if the name is a marker; else return -EINVAL
+ */
+static int pending_parse(const char *name, u32 *fh, int *len, int *type) {
+	u8 *p = (u8 *)fh;
+	const char *hex;
+	int i, hi, lo;
+
+	hex = strchr(name, '-');
+	if(!hex || sscanf(name, "%d-", type) != 1)
+		return -EINVAL;
+	hex++;
+	if(!*hex || strlen(hex) % 8 || strlen(hex) / 8 > PENDING_FH_WORDS)
+		return -EINVAL;
+
+	*len = strlen(hex) / 8;
+	for(i = 0; i < *len * 4; i++) {
+		hi = hex_to_bin(hex[2 * i]);
+		lo = hex_to_bin(hex[2 * i + 1]);
+		if(hi < 0 || lo < 0)
+			return -EINVAL;
+		p[i] = (hi << 4) | lo;
+	}
+	return 0;
+}
+
+/* Method to create a marker and make it durable
+ * Input: wrapfs super block, name of the marker
+ * Output: return 0 if the all steps are successful; else return respective -ERRNO
+ * Note: the caller has to run with the kernel credentials of the mount
+ */
+static int pending_create(struct super_block *sb, const char *name) {
+	struct wrapfs_sb_info *sbi = WRAPFS_SB(sb);
+	struct path *dir = &sbi->pending_dir;
+	struct dentry *dentry;
+	struct file *filp;
+	int retval = 0;
+
+	mutex_lock_nested(&dir->dentry->d_inode->i_mutex, I_MUTEX_XATTR);
+	dentry = lookup_one_len(name, dir->dentry, strlen(name));
+	if(IS_ERR(dentry)) {
+		mutex_unlock(&dir->dentry->d_inode->i_mutex);
+		return PTR_ERR(dentry);
+	}
+	if(!dentry->d_inode) {
+		retval = mnt_want_write(dir->mnt);
+		if(!retval) {
+			retval = vfs_create(dir->dentry->d_inode, dentry, S_IFREG | S_IRUSR, NULL);
+			mnt_drop_write(dir->mnt);
+		}
+	}
+	mutex_unlock(&dir->dentry->d_inode->i_mutex);
+	if(retval) {
+		dput(dentry);
+		return retval;
+	}
+
+	/* the write can reach the disk before a marker that is only in the journal */
+	filp = dentry_open(dentry, mntget(dir->mnt), O_RDONLY, current_cred());
+	if(IS_ERR(filp))
+		return PTR_ERR(filp);
+	retval = vfs_fsync(filp, 0);
+	fput(filp);
+	return retval;
+}
+
+/* Method to remove a marker, a missing one is not an error
+ * Note: the caller has to run with the kernel credentials of the mount
+ */
+static void pending_remove(struct super_block *sb, const char *name) {
+	struct wrapfs_sb_info *sbi = WRAPFS_SB(sb);
+	struct path *dir = &sbi->pending_dir;
+	struct dentry *dentry;
+
+	mutex_lock_nested(&dir->dentry->d_inode->i_mutex, I_MUTEX_XATTR);
+	dentry = lookup_one_len(name, dir->dentry, strlen(name));
+	if(!IS_ERR(dentry)) {
+		if(dentry->d_inode && !mnt_want_write(dir->mnt)) {
+			vfs_unlink(dir->dentry->d_inode, dentry);
+			mnt_drop_write(dir->mnt);
+		}
+		dput(dentry);
+	}
+	mutex_unlock(&dir->dentry->d_inode->i_mutex);
+}
+
+/* Method to make sure a protected file has its marker before it is changed
+ * Input: wrapfs inode, lower path of the file
+ * Output: none, a file whose marker can't be created is changed all the same
+ * Following are the steps:
+ * 1. nothing to do if the marker is there already, couldn't be created for the writes going
+ 	on or the file is not protected
+ * 2. create the marker as the kernel and sync it
+ * 3. if that fails, warn once and don't try again until the integrity_val is up to date,
+ 	see wrapfs_clear_pending
+ * Must be called before the lower file is written, truncated or mapped for writing.
+ */
+void wrapfs_mark_pending(struct inode *inode, struct path *lower_path) {
+	struct wrapfs_sb_info *sbi = WRAPFS_SB(inode->i_sb);
+	struct wrapfs_inode_info *info = WRAPFS_I(inode);
+	const struct cred *old_cred;
+	char name[WRAPFS_PENDING_NAMELEN];
+	int retval;
+
+	if(!sbi->pending_dir.dentry)
+		return;
+
+	/* pairs with the barrier in wrapfs_clear_pending */
+	smp_mb();
+	if(ACCESS_ONCE(info->pending_marker) || ACCESS_ONCE(info->pending_failed))
+		return;
+	if(has_integrity(inode, *lower_path) != 1)
+		return;
+
+	mutex_lock(&info->pending_mutex);
+	if(info->pending_marker || info->pending_failed)
+		goto unlock;
+
+	retval = pending_name(lower_path->dentry, name, sizeof(name));
+	if(!retval) {
+		old_cred = override_creds(sbi->kernel_cred);
+		retval = pending_create(inode->i_sb, name);
+		revert_creds(old_cred);
+	}
+	if(retval) {
+		/* every write of the file would try again and fail the same way */
+		info->pending_failed = 1;
+		printk(KERN_WARNING "wrapfs: cannot create the pending marker of inode %lu, err=%d, a crash "
+			"before its integrity_val is updated leaves it stale\n", inode->i_ino, retval);
+	}
+	else
+		info->pending_marker = 1;
+
+unlock:
+	mutex_unlock(&info->pending_mutex);
+}
+
+/* Method to remove the marker of a file whose integrity_val is up to date
+ * Input: wrapfs inode, lower path of the file, number of write opens of the caller
+ 	(1 for a release, 0 for the rehash workqueue)
+ * Output: none, the marker stays while the file is dirty or open for writing by others
+ * Following are the steps:
+ * 1. clear pending_marker first, a writer that still sees it set has the file open for
+ 	writing already and is seen in i_writecount
+ * 2. put it back if the file is dirty again or someone else can write to it
+ * 3. else remove the marker; a file whose marker couldn't be created gets another try
+ 	with its next write
+ */
+void wrapfs_clear_pending(struct inode *inode, struct path *lower_path, int writers) {
+	struct wrapfs_sb_info *sbi = WRAPFS_SB(inode->i_sb);
+	struct wrapfs_inode_info *info = WRAPFS_I(inode);
+	const struct cred *old_cred;
+	char name[WRAPFS_PENDING_NAMELEN];
+	unsigned int marker;
+
+	if(!ACCESS_ONCE(info->pending_marker) && !ACCESS_ONCE(info->pending_failed))
+		return;
+
+	mutex_lock(&info->pending_mutex);
+	marker = info->pending_marker;
+	if(!marker && !info->pending_failed)
+		goto unlock;
+
+	info->pending_marker = 0;
+	smp_mb();
+	if(atomic_read(&inode->i_writecount) > writers || wrapfs_get_dirty_flag(inode)) {
+		info->pending_marker = marker;
+		goto unlock;
+	}
+
+	info->pending_failed = 0;
+	if(marker && !pending_name(lower_path->dentry, name, sizeof(name))) {
+		old_cred = override_creds(sbi->kernel_cred);
+		pending_remove(inode->i_sb, name);
+		revert_creds(old_cred);
+	}
+
+unlock:
+	mutex_unlock(&info->pending_mutex);
+}
+
+/* readdir callback collecting the markers */
+static int pending_filldir(void *buf, const char *name, int namelen, loff_t offset, u64 ino,
+	unsigned int d_type) {
+	struct list_head *entries = buf;
+	struct pending_entry *entry;
+
+	if((namelen == 1 && name[0] == '.') || (namelen == 2 && name[0] == '.' && name[1] == '.'))
+		return 0;
+
+	entry = kmalloc(sizeof(*entry) + namelen + 1, GFP_KERNEL);
+	if(!entry)
+		return -ENOMEM;
+	memcpy(entry->name, name, namelen);
+	entry->name[namelen] = '\0';
+	list_add_tail(&entry->list, entries);
+	return 0;
+}
+
+static int pending_acceptable(void *context, struct dentry *dentry) {
+	return 1;
+}
+
+/* Method to queue the rehash of a file left with a marker by an earlier mount
+ * Input: wrapfs super block, lower root, name of the marker
+ * Output: return 0 if the rehash is queued or the marker was stale; else return respective -ERRNO
+ * Following are the steps:
+ * 1. find the lower file from the handle in the name, a file that is gone loses its marker
+ * 2. get its wrapfs inode, which the rehash will need, and hold it until the rehash is done
+ * 3. mark the whole file dirty and queue its rehash like a deferred release does;
+ 	the marker is removed once the rehash has updated the integrity_val
+ */
+static int pending_recover(struct super_block *sb, struct path *root, const char *name) {
+	struct wrapfs_sb_info *sbi = WRAPFS_SB(sb);
+	struct workqueue_struct *wq = sbi->rehash_wq ? sbi->rehash_wq : sbi->verify_wq;
+	struct pending_recover *r;
+	struct path lower_path;
+	struct inode *inode;
+	u32 fh[PENDING_FH_WORDS];
+	int len, type;
+	int retval = 0;
+
+	if(pending_parse(name, fh, &len, &type)) {
+		pending_remove(sb, name);
+		return 0;
+	}
+
+	lower_path.dentry = exportfs_decode_fh(root->mnt, (struct fid *)fh, len, type,
+		pending_acceptable, NULL);
+	if(IS_ERR(lower_path.dentry)) {
+		retval = PTR_ERR(lower_path.dentry);
+		/* the file was deleted since */
+		if(retval != -ESTALE)
+			return retval;
+		pending_remove(sb, name);
+		return 0;
+	}
+	lower_path.mnt = root->mnt;
+	if(!lower_path.dentry->d_inode || !S_ISREG(lower_path.dentry->d_inode->i_mode)) {
+		pending_remove(sb, name);
+		goto out;
+	}
+
+	r = kmalloc(sizeof(*r), GFP_KERNEL);
+	if(!r) {
+		retval = -ENOMEM;
+		goto out;
+	}
+	inode = wrapfs_iget(sb, lower_path.dentry->d_inode);
+	if(IS_ERR(inode)) {
+		kfree(r);
+		retval = PTR_ERR(inode);
+		goto out;
+	}
+
+	WRAPFS_I(inode)->pending_marker = 1;
+	wrapfs_mark_dirty_all(inode);
+	/* without a workqueue the file is rehashed now */
+	wrapfs_queue_rehash(inode, &lower_path, wq);
+	r->inode = inode;
+	list_add_tail(&r->list, &sbi->recover_list);
+
+out:
+	dput(lower_path.dentry);
+	return retval;
+}
+
+/* Method run once the rehashes queued at mount are done, drops the inodes they needed */
+static void pending_recover_work(struct work_struct *work) {
+	struct wrapfs_sb_info *sbi = container_of(work, struct wrapfs_sb_info, recover_work);
+	struct pending_recover *r, *tmp;
+	unsigned int n = 0;
+
+	list_for_each_entry_safe(r, tmp, &sbi->recover_list, list) {
+		flush_work_sync(&WRAPFS_I(r->inode)->rehash_work);
+		iput(r->inode);
+		list_del(&r->list);
+		kfree(r);
+		n++;
+	}
+	if(n)
+		printk("wrapfs: recovered %u file(s) written before an unclean unmount\n", n);
+}
+
+/* Method to set up the markers at mount and recover the files an earlier mount left marked
+ * Input: wrapfs super block, the sidecar directory is set up already
+ * Output: none, without the pending directory files are changed without markers
+ * Following are the steps:
+ * 1. look up WRAPFS_PENDING_DIR in the sidecar directory, create it if it doesn't exist
+ * 2. read the names of the markers in it
+ * 3. queue the rehash of every marked file, and one work that waits for them
+ */
+void wrapfs_init_pending(struct super_block *sb) {
+	struct wrapfs_sb_info *sbi = WRAPFS_SB(sb);
+	struct super_block *lower_sb;
+	const struct cred *old_cred;
+	struct path sidecar, root;
+	struct dentry *dentry;
+	struct file *dir;
+	struct pending_entry *entry, *tmp;
+	LIST_HEAD(entries);
+	int retval;
+
+	INIT_LIST_HEAD(&sbi->recover_list);
+	INIT_WORK(&sbi->recover_work, pending_recover_work);
+
+	/* markers are named after file handles, without them pending_dir stays unset
+	 * and the files are written without markers */
+	lower_sb = wrapfs_lower_super(sb);
+	if(!lower_sb->s_export_op || !lower_sb->s_export_op->fh_to_dentry) {
+		printk(KERN_WARNING "wrapfs_init_pending: %s can't export file handles, no crash-safe markers\n",
+			lower_sb->s_type->name);
+		return;
+	}
+
+	if(wrapfs_sidecar_dir(sb, &sidecar))
+		return;
+
+	old_cred = override_creds(sbi->kernel_cred);
+	mutex_lock_nested(&sidecar.dentry->d_inode->i_mutex, I_MUTEX_XATTR);
+	dentry = lookup_one_len(WRAPFS_PENDING_DIR, sidecar.dentry, strlen(WRAPFS_PENDING_DIR));
+	if(IS_ERR(dentry)) {
+		retval = PTR_ERR(dentry);
+		mutex_unlock(&sidecar.dentry->d_inode->i_mutex);
+		goto out;
+	}
+	retval = 0;
+	if(!dentry->d_inode) {
+		retval = mnt_want_write(sidecar.mnt);
+		if(!retval) {
+			retval = vfs_mkdir(sidecar.dentry->d_inode, dentry, S_IRWXU);
+			mnt_drop_write(sidecar.mnt);
+		}
+	}
+	else if(!S_ISDIR(dentry->d_inode->i_mode))
+		retval = -ENOTDIR;
+	mutex_unlock(&sidecar.dentry->d_inode->i_mutex);
+	if(retval) {
+		dput(dentry);
+		goto out;
+	}
+	sbi->pending_dir.dentry = dentry;
+	sbi->pending_dir.mnt = mntget(sidecar.mnt);
+
+	/* dentry_open consumes the references */
+	path_get(&sbi->pending_dir);
+	dir = dentry_open(sbi->pending_dir.dentry, sbi->pending_dir.mnt, O_RDONLY, current_cred());
+	if(IS_ERR(dir)) {
+		retval = PTR_ERR(dir);
+		goto out;
+	}
+	retval = vfs_readdir(dir, pending_filldir, &entries);
+	fput(dir);
+
+	wrapfs_get_lower_path(sb->s_root, &root);
+	list_for_each_entry_safe(entry, tmp, &entries, list) {
+		if(!retval && pending_recover(sb, &root, entry->name))
+			printk("wrapfs_init_pending: cannot recover %s\n", entry->name);
+		list_del(&entry->list);
+		kfree(entry);
+	}
+	wrapfs_put_lower_path(sb->s_root, &root);
+
+	if(!list_empty(&sbi->recover_list))
+		schedule_work(&sbi->recover_work);
+
+out:
+	revert_creds(old_cred);
+	path_put(&sidecar);
+	if(retval)
+		printk("wrapfs_init_pending: cannot read %s, err=%d\n", WRAPFS_PENDING_DIR, retval);
+}
+
+/* Method to wait for the recovery at unmount, before the inodes it holds are looked at */
+void wrapfs_flush_pending(struct super_block *sb) {
+	flush_work_sync(&WRAPFS_SB(sb)->recover_work);
+}
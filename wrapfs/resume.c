@@ -0,0 +1,209 @@
+/*
+ * This file contains the saved hash state of the files that only grow.
+ *
+ * A flat integrity_type can't be patched like a hash tree, so every update of
+ * a log or journal used to hash the whole file again from byte 0, however
+ * little was appended. When a file of at least WRAPFS_RESUME_MIN bytes is
+ * rehashed, the state of the hash just before it is finalized is exported
+ * and saved in ATTR_INTEGRITY_RESUME of the lower file, together with the
+ * number of bytes it covers and the integrity_val it was finalized into. The
+ * next update of the file, if everything written since lies past those bytes,
+ * loads the state and only hashes the tail.
+ *
+ * The saved state only holds while it goes with the integrity_val of the
+ * record: a rehash that doesn't save a new one (a write through a mapping, a
+ * change of integrity_type, an update by an older wrapfs) leaves a state that
+ * is simply ignored. The exported state is private to the crypto driver, so
+ * the driver name is saved too and a state of another driver is not loaded.
+ *
+ * Only rehashing gets cheaper: an integrity check still hashes the whole
+ * file, it is what finds a prefix that went bad on the disk. A state saved
+ * before such a corruption actually helps there, the integrity_val resumed
+ * from it still describes the good prefix and the next check fails.
+ *
+ * The xattr is laid out as follows, the state in the byte order of the CPU:
+ *
+ *	version | length of integrity_val | length of the driver name | unused |
+ *	bytes covered (le64) | length of the state (le16) |
+ *	integrity_val | driver name | state
+ */
+
+#include "wrapfs.h"
+
+struct resume_record {
+	__u8 version;
+	__u8 ilen;
+	__u8 driver_len;
+	__u8 unused;
+	__le64 len;
+	__le16 state_len;
+	char data[0];
+} __attribute__((packed));
+
+#define RESUME_RECORD_VERSION 1
+
+/* largest record of a pool */
+static size_t resume_record_size(struct wrapfs_hash_pool *pool) {
+	return sizeof(struct resume_record) + MAXLEN + CRYPTO_MAX_ALG_NAME + pool->state_size;
+}
+
+/* Method to load the saved hash state of a file
+ * Input: lower_path, pool of the algo of the file, integrity record of the file, where to
+ 	put the number of bytes covered and the state (state_size bytes of the pool)
+ * Output: return 0 if there is a state that goes with the integrity_val of the record and
+ 	the driver of the pool; else return respective -ERRNO
+ */
+static int resume_load(struct path lower_path, struct wrapfs_hash_pool *pool,
+	const struct wrapfs_integrity *rec, loff_t *len, void *state) {
+	size_t size = resume_record_size(pool);
+	struct resume_record *r;
+	unsigned int driver_len = strlen(pool->driver);
+	long retval;
+
+	r = kmalloc(size, GFP_KERNEL);
+	if(!r)
+		return -ENOMEM;
+
+	retval = vfs_getxattr(lower_path.dentry, ATTR_INTEGRITY_RESUME, r, size);
+	if(retval<0)
+		goto out;
+
+	if(retval < sizeof(*r) || r->version != RESUME_RECORD_VERSION ||
+		retval != sizeof(*r) + r->ilen + r->driver_len + le16_to_cpu(r->state_len)) {
+		retval = -EINVAL;
+		goto out;
+	}
+	/* a state of another integrity_val or another driver is of no use */
+	if(r->ilen != rec->ilen || memcmp(r->data, rec->ival, rec->ilen) ||
+		r->driver_len != driver_len || memcmp(r->data + r->ilen, pool->driver, driver_len) ||
+		le16_to_cpu(r->state_len) != pool->state_size) {
+		retval = -ESTALE;
+		goto out;
+	}
+
+	*len = le64_to_cpu(r->len);
+	memcpy(state, r->data + r->ilen + driver_len, pool->state_size);
+	retval = 0;
+
+out:
+	kfree(r);
+	return retval;
+}
+
+/* Method to save the hash state of a file after its integrity_val was stored
+ * Input: lower_path, pool the state was exported from, state, number of bytes it covers,
+ 	the integrity_val it was finalized into and its length
+ * Output: none, without a saved state the next update hashes the whole file
+ */
+void wrapfs_resume_save(struct path lower_path, struct wrapfs_hash_pool *pool, const void *state,
+	loff_t len, const unsigned char *ival, unsigned int ilen) {
+	unsigned int driver_len = strlen(pool->driver);
+	struct resume_record *r;
+	long retval;
+
+	if(len < WRAPFS_RESUME_MIN || !pool->state_size || ilen > MAXLEN)
+		return;
+
+	r = kmalloc(resume_record_size(pool), GFP_KERNEL);
+	if(!r)
+		return;
+
+	r->version = RESUME_RECORD_VERSION;
+	r->ilen = ilen;
+	r->driver_len = driver_len;
+	r->unused = 0;
+	r->len = cpu_to_le64(len);
+	r->state_len = cpu_to_le16(pool->state_size);
+	memcpy(r->data, ival, ilen);
+	memcpy(r->data + ilen, pool->driver, driver_len);
+	memcpy(r->data + ilen + driver_len, state, pool->state_size);
+
+	retval = vfs_setxattr(lower_path.dentry, ATTR_INTEGRITY_RESUME, r,
+		sizeof(*r) + ilen + driver_len + pool->state_size, 0);
+	if(retval<0)
+		printk("wrapfs_resume_save: not able to set %s, err=%ld\n", ATTR_INTEGRITY_RESUME, retval);
+	kfree(r);
+}
+
+/* Method to bring the integrity_val of a flat protected file up to date from its saved state
+ * Input: wrapfs inode, lower_path, integrity record of the file, crypto algo of its
+ 	integrity_type, byte ranges written since the last update, flag telling that the
+ 	file was written outside of those ranges
+ * Output: return 0 if the all steps are successful; -EAGAIN if the file is too small to
+ 	be worth a saved state; else return respective -ERRNO
+ * Following are the steps:
+ * 1. load the saved state if every written range lies past the bytes it covers
+ * 2. else start a new hash from byte 0
+ * 3. hash the rest of the file from the lower page cache
+ * 4. export the state, finalize the hash into the record and store the record
+ * 5. save the state next to it for the next update
+ */
+long wrapfs_resume_rehash(struct inode *inode, struct path lower_path, struct wrapfs_integrity *rec,
+	const char *algo, struct list_head *dirty, unsigned int dirty_all) {
+	loff_t size = i_size_read(lower_path.dentry->d_inode);
+	struct wrapfs_hash_pool *pool;
+	struct wrapfs_hash_ctx *ctx;
+	struct file *filp;
+	void *state;
+	loff_t from = 0;
+	long retval = 0;
+
+	if(size < WRAPFS_RESUME_MIN)
+		return -EAGAIN;
+	pool = wrapfs_hash_pool(inode->i_sb, algo);
+	if(IS_ERR(pool) || !pool->state_size)
+		return -EAGAIN;
+	if(pool->digest_size > MAXLEN)
+		return -EINVAL;
+
+	state = kmalloc(pool->state_size, GFP_KERNEL);
+	if(!state)
+		return -ENOMEM;
+
+	if(!dirty_all && rec->ilen && !resume_load(lower_path, pool, rec, &from, state)) {
+		/* the ranges are sorted, the first one tells whether the covered bytes changed */
+		if(from > size || (!list_empty(dirty) &&
+			list_first_entry(dirty, struct wrapfs_dirty_range, list)->start < from))
+			from = 0;
+	}
+	else
+		from = 0;
+
+	/* dentry_open consumes the references, so take our own */
+	path_get(&lower_path);
+	filp = dentry_open(lower_path.dentry, lower_path.mnt, O_RDONLY | O_LARGEFILE, current_cred());
+	if(IS_ERR(filp)) {
+		printk("wrapfs_resume_rehash: cannot open the file in O_RDONLY mode\n");
+		retval = PTR_ERR(filp);
+		goto out;
+	}
+	wrapfs_hash_readahead(filp);
+
+	ctx = wrapfs_get_hash(pool);
+	if(from)
+		retval = wrapfs_hash_import(ctx, state);
+	else
+		retval = wrapfs_hash_init(ctx);
+	if(!retval)
+		retval = wrapfs_hash_range(ctx, filp, from, size - from);
+	if(!retval)
+		retval = wrapfs_hash_export(ctx, state);
+	if(!retval)
+		retval = wrapfs_hash_final(ctx, rec->ival);
+	wrapfs_put_hash(ctx);
+	fput(filp);
+	if(retval) {
+		printk("wrapfs_resume_rehash: error hashing the file, err=%ld\n", retval);
+		goto out;
+	}
+	rec->ilen = pool->digest_size;
+
+	retval = put_integrity_record(inode, lower_path, rec);
+	if(retval<0)
+		goto out;
+	wrapfs_resume_save(lower_path, pool, state, size, rec->ival, rec->ilen);
+
+out:
+	kfree(state);
+	return retval;
+}
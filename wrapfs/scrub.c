@@ -0,0 +1,592 @@
+/*
+ * This file contains the online scrubber of a mount.
+ *
+ * The integrity of a file is only checked when it is opened, so a file nobody
+ * opens can rot unnoticed until the day it is needed, and then the check shows
+ * up as a slow open. The scrubber is a kernel thread that walks the tree from
+ * the wrapfs root, reading the directories of the lower file system, and
+ * checks every file with has_integrity set with check_integrity, hashing it
+ * again even when it is verified already. A match warms the verified state of
+ * the inode and the vcache, so that a later open of the file is a lookup; a
+ * mismatch is logged and marks the inode like a failed background check
+ * (reads get EPERM, the next open checks the file again).
+ *
+ * The walk is paced after every entry by the scrub_bps= and scrub_iops= mount
+ * options: looking up an entry is one I/O and so is every readahead window
+ * (WRAPFS_HASH_RA_PAGES) of a file read. A file is hashed in one go, a large
+ * one at full speed, and the thread sleeps it off afterwards.
+ *
+ * The position of the walk is the readdir offset and the name hash of the
+ * current entry of every directory from the root down. It is kept in the
+ * super block, so a stopped scrub goes on where it was, and every
+ * WRAPFS_SCRUB_CHECKPOINT entries it is saved in an xattr of the sidecar
+ * directory, so it goes on after a remount as well. A directory that is not
+ * where the position says anymore (renamed, deleted) is walked from the start.
+ *
+ * mount -o scrub=start|stop|restart starts, stops, or starts again from the
+ * root the scrubber, at mount or on remount. getxattr user.integrity_scrub on
+ * the root of the mount tells its state and counters.
+ */
+
+#include "wrapfs.h"
+
+/* xattr of the sidecar directory holding the saved position */
+#define SCRUB_XATTR "user.wrapfs_scrub"
+#define SCRUB_VERSION 1
+
+/* the position as it is saved, little endian */
+struct scrub_checkpoint {
+	__u8 version;
+	__u8 depth;
+	__le32 hash[WRAPFS_SCRUB_MAX_DEPTH];
+	__le64 pos[WRAPFS_SCRUB_MAX_DEPTH];
+} __attribute__((packed));
+
+/* a directory being walked */
+struct scrub_level {
+	struct dentry *dentry;		/* wrapfs dentry of the directory */
+	struct file *dir;		/* lower directory, read one entry at a time */
+};
+
+/* the entry scrub_filldir read */
+struct scrub_entry {
+	unsigned int found;
+	char name[NAME_MAX + 1];
+	int len;
+	loff_t pos;
+	unsigned int d_type;
+};
+
+/* state of a walk, too large for the stack of the thread */
+struct scrub_walk {
+	struct super_block *sb;
+	struct scrub_level level[WRAPFS_SCRUB_MAX_DEPTH];
+	int depth;			/* deepest level open, -1 if none */
+	struct wrapfs_scrub_pos pos;
+	unsigned int resume;		/* levels of pos still to be restored */
+	unsigned int entries;		/* since the position was last saved */
+	struct scrub_entry entry;
+	unsigned long start;		/* jiffies the pacing counts from */
+	u64 bytes;			/* read since start */
+	u64 ops;			/* I/Os since start */
+	char path[256];			/* for the log */
+};
+
+static const char *scrub_states[] = {
+	[WRAPFS_SCRUB_IDLE] = "idle",
+	[WRAPFS_SCRUB_RUNNING] = "running",
+	[WRAPFS_SCRUB_DONE] = "done",
+};
+
+/* readdir callback taking one entry, the next one stays where it is for the next call */
+static int scrub_filldir(void *buf, const char *name, int namelen, loff_t offset, u64 ino,
+	unsigned int d_type) {
+	struct scrub_entry *entry = buf;
+
+	if(entry->found || namelen > NAME_MAX)
+		return -EINVAL;
+	memcpy(entry->name, name, namelen);
+	entry->name[namelen] = '\0';
+	entry->len = namelen;
+	entry->pos = offset;
+	entry->d_type = d_type;
+	entry->found = 1;
+	return 0;
+}
+
+/* Method to save the position of the scrubber in the sidecar directory
+ * Input: wrapfs super block, position, empty for a finished pass
+ * Output: none, the position is only kept in memory if it can't be saved
+ */
+static void scrub_save(struct super_block *sb, const struct wrapfs_scrub_pos *pos) {
+	struct wrapfs_sb_info *sbi = WRAPFS_SB(sb);
+	struct scrub_checkpoint ck;
+	const struct cred *old_cred;
+	unsigned int i;
+	int retval;
+
+	if(!sbi->sidecar.dentry)
+		return;
+
+	memset(&ck, 0, sizeof(ck));
+	ck.version = SCRUB_VERSION;
+	ck.depth = pos->depth;
+	for(i = 0; i < pos->depth; i++) {
+		ck.hash[i] = cpu_to_le32(pos->hash[i]);
+		ck.pos[i] = cpu_to_le64(pos->pos[i]);
+	}
+
+	old_cred = override_creds(sbi->kernel_cred);
+	retval = mnt_want_write(sbi->sidecar.mnt);
+	if(!retval) {
+		retval = vfs_setxattr(sbi->sidecar.dentry, SCRUB_XATTR, &ck, sizeof(ck), 0);
+		mnt_drop_write(sbi->sidecar.mnt);
+	}
+	revert_creds(old_cred);
+	if(retval<0)
+		printk("scrub_save: not able to save the position, error %d\n", retval);
+}
+
+/* Method to read the position saved by an earlier mount, leaves it empty if there is none */
+static void scrub_load(struct super_block *sb, struct wrapfs_scrub_pos *pos) {
+	struct wrapfs_sb_info *sbi = WRAPFS_SB(sb);
+	struct scrub_checkpoint ck;
+	const struct cred *old_cred;
+	unsigned int i;
+	ssize_t retval;
+
+	memset(pos, 0, sizeof(*pos));
+	if(!sbi->sidecar.dentry)
+		return;
+
+	old_cred = override_creds(sbi->kernel_cred);
+	retval = vfs_getxattr(sbi->sidecar.dentry, SCRUB_XATTR, &ck, sizeof(ck));
+	revert_creds(old_cred);
+	if(retval == -ENODATA)
+		return;
+	if(retval != sizeof(ck) || ck.version != SCRUB_VERSION || ck.depth > WRAPFS_SCRUB_MAX_DEPTH) {
+		printk("scrub_load: %s is malformed, starting from the root\n", SCRUB_XATTR);
+		return;
+	}
+
+	pos->depth = ck.depth;
+	for(i = 0; i < ck.depth; i++) {
+		pos->hash[i] = le32_to_cpu(ck.hash[i]);
+		pos->pos[i] = le64_to_cpu(ck.pos[i]);
+	}
+}
+
+/* Method to give the position of the walk to the super block, and every
+ 	WRAPFS_SCRUB_CHECKPOINT entries to the sidecar directory
+ */
+static void scrub_checkpoint(struct scrub_walk *w) {
+	struct wrapfs_sb_info *sbi = WRAPFS_SB(w->sb);
+
+	spin_lock(&sbi->scrub_lock);
+	sbi->scrub_pos = w->pos;
+	spin_unlock(&sbi->scrub_lock);
+
+	if(++w->entries >= WRAPFS_SCRUB_CHECKPOINT) {
+		w->entries = 0;
+		scrub_save(w->sb, &w->pos);
+	}
+}
+
+/* Method to sleep as long as scrub_bps= and scrub_iops= ask for
+ * Input: walk, bytes read and I/Os done since the last call
+ * Output: none, returns early when the thread is stopped or frozen
+ * Following are the steps:
+ * 1. add the work to what was done since the pacing started
+ * 2. work out how long it should have taken at the configured rates
+ * 3. sleep off the difference; if the walk is more than a second behind (slow
+ 	lower file system), start counting again so that it doesn't burst to catch up
+ */
+static void scrub_pace(struct scrub_walk *w, u64 bytes, u64 ops) {
+	struct wrapfs_sb_info *sbi = WRAPFS_SB(w->sb);
+	unsigned int bps = ACCESS_ONCE(sbi->scrub_bps);
+	unsigned int iops = ACCESS_ONCE(sbi->scrub_iops);
+	unsigned long elapsed;
+	u64 due = 0;
+
+	w->bytes += bytes;
+	w->ops += ops;
+	if(bps)
+		due = max(due, div_u64(w->bytes * MSEC_PER_SEC, bps));
+	if(iops)
+		due = max(due, div_u64(w->ops * MSEC_PER_SEC, iops));
+
+	elapsed = jiffies_to_msecs(jiffies - w->start);
+	if(due > elapsed)
+		schedule_timeout_interruptible(msecs_to_jiffies(due - elapsed));
+	else if(elapsed - due > MSEC_PER_SEC) {
+		w->start = jiffies;
+		w->bytes = 0;
+		w->ops = 0;
+	}
+	try_to_freeze();
+}
+
+/* Method to open a directory for the walk, one level down
+ * Input: walk, wrapfs dentry of the directory
+ * Output: return 0 if the directory is open or too deep to be walked; else return respective -ERRNO
+ */
+static int scrub_push(struct scrub_walk *w, struct dentry *dentry) {
+	struct scrub_level *level;
+	struct path lower_path;
+	struct file *dir;
+	int depth = w->depth + 1;
+
+	if(depth >= WRAPFS_SCRUB_MAX_DEPTH) {
+		printk("scrub_push: %s is too deep, not scrubbed\n", dentry->d_name.name);
+		return 0;
+	}
+
+	/* dentry_open takes over the references of the lower path */
+	wrapfs_get_lower_path(dentry, &lower_path);
+	dir = dentry_open(lower_path.dentry, lower_path.mnt, O_RDONLY | O_NOATIME | O_LARGEFILE,
+		current_cred());
+	if(IS_ERR(dir))
+		return PTR_ERR(dir);
+
+	/* going on from a saved position */
+	if(depth < w->resume && vfs_llseek(dir, w->pos.pos[depth], SEEK_SET) < 0)
+		w->resume = 0;
+
+	level = &w->level[depth];
+	level->dentry = dget(dentry);
+	level->dir = dir;
+	w->depth = depth;
+	return 0;
+}
+
+/* Method to close the deepest directory of the walk, its parent goes on with its next entry */
+static void scrub_pop(struct scrub_walk *w) {
+	struct scrub_level *level = &w->level[w->depth];
+
+	fput(level->dir);
+	dput(level->dentry);
+	level->dir = NULL;
+	level->dentry = NULL;
+	w->depth--;
+	w->resume = 0;
+
+	if(w->depth >= 0) {
+		w->pos.pos[w->depth] = w->level[w->depth].dir->f_pos;
+		w->pos.hash[w->depth] = 0;
+	}
+	w->pos.depth = w->depth + 1;
+}
+
+/* Method to look up an entry of a directory being walked
+ * Input: wrapfs dentry of the directory, entry read from the lower directory
+ * Output: returns the wrapfs dentry, which may be negative; else returns ERR_PTR
+ */
+static struct dentry *scrub_lookup(struct dentry *parent, const struct scrub_entry *entry) {
+	struct dentry *dentry;
+
+	mutex_lock(&parent->d_inode->i_mutex);
+	dentry = lookup_one_len(entry->name, parent, entry->len);
+	mutex_unlock(&parent->d_inode->i_mutex);
+	return dentry;
+}
+
+/* Method to scrub one file
+ * Input: walk, wrapfs dentry of a regular file
+ * Output: returns the number of bytes read, the outcome goes to the counters of the mount
+ * Following are the steps:
+ * 1. skip a file being written or rehashed, it gets a new integrity_val anyway
+ * 2. skip a file without has_integrity set
+ * 3. check the file, hashing it again even if it is verified (check_integrity_shared
+ 	with fresh set), the merkle family checks the root and then every block
+ * 4. on a mismatch mark the inode failed, reads get EPERM until it is checked again
+ */
+static loff_t scrub_file(struct scrub_walk *w, struct dentry *dentry) {
+	struct wrapfs_sb_info *sbi = WRAPFS_SB(w->sb);
+	struct inode *inode = dentry->d_inode;
+	struct wrapfs_integrity rec;
+	struct path lower_path;
+	struct file *lower_file;
+	loff_t size = 0, pos;
+	size_t count;
+	char *path;
+	int retval;
+
+	wrapfs_get_lower_path(dentry, &lower_path);
+
+	if(wrapfs_get_dirty_flag(inode) || wrapfs_pending_rehash(inode) ||
+		atomic_read(&lower_path.dentry->d_inode->i_writecount) > 0) {
+		spin_lock(&sbi->scrub_lock);
+		sbi->scrub_skipped++;
+		spin_unlock(&sbi->scrub_lock);
+		goto out;
+	}
+
+	retval = get_integrity_record(inode, lower_path, &rec);
+	if(retval<0 || integrity_record_flag(&rec) != 1 || !rec.ilen)
+		goto out;
+
+	/* dentry_open takes over the references */
+	path_get(&lower_path);
+	lower_file = dentry_open(lower_path.dentry, lower_path.mnt, O_RDONLY | O_NOATIME | O_LARGEFILE,
+		current_cred());
+	if(IS_ERR(lower_file)) {
+		retval = PTR_ERR(lower_file);
+		goto counters;
+	}
+
+	size = i_size_read(lower_path.dentry->d_inode);
+	retval = check_integrity_shared(inode, lower_path, &rec, lower_file, 1);
+	/* blocks read since the tree was loaded are verified already */
+	for(pos = 0; retval == 1 && WRAPFS_I(inode)->merkle && pos < size; pos += count) {
+		count = min_t(loff_t, size - pos, WRAPFS_HASH_RA_PAGES << PAGE_CACHE_SHIFT);
+		if(merkle_verify_range(inode, lower_file, pos, count) < 0)
+			retval = -EPERM;
+	}
+	fput(lower_file);
+
+counters:
+	path = dentry_path_raw(dentry, w->path, sizeof(w->path));
+	if(IS_ERR(path))
+		path = (char *) dentry->d_name.name;
+
+	spin_lock(&sbi->scrub_lock);
+	if(retval == 1) {
+		sbi->scrub_files++;
+		sbi->scrub_bytes += size;
+	}
+	else if(retval == -EPERM)
+		sbi->scrub_failed++;
+	else
+		sbi->scrub_errors++;
+	spin_unlock(&sbi->scrub_lock);
+
+	if(retval == -EPERM) {
+		printk("scrub_file: Integrity check of %s failed!!\n", path);
+		wrapfs_clear_verified(inode);
+		set_bit(WRAPFS_VSTATE_FAILED, &WRAPFS_I(inode)->verify_state);
+	}
+	else if(retval<0 && retval != -EINTR)
+		printk("scrub_file: not able to check %s, error %d\n", path, retval);
+
+out:
+	wrapfs_put_lower_path(dentry, &lower_path);
+	return size;
+}
+
+/* Method to walk the tree of the mount once, from the position in w->pos
+ * Input: walk with no directory open
+ * Output: return 0 if the whole tree was walked, -EINTR if the thread was stopped; else
+ 	return respective -ERRNO. The directories still open are left to the caller.
+ * Following are the steps, for every entry of the deepest open directory:
+ * 1. read the next entry; at the end of the directory go back to its parent
+ * 2. while restoring a saved position, go down only into the directory the position
+ 	names, anything else means the tree changed and the walk goes on from here
+ * 3. look the entry up through wrapfs, open a directory one level down, scrub a file
+ * 4. remember the position and pace the walk
+ */
+static int scrub_walk(struct scrub_walk *w) {
+	struct scrub_level *level;
+	struct scrub_entry *entry = &w->entry;
+	struct dentry *dentry;
+	unsigned int is_dir;
+	int depth, retval;
+	u32 hash;
+	loff_t bytes;
+
+	retval = scrub_push(w, w->sb->s_root);
+	if(retval)
+		return retval;
+
+	while(w->depth >= 0) {
+		if(kthread_should_stop())
+			return -EINTR;
+
+		depth = w->depth;
+		level = &w->level[depth];
+		entry->found = 0;
+		retval = vfs_readdir(level->dir, scrub_filldir, entry);
+		if(retval<0)
+			printk("scrub_walk: not able to read %s, error %d\n",
+				level->dentry->d_name.name, retval);
+		if(retval<0 || !entry->found) {
+			scrub_pop(w);
+			continue;
+		}
+
+		if(!strcmp(entry->name, ".") || !strcmp(entry->name, "..") ||
+			(!depth && !strcmp(entry->name, WRAPFS_SIDECAR_DIR)))
+			continue;
+
+		hash = full_name_hash((unsigned char *) entry->name, entry->len);
+		is_dir = entry->d_type == DT_DIR || entry->d_type == DT_UNKNOWN;
+		if(depth < w->resume && (depth + 1 >= w->resume || !is_dir || hash != w->pos.hash[depth]))
+			w->resume = 0;
+
+		/* the position of a directory is its own entry, it is walked again on resume */
+		w->pos.pos[depth] = entry->pos;
+		w->pos.hash[depth] = hash;
+		w->pos.depth = depth + 1;
+
+		bytes = 0;
+		if(is_dir || entry->d_type == DT_REG) {
+			dentry = scrub_lookup(level->dentry, entry);
+			if(IS_ERR(dentry)) {
+				printk("scrub_walk: not able to look up %s, error %ld\n", entry->name,
+					PTR_ERR(dentry));
+				dentry = NULL;
+			}
+			else if(dentry->d_inode && S_ISDIR(dentry->d_inode->i_mode)) {
+				retval = scrub_push(w, dentry);
+				if(retval)
+					printk("scrub_walk: not able to open %s, error %d\n", entry->name, retval);
+			}
+			else if(dentry->d_inode && S_ISREG(dentry->d_inode->i_mode))
+				bytes = scrub_file(w, dentry);
+			dput(dentry);
+		}
+
+		/* anything else is done with, the walk goes on after it */
+		if(w->depth == depth) {
+			w->pos.pos[depth] = level->dir->f_pos;
+			w->pos.hash[depth] = 0;
+		}
+
+		scrub_checkpoint(w);
+		scrub_pace(w, bytes, 1 + div_u64(bytes, WRAPFS_HASH_RA_PAGES << PAGE_CACHE_SHIFT));
+	}
+	return 0;
+}
+
+/* Method run by the scrubber thread
+ * Input: wrapfs super block
+ * Output: 0 if the pass went through the whole tree; else returns respective -ERRNO
+ * Following are the steps:
+ * 1. walk the tree from the position in the super block
+ * 2. keep and save the position the walk stopped at, the next start goes on from there;
+ 	a finished pass leaves an empty position, the next pass starts from the root
+ * 3. wait for wrapfs_scrub_ctl or the unmount to reap the thread
+ */
+static int scrub_thread(void *data) {
+	struct super_block *sb = data;
+	struct wrapfs_sb_info *sbi = WRAPFS_SB(sb);
+	struct scrub_walk *w;
+	int retval = -ENOMEM;
+
+	set_freezable();
+
+	w = kzalloc(sizeof(*w), GFP_KERNEL);
+	if(!w)
+		goto idle;
+
+	w->sb = sb;
+	w->depth = -1;
+	w->start = jiffies;
+	spin_lock(&sbi->scrub_lock);
+	w->pos = sbi->scrub_pos;
+	spin_unlock(&sbi->scrub_lock);
+	w->resume = w->pos.depth;
+
+	retval = scrub_walk(w);
+	while(w->depth >= 0) {
+		fput(w->level[w->depth].dir);
+		dput(w->level[w->depth].dentry);
+		w->depth--;
+	}
+	if(!retval)
+		memset(&w->pos, 0, sizeof(w->pos));
+	scrub_save(sb, &w->pos);
+
+	spin_lock(&sbi->scrub_lock);
+	sbi->scrub_pos = w->pos;
+	if(!retval)
+		sbi->scrub_passes++;
+	spin_unlock(&sbi->scrub_lock);
+	kfree(w);
+
+idle:
+	if(retval && retval != -EINTR)
+		printk("scrub_thread: scrub stopped, error %d\n", retval);
+	spin_lock(&sbi->scrub_lock);
+	sbi->scrub_state = retval ? WRAPFS_SCRUB_IDLE : WRAPFS_SCRUB_DONE;
+	spin_unlock(&sbi->scrub_lock);
+
+	set_current_state(TASK_INTERRUPTIBLE);
+	while(!kthread_should_stop()) {
+		schedule();
+		set_current_state(TASK_INTERRUPTIBLE);
+	}
+	__set_current_state(TASK_RUNNING);
+	return retval;
+}
+
+/* Method to start, stop or restart the scrubber of a mount
+ * Input: wrapfs super block, WRAPFS_SCRUB_* command
+ * Output: return 0 if the all steps are successful; else return respective -ERRNO
+ * Following are the steps:
+ * 1. start does nothing if the scrubber is running already
+ * 2. stop the thread, it keeps its position
+ * 3. restart forgets the position
+ * 4. start a thread, it goes on from the position
+ * Must not be called with an i_mutex of the mount held, the thread may be waiting for it.
+ */
+int wrapfs_scrub_ctl(struct super_block *sb, unsigned int cmd) {
+	struct wrapfs_sb_info *sbi = WRAPFS_SB(sb);
+	struct task_struct *task;
+	unsigned int state;
+	int retval = 0;
+
+	if(cmd == WRAPFS_SCRUB_NONE)
+		return 0;
+
+	mutex_lock(&sbi->scrub_mutex);
+	spin_lock(&sbi->scrub_lock);
+	state = sbi->scrub_state;
+	spin_unlock(&sbi->scrub_lock);
+	if(cmd == WRAPFS_SCRUB_START && state == WRAPFS_SCRUB_RUNNING)
+		goto unlock;
+
+	if(sbi->scrub_task) {
+		kthread_stop(sbi->scrub_task);
+		sbi->scrub_task = NULL;
+	}
+	if(cmd == WRAPFS_SCRUB_STOP)
+		goto unlock;
+
+	spin_lock(&sbi->scrub_lock);
+	if(cmd == WRAPFS_SCRUB_RESTART)
+		memset(&sbi->scrub_pos, 0, sizeof(sbi->scrub_pos));
+	sbi->scrub_state = WRAPFS_SCRUB_RUNNING;
+	spin_unlock(&sbi->scrub_lock);
+
+	task = kthread_run(scrub_thread, sb, "wrapfs_scrub");
+	if(IS_ERR(task)) {
+		retval = PTR_ERR(task);
+		printk("wrapfs_scrub_ctl: not able to start the scrubber, error %d\n", retval);
+		spin_lock(&sbi->scrub_lock);
+		sbi->scrub_state = WRAPFS_SCRUB_IDLE;
+		spin_unlock(&sbi->scrub_lock);
+		goto unlock;
+	}
+	sbi->scrub_task = task;
+
+unlock:
+	mutex_unlock(&sbi->scrub_mutex);
+	return retval;
+}
+
+/* Method to set up the scrubber at mount, once the root and the sidecar directory are there
+ * Input: wrapfs super block, scrub_cmd set by the mount options
+ * Output: none, a scrubber that doesn't start is logged
+ */
+void wrapfs_init_scrub(struct super_block *sb) {
+	struct wrapfs_sb_info *sbi = WRAPFS_SB(sb);
+
+	scrub_load(sb, &sbi->scrub_pos);
+	wrapfs_scrub_ctl(sb, sbi->scrub_cmd);
+	sbi->scrub_cmd = WRAPFS_SCRUB_NONE;
+}
+
+/* Method to tell the state of the scrubber, the value of ATTR_INTEGRITY_SCRUB
+ * Input: wrapfs super block, buffer and its size (0 to query the length)
+ * Output: returns the length of the text; else return -ERANGE
+ */
+ssize_t wrapfs_scrub_status(struct super_block *sb, char *buf, size_t size) {
+	struct wrapfs_sb_info *sbi = WRAPFS_SB(sb);
+	char status[256];
+	int len;
+
+	spin_lock(&sbi->scrub_lock);
+	len = snprintf(status, sizeof(status),
+		"state=%s files=%lu bytes=%llu failed=%lu errors=%lu skipped=%lu passes=%lu depth=%u\n",
+		scrub_states[sbi->scrub_state], sbi->scrub_files, (unsigned long long) sbi->scrub_bytes,
+		sbi->scrub_failed, sbi->scrub_errors, sbi->scrub_skipped, sbi->scrub_passes,
+		sbi->scrub_pos.depth);
+	spin_unlock(&sbi->scrub_lock);
+
+	if(size) {
+		if(size < len)
+			return -ERANGE;
+		memcpy(buf, status, len);
+	}
+	return len;
+}
@@ -0,0 +1,242 @@
+/*
+ * This file contains the hashing of a file as it is written.
+ *
+ * Most protected files are written once from the start to the end (exports,
+ * archives, checkpoints), and the data passes through wrapfs_write anyway.
+ * Rehashing them at release reads the whole file back a second time. For a
+ * file of a flat integrity_type that is written sequentially from offset 0,
+ * every write is fed to a running hash instead, straight from the lower page
+ * cache the write just filled, and the release only finalizes it.
+ *
+ * The state of the running hash is exported from the request after each
+ * write and kept in the wrapfs file, so the stream only borrows a context of
+ * the pool while it hashes a write. One file per inode can stream, the one
+ * recorded in stream_file of the inode: a write at offset 0 of an empty
+ * protected file with no other writer starts the stream, writes of that file
+ * at the end of the stream go on with it. Anything else (a seek, a write of
+ * another file, a truncate, a writable mmap) drops it, and the release falls
+ * back to the usual rehash of the written ranges.
+ */
+
+#include "wrapfs.h"
+
+/* drop the stream of an inode, the caller holds dirty_lock */
+static void stream_drop(struct wrapfs_inode_info *info) {
+	info->stream_file = NULL;
+}
+
+/* Method to drop the stream of a file, the next release rehashes the file as usual
+ * Called when the file is changed in a way a stream can't follow.
+ */
+void wrapfs_stream_break(struct inode *inode) {
+	struct wrapfs_inode_info *info = WRAPFS_I(inode);
+
+	if(!ACCESS_ONCE(info->stream_file))
+		return;
+	spin_lock(&info->dirty_lock);
+	stream_drop(info);
+	spin_unlock(&info->dirty_lock);
+}
+
+/* Method to set up the stream of a file for its first write
+ * Input: wrapfs file, lower file
+ * Output: the stream, or NULL if the file can't be streamed
+ * A stream is made for a protected file of a flat integrity_type whose pool has a state
+ * that can be exported.
+ */
+static struct wrapfs_stream *stream_alloc(struct file *file, struct file *lower_file) {
+	struct inode *inode = file->f_path.dentry->d_inode;
+	struct wrapfs_integrity rec;
+	struct wrapfs_hash_pool *pool;
+	struct wrapfs_stream *stream;
+	char algo[MAXLEN_ALGO_NAME + 1];
+
+	if(get_integrity_record(inode, lower_file->f_path, &rec) || integrity_record_flag(&rec) != 1)
+		return NULL;
+	if(parse_integrity_type(integrity_record_type(&rec), algo, sizeof(algo)) != INTEGRITY_FAMILY_FLAT)
+		return NULL;
+	pool = wrapfs_hash_pool(inode->i_sb, algo);
+	if(IS_ERR(pool) || !pool->state_size)
+		return NULL;
+
+	stream = kzalloc(sizeof(*stream) + pool->state_size, GFP_KERNEL);
+	if(!stream)
+		return NULL;
+	mutex_init(&stream->mutex);
+	stream->pool = pool;
+	strcpy(stream->type, algo);
+	return stream;
+}
+
+/* Method to feed the bytes of a write to the running hash of a stream
+ * Input: stream, lower file, start and length of the written bytes
+ * Output: return 0 if the all steps are successful; else return respective -ERRNO
+ * Following are the steps:
+ * 1. take a context of the pool
+ * 2. start a new hash at offset 0, else load the state of the stream into the request
+ * 3. hash the written bytes from the lower page cache
+ * 4. save the state of the request back into the stream
+ */
+static int stream_hash(struct wrapfs_stream *stream, struct file *lower_file, loff_t pos, size_t count) {
+	struct wrapfs_hash_ctx *ctx;
+	int retval;
+
+	ctx = wrapfs_get_hash(stream->pool);
+	if(pos)
+		retval = wrapfs_hash_import(ctx, stream->state);
+	else
+		retval = wrapfs_hash_init(ctx);
+	if(!retval)
+		retval = wrapfs_hash_range(ctx, lower_file, pos, count);
+	if(!retval)
+		retval = wrapfs_hash_export(ctx, stream->state);
+	wrapfs_put_hash(ctx);
+
+	if(retval)
+		printk("wrapfs_stream_write: error hashing the written bytes, err=%d\n", retval);
+	return retval;
+}
+
+/* Method to hash the bytes a write just put in the lower file
+ * Input: wrapfs file, lower file, start and length of the written bytes
+ * Output: none, the stream of the inode is dropped when the write doesn't go on with it
+ * Following are the steps:
+ * 1. a write of another file drops the stream of the inode
+ * 2. a write at offset 0 that makes up the whole lower file, with no other writer and no
+ 	stream yet, starts one; O_DIRECT writes leave nothing in the page cache to hash
+ * 3. a write of the streaming file at the end of its stream is hashed
+ * 4. anything else drops the stream
+ * Called after the written range was marked dirty.
+ */
+void wrapfs_stream_write(struct file *file, struct file *lower_file, loff_t pos, size_t count) {
+	struct inode *inode = file->f_path.dentry->d_inode;
+	struct wrapfs_inode_info *info = WRAPFS_I(inode);
+	struct wrapfs_file_info *finfo = WRAPFS_F(file);
+	loff_t size = i_size_read(lower_file->f_path.dentry->d_inode);
+	int start;
+
+	if(ACCESS_ONCE(info->stream_file) != file) {
+		start = !pos && size == count && count && !(lower_file->f_flags & O_DIRECT) &&
+			!info->stream_file && atomic_read(&info->writers) == 1;
+		if(!start) {
+			wrapfs_stream_break(inode);
+			return;
+		}
+		if(!finfo->stream)
+			finfo->stream = stream_alloc(file, lower_file);
+		if(!finfo->stream)
+			return;
+
+		spin_lock(&info->dirty_lock);
+		if(info->stream_file) {
+			/* someone else got there first, neither of us can stream */
+			stream_drop(info);
+			spin_unlock(&info->dirty_lock);
+			return;
+		}
+		info->stream_file = file;
+		spin_unlock(&info->dirty_lock);
+
+		mutex_lock(&finfo->stream->mutex);
+		finfo->stream->pos = 0;
+	}
+	else {
+		mutex_lock(&finfo->stream->mutex);
+		if(pos != finfo->stream->pos || size != pos + count) {
+			wrapfs_stream_break(inode);
+			goto unlock;
+		}
+	}
+
+	if(stream_hash(finfo->stream, lower_file, pos, count)) {
+		wrapfs_stream_break(inode);
+		goto unlock;
+	}
+	finfo->stream->pos = pos + count;
+
+unlock:
+	mutex_unlock(&finfo->stream->mutex);
+}
+
+/* Method to end the stream of a file at its release
+ * Input: wrapfs inode, wrapfs file, lower path, flag telling that this is the last close
+ 	by a writer
+ * Output: returns 1 if integrity_val was stored from the stream, 0 if the file has to be
+ 	rehashed as usual; else returns respective -ERRNO, the file is still dirty then
+ * Following are the steps:
+ * 1. give up the stream of the inode if this file has it
+ * 2. on the last close, if the written ranges are exactly the bytes that were streamed and
+ 	the lower file is that long, take them over
+ * 3. finalize the hash and store it as integrity_val, unless the integrity_type of the
+ 	file changed meanwhile, and save the state for the next append (see resume.c)
+ * 4. free the stream of the file
+ */
+int wrapfs_stream_release(struct inode *inode, struct file *file, struct path *lower_path, int last) {
+	struct wrapfs_inode_info *info = WRAPFS_I(inode);
+	struct wrapfs_file_info *finfo = WRAPFS_F(file);
+	struct wrapfs_stream *stream = finfo->stream;
+	struct wrapfs_dirty_range *range;
+	struct wrapfs_hash_ctx *ctx;
+	struct wrapfs_integrity rec;
+	LIST_HEAD(dirty);
+	unsigned int dirty_all;
+	int owner, retval = 0;
+
+	if(!stream)
+		return 0;
+	finfo->stream = NULL;
+
+	spin_lock(&info->dirty_lock);
+	owner = info->stream_file == file;
+	if(owner)
+		stream_drop(info);
+	if(!owner || !last || info->dirty_all || info->nr_dirty_ranges != 1)
+		goto unlock;
+	range = list_first_entry(&info->dirty_ranges, struct wrapfs_dirty_range, list);
+	if(range->start || range->end != stream->pos ||
+		i_size_read(lower_path->dentry->d_inode) != stream->pos)
+		goto unlock;
+	retval = 1;
+unlock:
+	spin_unlock(&info->dirty_lock);
+	if(retval != 1)
+		goto out;
+
+	/* from here on the file is clean or made dirty again */
+	wrapfs_take_dirty(inode, &dirty, &dirty_all);
+	wrapfs_free_dirty(&dirty);
+
+	retval = get_integrity_record(inode, *lower_path, &rec);
+	if(retval<0)
+		goto fail;
+	if(integrity_record_flag(&rec) != 1 || strcmp(integrity_record_type(&rec), stream->type)) {
+		/* protection or type changed while it was written, hash it the usual way */
+		wrapfs_mark_dirty_all(inode);
+		retval = 0;
+		goto out;
+	}
+
+	ctx = wrapfs_get_hash(stream->pool);
+	retval = wrapfs_hash_import(ctx, stream->state);
+	if(!retval)
+		retval = wrapfs_hash_final(ctx, rec.ival);
+	wrapfs_put_hash(ctx);
+	if(retval)
+		goto fail;
+	rec.ilen = stream->pool->digest_size;
+
+	retval = put_integrity_record(inode, *lower_path, &rec);
+	if(retval<0)
+		goto fail;
+	/* the next append of a large file goes on from here */
+	wrapfs_resume_save(*lower_path, stream->pool, stream->state, stream->pos, rec.ival, rec.ilen);
+	retval = 1;
+	goto out;
+
+fail:
+	printk("wrapfs_stream_release: cannot store the streamed %s, err=%d\n", ATTR_INTEGRITY_VAL, retval);
+	wrapfs_mark_dirty_all(inode);
+out:
+	kfree(stream);
+	return retval;
+}
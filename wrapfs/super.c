@@ -32,6 +32,21 @@ static void wrapfs_put_super(struct super_block *sb)
 	wrapfs_set_lower_super(sb, NULL);
 	atomic_dec(&s->s_active);
 
+	if (spd->pending_dir.dentry)
+		path_put(&spd->pending_dir);
+	if (spd->sidecar.dentry)
+		path_put(&spd->sidecar);
+	/* evict has run the rehash of every inode, this only waits for the queue */
+	if (spd->rehash_wq)
+		destroy_workqueue(spd->rehash_wq);
+	if (spd->verify_wq)
+		destroy_workqueue(spd->verify_wq);
+	wrapfs_destroy_vcache(sb);
+	/* the trees of the evicted inodes still hold their sidecars */
+	merkle_flush_freed();
+	wrapfs_destroy_hash_pools(sb);
+	put_cred(spd->kernel_cred);
+
 	kfree(spd);
 	sb->s_fs_info = NULL;
 }
@@ -70,9 +85,45 @@ static int wrapfs_remount_fs(struct super_block *sb, int *flags, char *options)
 		err = -EINVAL;
 	}
 
+	/* verify=, pending= and the scrub options can be changed on remount */
+	if (!err)
+		err = wrapfs_parse_options(sb, options, 1);
+	if (!err)
+		err = wrapfs_scrub_ctl(sb, WRAPFS_SB(sb)->scrub_cmd);
+
 	return err;
 }
 
+/* show the options that differ from the defaults, as they are now */
+static int wrapfs_show_options(struct seq_file *m, struct vfsmount *mnt)
+{
+	struct wrapfs_sb_info *sbi = WRAPFS_SB(mnt->mnt_sb);
+	char verify[WRAPFS_VERIFY_MAXLEN + 1];
+	unsigned char verify_mode;
+	unsigned int verify_period;
+
+	if (sbi->rehash_mode == WRAPFS_REHASH_DEFERRED)
+		seq_puts(m, ",rehash=deferred");
+	if (sbi->pending_mode == WRAPFS_PENDING_OPEN)
+		seq_puts(m, ",pending=open");
+	if (sbi->vcache_max != WRAPFS_VCACHE_DEFAULT)
+		seq_printf(m, ",vcache=%lu", sbi->vcache_max);
+
+	spin_lock(&sbi->verify_lock);
+	verify_mode = sbi->verify_mode;
+	verify_period = sbi->verify_period;
+	spin_unlock(&sbi->verify_lock);
+	if (verify_mode != WRAPFS_VERIFY_OPEN) {
+		wrapfs_format_verify(verify_mode, verify_period, verify);
+		seq_printf(m, ",verify=%s", verify);
+	}
+	if (sbi->scrub_bps != WRAPFS_SCRUB_BPS_DEFAULT)
+		seq_printf(m, ",scrub_bps=%u", sbi->scrub_bps);
+	if (sbi->scrub_iops != WRAPFS_SCRUB_IOPS_DEFAULT)
+		seq_printf(m, ",scrub_iops=%u", sbi->scrub_iops);
+	return 0;
+}
+
 /*
  * Called by iput() when the inode reference count reached zero
  * and the inode is not hashed anywhere.  Used to clear anything
@@ -82,9 +133,18 @@ static int wrapfs_remount_fs(struct super_block *sb, int *flags, char *options)
 static void wrapfs_evict_inode(struct inode *inode)
 {
 	struct inode *lower_inode;
+	LIST_HEAD(dirty);
+	unsigned int dirty_all;
 
+	/* a deferred rehash still needs the inode, run it now */
+	flush_work_sync(&WRAPFS_I(inode)->rehash_work);
+	/* a background check is of no use anymore */
+	wrapfs_cancel_verify(inode);
 	truncate_inode_pages(&inode->i_data, 0);
 	end_writeback(inode);
+	merkle_release(inode);
+	wrapfs_take_dirty(inode, &dirty, &dirty_all);
+	wrapfs_free_dirty(&dirty);
 	/*
 	 * Decrement a reference to a lower_inode, which was incremented
 	 * by our read_inode when it was created initially.
@@ -104,6 +164,16 @@ static struct inode *wrapfs_alloc_inode(struct super_block *sb)
 
 	/* memset everything up to the inode to 0 */
 	memset(i, 0, offsetof(struct wrapfs_inode_info, vfs_inode));
+	mutex_init(&i->merkle_mutex);
+	mutex_init(&i->verify_mutex);
+	mutex_init(&i->pending_mutex);
+	spin_lock_init(&i->dirty_lock);
+	seqcount_init(&i->verified_seq);
+	spin_lock_init(&i->integrity_lock);
+	INIT_LIST_HEAD(&i->dirty_ranges);
+	INIT_LIST_HEAD(&i->batch_list);
+	INIT_WORK(&i->rehash_work, wrapfs_rehash_work);
+	INIT_WORK(&i->verify_work, wrapfs_verify_work);
 
 	i->vfs_inode.i_version = 1;
 	return &i->vfs_inode;
@@ -161,7 +231,7 @@ const struct super_operations wrapfs_sops = {
 	.remount_fs	= wrapfs_remount_fs,
 	.evict_inode	= wrapfs_evict_inode,
 	.umount_begin	= wrapfs_umount_begin,
-	.show_options	= generic_show_options,
+	.show_options	= wrapfs_show_options,
 	.alloc_inode	= wrapfs_alloc_inode,
 	.destroy_inode	= wrapfs_destroy_inode,
 	.drop_inode	= generic_delete_inode,
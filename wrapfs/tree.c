@@ -0,0 +1,232 @@
+/*
+ * This file contains the chunked tree hash used by the "tree(<algo>)"
+ * integrity_type family.
+ *
+ * A flat hash is one sequential hash state, so checking a large file uses
+ * a single CPU however many are idle. The tree family splits the file into
+ * chunks of 1 << chunk_shift bytes and hashes them independently:
+ *
+ *	root = H(le64 file size || H(chunk 0) || H(chunk 1) || ...)
+ *
+ * chunk_shift starts at WRAPFS_TREE_CHUNK_SHIFT and grows with the file so
+ * that it never has more than WRAPFS_TREE_MAX_CHUNKS chunks; it is derived
+ * from the size alone, so the root doesn't depend on the machine. Only the
+ * root is stored against integrity_val.
+ *
+ * The chunks are handed out to work items on the hash workqueue of the
+ * mount, one per online CPU, and the caller works through them too. Every
+ * worker opens its own lower file, so each one gets its own readahead
+ * state, and takes a context from the pool of the algo for one chunk at a
+ * time.
+ *
+ * Every whole chunk of a hole has the same digest. The first one is hashed
+ * (from the zero page, without reading it) and the others copy its digest,
+ * so a sparse file costs its allocated chunks.
+ */
+
+#include "wrapfs.h"
+
+/* a tree hash shared by the caller and its workers */
+struct tree_job {
+	struct path lower_path;
+	const struct cred *cred;	/* of the caller, used to open the file */
+	struct wrapfs_hash_pool *pool;
+	loff_t size;
+	unsigned int chunk_shift;
+	unsigned long nr_chunks;
+	atomic_t next;			/* next chunk to hash */
+	atomic_t err;			/* first error of a worker */
+	atomic_t running;		/* workers, the caller included */
+	struct completion done;		/* the last worker finished */
+	unsigned char *digests;		/* le64 size followed by the chunk digests */
+	unsigned int zero_ok;		/* zero_digest is set */
+	unsigned char zero_digest[MAXLEN];	/* of a whole chunk of a hole */
+};
+
+struct tree_worker {
+	struct work_struct work;
+	struct tree_job *job;
+};
+
+/* chunk size for a file of size bytes, see the top of the file */
+static unsigned int tree_chunk_shift(loff_t size) {
+	unsigned int shift = WRAPFS_TREE_CHUNK_SHIFT;
+
+	while((size >> shift) >= WRAPFS_TREE_MAX_CHUNKS)
+		shift++;
+	return shift;
+}
+
+/* hash one chunk of the file into its slot of job->digests */
+static int tree_hash_chunk(struct tree_job *job, struct file *filp, unsigned long index) {
+	struct wrapfs_hash_ctx *ctx;
+	loff_t pos = (loff_t)index << job->chunk_shift;
+	loff_t len = min_t(loff_t, (loff_t)1 << job->chunk_shift, job->size - pos);
+	unsigned char *out = job->digests + sizeof(__le64) + index * job->pool->digest_size;
+	int hole, retval;
+
+	ctx = wrapfs_get_hash(job->pool);
+	hole = len == (loff_t)1 << job->chunk_shift && job->pool->digest_size <= MAXLEN &&
+		wrapfs_hash_hole(ctx, filp, pos, len);
+	if(hole && ACCESS_ONCE(job->zero_ok)) {
+		/* pairs with the barrier below */
+		smp_rmb();
+		memcpy(out, job->zero_digest, job->pool->digest_size);
+		wrapfs_put_hash(ctx);
+		return 0;
+	}
+
+	retval = wrapfs_hash_init(ctx);
+	if(!retval)
+		retval = wrapfs_hash_range(ctx, filp, pos, len);
+	if(!retval)
+		retval = wrapfs_hash_final(ctx, out);
+	wrapfs_put_hash(ctx);
+
+	/* workers racing here all store the same digest */
+	if(!retval && hole && !job->zero_ok) {
+		memcpy(job->zero_digest, out, job->pool->digest_size);
+		smp_wmb();
+		job->zero_ok = 1;
+	}
+	return retval;
+}
+
+/* Method run by every worker of a tree hash, the caller included
+ * Input: the job
+ * Output: none, the first error is left in job->err
+ * Following are the steps:
+ * 1. open the lower file with the cred of the caller
+ * 2. take the next chunk until all of them are handed out or a worker failed
+ * 3. the last worker to finish completes the job
+ */
+static void tree_run(struct tree_job *job) {
+	struct file *filp;
+	unsigned long index;
+	int retval = 0;
+
+	/* dentry_open consumes the references, so take our own */
+	path_get(&job->lower_path);
+	filp = dentry_open(job->lower_path.dentry, job->lower_path.mnt, O_RDONLY | O_LARGEFILE, job->cred);
+	if(IS_ERR(filp)) {
+		printk("tree_run: cannot open the file in O_RDONLY mode\n");
+		retval = PTR_ERR(filp);
+		goto out;
+	}
+	wrapfs_hash_readahead(filp);
+
+	while(!atomic_read(&job->err)) {
+		index = atomic_inc_return(&job->next) - 1;
+		if(index >= job->nr_chunks)
+			break;
+		retval = tree_hash_chunk(job, filp, index);
+		if(retval)
+			break;
+	}
+	fput(filp);
+
+out:
+	if(retval)
+		atomic_cmpxchg(&job->err, 0, retval);
+	if(atomic_dec_and_test(&job->running))
+		complete(&job->done);
+}
+
+static void tree_work(struct work_struct *work) {
+	struct tree_worker *worker = container_of(work, struct tree_worker, work);
+
+	tree_run(worker->job);
+}
+
+/* Core method to compute the tree hash of a file
+ * Input: wrapfs inode, lower_path, inner crypto algo, buffer for the root, size of the buffer
+ * Output: return 0 if the all steps are successful; else return respective -ERRNO,
+ 	*rlen is set to the length of the root
+ * Following are the steps:
+ * 1. get the pool of the algo and split the file into chunks
+ * 2. queue one worker per online CPU, as many as there are chunks and contexts
+ * 3. hash chunks in the caller as well and wait for the workers
+ * 4. hash the size and the chunk digests into the root
+ */
+long tree_hash(struct inode *inode, struct path lower_path, const char *algo,
+	unsigned char *root, unsigned int *rlen) {
+
+	long retval = 0;
+	struct wrapfs_sb_info *sbi = WRAPFS_SB(inode->i_sb);
+	struct tree_job job;
+	struct tree_worker *workers = NULL;
+	struct wrapfs_hash_ctx *ctx;
+	struct scatterlist sg;
+	unsigned int i, nr_workers = 0;
+
+	job.pool = wrapfs_hash_pool(inode->i_sb, algo);
+	if(IS_ERR(job.pool)) {
+		printk("tree_hash: error attempting to allocate crypto context\n");
+		retval = PTR_ERR(job.pool);
+		goto out;
+	}
+
+	if(job.pool->digest_size > *rlen) {
+		printk("tree_hash: buf length is too short to store the root\n");
+		retval = -EINVAL;
+		goto out;
+	}
+	*rlen = job.pool->digest_size;
+
+	job.lower_path = lower_path;
+	job.size = i_size_read(lower_path.dentry->d_inode);
+	job.chunk_shift = tree_chunk_shift(job.size);
+	job.nr_chunks = (job.size + ((loff_t)1 << job.chunk_shift) - 1) >> job.chunk_shift;
+	atomic_set(&job.next, 0);
+	atomic_set(&job.err, 0);
+	init_completion(&job.done);
+	job.zero_ok = 0;
+
+	job.digests = kmalloc(sizeof(__le64) + job.nr_chunks * job.pool->digest_size, GFP_KERNEL);
+	if(!job.digests) {
+		printk("tree_hash: out of memory for digests\n");
+		retval = -ENOMEM;
+		goto out;
+	}
+	*(__le64 *)job.digests = cpu_to_le64(job.size);
+
+	/* the caller is a worker too, the others come from the workqueue */
+	if(sbi->hash_wq && job.nr_chunks > 1) {
+		nr_workers = min_t(unsigned long, num_online_cpus(), job.nr_chunks);
+		nr_workers = min(nr_workers, job.pool->nr_ctx) - 1;
+		if(nr_workers) {
+			workers = kcalloc(nr_workers, sizeof(*workers), GFP_KERNEL);
+			if(!workers)
+				nr_workers = 0;
+		}
+	}
+
+	job.cred = get_current_cred();
+	atomic_set(&job.running, nr_workers + 1);
+	for(i = 0; i < nr_workers; i++) {
+		workers[i].job = &job;
+		INIT_WORK(&workers[i].work, tree_work);
+		queue_work(sbi->hash_wq, &workers[i].work);
+	}
+	tree_run(&job);
+	wait_for_completion(&job.done);
+	put_cred(job.cred);
+
+	retval = atomic_read(&job.err);
+	if(retval) {
+		printk("tree_hash: cannot hash the file, err=%ld\n", retval);
+		goto free_digests;
+	}
+
+	/* the digests are kmalloc'ed, so they can go to the crypto layer as they are */
+	sg_init_one(&sg, job.digests, sizeof(__le64) + job.nr_chunks * job.pool->digest_size);
+	ctx = wrapfs_get_hash(job.pool);
+	retval = wrapfs_hash_digest(ctx, &sg, sg.length, root);
+	wrapfs_put_hash(ctx);
+
+free_digests:
+	kfree(workers);
+	kfree(job.digests);
+out:
+	return retval;
+}
@@ -0,0 +1,198 @@
+/*
+ * This file contains the verified digest cache of a mount.
+ *
+ * The verified state of a file (see wrapfs_is_verified) lives in its wrapfs
+ * inode and goes away when the inode is evicted, so under memory pressure a
+ * file opened over and over is hashed again every time its inode is thrown
+ * out. The vcache keeps the outcome of the checks in the super block
+ * instead: an entry is keyed by the number and generation of the lower inode
+ * and holds the integrity_val that matched the contents, with the stamp of
+ * the lower inode taken before they were hashed. When an inode comes back
+ * and its lower inode still has that stamp and its record still has that
+ * integrity_val, the check is a lookup. A racy stamp (see wrapfs_get_stamp)
+ * doesn't tell a later write apart, so it never gets an entry.
+ *
+ * Lookups walk the hash table under RCU. Entries are never changed once they
+ * are in the table, a newer check of the same file replaces its entry. The
+ * table is bounded by the vcache=<entries> mount option and the entries are
+ * evicted from the tail of an LRU list; a lookup only sets the referenced
+ * bit of the entry, which gives it one more trip around the list (second
+ * chance), so readers never take the lock. A shrinker lets the VM trim the
+ * cache like it trims the inode cache.
+ */
+
+#include "wrapfs.h"
+
+struct wrapfs_vcache_entry {
+	struct hlist_node hash;		/* in vcache_table, RCU */
+	struct list_head lru;		/* in vcache_lru, under vcache_lock */
+	struct rcu_head rcu;
+	unsigned long ino;		/* of the lower inode */
+	u32 generation;
+	unsigned int referenced;	/* looked up since it last went round the lru */
+	struct wrapfs_stamp stamp;	/* of the lower inode when it was hashed */
+	unsigned int ilen;
+	unsigned char ival[MAXLEN];	/* the integrity_val that matched */
+};
+
+static struct hlist_head *vcache_bucket(struct wrapfs_sb_info *sbi, struct inode *lower_inode) {
+	return &sbi->vcache_table[hash_long(lower_inode->i_ino ^ lower_inode->i_generation,
+		WRAPFS_VCACHE_BITS)];
+}
+
+/* drop an entry, the caller holds vcache_lock */
+static void vcache_unlink(struct wrapfs_sb_info *sbi, struct wrapfs_vcache_entry *e) {
+	hlist_del_rcu(&e->hash);
+	list_del(&e->lru);
+	sbi->vcache_nr--;
+	kfree_rcu(e, rcu);
+}
+
+/* evict up to nr entries from the tail of the lru, the caller holds vcache_lock */
+static void vcache_evict(struct wrapfs_sb_info *sbi, unsigned long nr) {
+	struct wrapfs_vcache_entry *e;
+
+	while(nr-- && !list_empty(&sbi->vcache_lru)) {
+		e = list_entry(sbi->vcache_lru.prev, struct wrapfs_vcache_entry, lru);
+		if(e->referenced) {
+			/* second chance */
+			e->referenced = 0;
+			list_move(&e->lru, &sbi->vcache_lru);
+			continue;
+		}
+		vcache_unlink(sbi, e);
+	}
+}
+
+/* the VM asks for memory: trim nr_to_scan entries and tell how many are left */
+static int vcache_shrink(struct shrinker *shrink, struct shrink_control *sc) {
+	struct wrapfs_sb_info *sbi = container_of(shrink, struct wrapfs_sb_info, vcache_shrinker);
+	unsigned long nr;
+
+	spin_lock(&sbi->vcache_lock);
+	if(sc->nr_to_scan)
+		vcache_evict(sbi, sc->nr_to_scan);
+	nr = sbi->vcache_nr;
+	spin_unlock(&sbi->vcache_lock);
+
+	return (nr * sysctl_vfs_cache_pressure) / 100;
+}
+
+/* Method to set up the vcache of a super block, called at mount
+ * Input: wrapfs super block, vcache_max already set by the mount options
+ * Output: none, the mount goes without a vcache if the table can't be allocated
+ */
+void wrapfs_init_vcache(struct super_block *sb) {
+	struct wrapfs_sb_info *sbi = WRAPFS_SB(sb);
+	unsigned int i;
+
+	spin_lock_init(&sbi->vcache_lock);
+	INIT_LIST_HEAD(&sbi->vcache_lru);
+	sbi->vcache_nr = 0;
+	if(!sbi->vcache_max)
+		return;
+
+	sbi->vcache_table = kmalloc(sizeof(struct hlist_head) << WRAPFS_VCACHE_BITS, GFP_KERNEL);
+	if(!sbi->vcache_table) {
+		printk("wrapfs_init_vcache: out of memory, running without a vcache\n");
+		return;
+	}
+	for(i = 0; i < (1 << WRAPFS_VCACHE_BITS); i++)
+		INIT_HLIST_HEAD(&sbi->vcache_table[i]);
+
+	sbi->vcache_shrinker.shrink = vcache_shrink;
+	sbi->vcache_shrinker.seeks = DEFAULT_SEEKS;
+	register_shrinker(&sbi->vcache_shrinker);
+}
+
+/* Method to free the vcache of a super block, called at unmount */
+void wrapfs_destroy_vcache(struct super_block *sb) {
+	struct wrapfs_sb_info *sbi = WRAPFS_SB(sb);
+
+	if(!sbi->vcache_table)
+		return;
+
+	unregister_shrinker(&sbi->vcache_shrinker);
+	spin_lock(&sbi->vcache_lock);
+	vcache_evict(sbi, ULONG_MAX);
+	spin_unlock(&sbi->vcache_lock);
+	/* the entries go with kfree_rcu, only the table is ours to free now */
+	kfree(sbi->vcache_table);
+	sbi->vcache_table = NULL;
+}
+
+/* Method to check whether the vcache knows the contents of a file to match its record
+ * Input: wrapfs inode, stamp of the lower inode taken now, integrity record of the file
+ * Output: returns 1 if the file was verified with this integrity_val and the lower
+ 	inode hasn't changed since; else returns 0
+ */
+int wrapfs_vcache_lookup(struct inode *inode, const struct wrapfs_stamp *stamp,
+	const struct wrapfs_integrity *rec) {
+	struct wrapfs_sb_info *sbi = WRAPFS_SB(inode->i_sb);
+	struct inode *lower_inode = wrapfs_lower_inode(inode);
+	struct wrapfs_vcache_entry *e;
+	struct hlist_node *pos;
+	int retval = 0;
+
+	if(!sbi->vcache_table)
+		return 0;
+
+	rcu_read_lock();
+	hlist_for_each_entry_rcu(e, pos, vcache_bucket(sbi, lower_inode), hash) {
+		if(e->ino != lower_inode->i_ino || e->generation != lower_inode->i_generation)
+			continue;
+		retval = wrapfs_same_stamp(&e->stamp, stamp) && e->ilen == rec->ilen &&
+			!memcmp(e->ival, rec->ival, rec->ilen);
+		if(retval && !e->referenced)
+			e->referenced = 1;
+		break;
+	}
+	rcu_read_unlock();
+
+	return retval;
+}
+
+/* Method to remember in the vcache that a file matched its integrity_val
+ * Input: wrapfs inode, stamp of the lower inode taken before the file was hashed,
+ 	integrity_val and its length
+ * Output: none, nothing is remembered if memory is short or the stamp is racy
+ * Following are the steps:
+ * 1. fill a new entry
+ * 2. replace the entry of the same lower inode, if there is one, else add it
+ * 3. evict from the tail of the lru while the cache is over vcache_max
+ */
+void wrapfs_vcache_insert(struct inode *inode, const struct wrapfs_stamp *stamp,
+	const unsigned char *ival, unsigned int ilen) {
+	struct wrapfs_sb_info *sbi = WRAPFS_SB(inode->i_sb);
+	struct inode *lower_inode = wrapfs_lower_inode(inode);
+	struct wrapfs_vcache_entry *e, *old;
+	struct hlist_head *head;
+	struct hlist_node *pos;
+
+	if(!sbi->vcache_table || ilen > MAXLEN || stamp->racy)
+		return;
+
+	e = kzalloc(sizeof(*e), GFP_KERNEL);
+	if(!e)
+		return;
+	e->ino = lower_inode->i_ino;
+	e->generation = lower_inode->i_generation;
+	e->stamp = *stamp;
+	e->ilen = ilen;
+	memcpy(e->ival, ival, ilen);
+
+	head = vcache_bucket(sbi, lower_inode);
+	spin_lock(&sbi->vcache_lock);
+	hlist_for_each_entry(old, pos, head, hash) {
+		if(old->ino == e->ino && old->generation == e->generation) {
+			vcache_unlink(sbi, old);
+			break;
+		}
+	}
+	hlist_add_head_rcu(&e->hash, head);
+	list_add(&e->lru, &sbi->vcache_lru);
+	sbi->vcache_nr++;
+	while(sbi->vcache_nr > sbi->vcache_max)
+		vcache_evict(sbi, 1);
+	spin_unlock(&sbi->vcache_lock);
+}
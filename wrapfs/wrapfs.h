@@ -29,9 +29,27 @@
 #include <linux/err.h> // for ISERR, PTR_ERR
 #include <linux/scatterlist.h> // for scatterlist
 #include <linux/crypto.h> // for crypto_alloc_hash, crypto_hash_update, crypto_hash_final, ...
+#include <crypto/hash.h> // for crypto_alloc_ahash, crypto_ahash_update, ...
+#include <linux/completion.h> // for completion
 #include <asm/string.h> // strnlen_user
 #include <linux/xattr.h> // for vfs_setxattr, vfs_getxattr
 #include <asm/page.h> // for PAGE_SIZE
+#include <linux/cred.h> // for prepare_kernel_cred, override_creds
+#include <linux/vmalloc.h> // for vzalloc
+#include <linux/bitops.h> // for test_bit, set_bit
+#include <linux/log2.h> // for roundup_pow_of_two
+#include <linux/rculist.h> // for hlist_for_each_entry_rcu
+#include <linux/hash.h> // for hash_long
+#include <linux/workqueue.h> // for alloc_workqueue, queue_work
+#include <linux/parser.h> // for match_token
+#include <linux/kthread.h> // for kthread_run, kthread_stop
+#include <linux/seqlock.h> // for seqcount_t, read_seqcount_begin
+#include <linux/freezer.h> // for set_freezable, try_to_freeze
+#include <linux/math64.h> // for div_u64
+#include <linux/exportfs.h> // for exportfs_encode_fh, exportfs_decode_fh
+#include <linux/fiemap.h> // for fiemap_extent, FIEMAP_EXTENT_UNWRITTEN
+#include <linux/random.h> // for get_random_bytes
+#include <linux/rwsem.h> // for down_read, up_read
 
 /* the file system name */
 #define WRAPFS_NAME "wrapfs"
@@ -49,6 +67,7 @@ extern const struct inode_operations wrapfs_main_iops;
 extern const struct inode_operations wrapfs_dir_iops;
 extern const struct inode_operations wrapfs_symlink_iops;
 extern const struct super_operations wrapfs_sops;
+extern int wrapfs_parse_options(struct super_block *sb, char *options, int remount);
 extern const struct dentry_operations wrapfs_dops;
 extern const struct address_space_operations wrapfs_aops, wrapfs_dummy_aops;
 extern const struct vm_operations_struct wrapfs_vm_ops;
@@ -74,27 +93,247 @@ extern int wrapfs_removexattr(struct dentry *dentry, const char *name);
 extern ssize_t wrapfs_listxattr(struct dentry *dentry, char *list, size_t size);
 
 /* functions related to integrity */
-extern int has_integrity(struct path lower_path);
-extern long get_integrity(struct path lower_path, unsigned char *ibuf, unsigned int ilen);
-extern long set_has_integrity(struct path lower_path, unsigned char buf);
-extern long set_integrity_val(struct path lower_path);
-extern long compute_integrity(struct path lower_path, unsigned char *ibuf, unsigned int ilen, 
-	unsigned int flag, const char *algo);
-extern int check_integrity(struct path lower_path);
+struct wrapfs_integrity;
+struct wrapfs_stamp;
+extern long get_integrity_record(struct inode *inode, struct path lower_path, struct wrapfs_integrity *rec);
+extern long put_integrity_record(struct inode *inode, struct path lower_path, struct wrapfs_integrity *rec);
+extern int integrity_record_flag(const struct wrapfs_integrity *rec);
+extern const char *integrity_record_type(const struct wrapfs_integrity *rec);
+extern int has_integrity(struct inode *inode, struct path lower_path);
+extern long get_integrity(struct inode *inode, struct path lower_path, unsigned char *ibuf, unsigned int ilen);
+extern long set_has_integrity(struct inode *inode, struct path lower_path,
+	const struct wrapfs_integrity *parent);
+extern long set_integrity_val(struct inode *inode, struct path lower_path);
+extern long compute_integrity(struct inode *inode, struct path lower_path, unsigned char *ibuf,
+	unsigned int *ilen, unsigned int flag, const char *algo, struct file *lower_file);
+extern long compute_integrity_unlocked(struct inode *inode, struct path lower_path,
+	struct wrapfs_integrity *rec, struct dentry **lower_parent);
+extern int check_integrity_shared(struct inode *inode, struct path lower_path,
+	const struct wrapfs_integrity *rec, struct file *lower_file, unsigned int fresh);
+extern int check_integrity(struct inode *inode, struct path lower_path, const struct wrapfs_integrity *rec,
+	struct file *lower_file, unsigned int fresh);
 extern int compare_integrity(unsigned char *ibuf1, unsigned char *ibuf2, unsigned int ilen);
-extern int calculate_integrity(char *dest, char *src, int len, const char *algo);
+extern int calculate_integrity(struct super_block *sb, char *dest, char *src, int len, const char *algo);
+extern int parse_integrity_type(const char *type, char *algo, unsigned int len);
+extern int check_integrity_type(const char *type);
+extern long get_integrity_type(struct inode *inode, struct path lower_path, char *type, unsigned int len);
+extern long update_integrity_val(struct inode *inode, struct path lower_path,
+	struct list_head *dirty, unsigned int dirty_all);
+extern void wrapfs_mark_dirty(struct inode *inode, loff_t start, loff_t end);
+extern void wrapfs_mark_dirty_all(struct inode *inode);
+extern void wrapfs_take_dirty(struct inode *inode, struct list_head *dirty, unsigned int *dirty_all);
+extern void wrapfs_free_dirty(struct list_head *dirty);
+extern void wrapfs_get_stamp(struct inode *lower_inode, struct wrapfs_stamp *stamp);
+extern int wrapfs_is_verified(struct inode *inode);
+extern int wrapfs_is_verified_within(struct inode *inode, unsigned int period);
+extern int wrapfs_same_stamp(const struct wrapfs_stamp *a, const struct wrapfs_stamp *b);
+extern int wrapfs_set_verified(struct inode *inode, const struct wrapfs_stamp *stamp);
+extern void wrapfs_clear_verified(struct inode *inode);
+extern int wrapfs_defer_rehash(struct inode *inode, struct path *lower_path);
+extern void wrapfs_queue_rehash(struct inode *inode, struct path *lower_path,
+	struct workqueue_struct *wq);
+extern void wrapfs_rehash_work(struct work_struct *work);
+extern int wrapfs_rehash_take(struct inode *inode, struct path *lower_path);
+extern void wrapfs_rehash_done(struct inode *inode, struct path *lower_path);
+extern int wrapfs_pending_rehash(struct inode *inode);
+extern int wrapfs_parse_verify(const char *value, unsigned char *mode, unsigned int *period);
+extern int wrapfs_format_verify(unsigned char mode, unsigned int period, char *buf);
+extern int wrapfs_verify_open(struct inode *inode, struct file *lower_file,
+	const struct wrapfs_integrity *rec);
+extern int wrapfs_verify_read(struct inode *inode, struct file *lower_file);
+extern void wrapfs_verify_work(struct work_struct *work);
+extern void wrapfs_cancel_verify(struct inode *inode);
+
+/* per-mount cache of verified digests (vcache.c) */
+extern void wrapfs_init_vcache(struct super_block *sb);
+extern void wrapfs_destroy_vcache(struct super_block *sb);
+extern int wrapfs_vcache_lookup(struct inode *inode, const struct wrapfs_stamp *stamp,
+	const struct wrapfs_integrity *rec);
+extern void wrapfs_vcache_insert(struct inode *inode, const struct wrapfs_stamp *stamp,
+	const unsigned char *ival, unsigned int ilen);
+
+/* crash-safe markers of the files being written (pending.c) */
+extern void wrapfs_mark_pending(struct inode *inode, struct path *lower_path);
+extern void wrapfs_clear_pending(struct inode *inode, struct path *lower_path, int writers);
+extern void wrapfs_init_pending(struct super_block *sb);
+extern void wrapfs_flush_pending(struct super_block *sb);
+
+/* online scrubber of a mount (scrub.c) */
+extern void wrapfs_init_scrub(struct super_block *sb);
+extern int wrapfs_scrub_ctl(struct super_block *sb, unsigned int cmd);
+extern ssize_t wrapfs_scrub_status(struct super_block *sb, char *buf, size_t size);
+
+/* batched rehashes of small files (batch.c) */
+extern void wrapfs_init_batch(struct super_block *sb);
+extern void wrapfs_flush_batch(struct super_block *sb);
+extern int wrapfs_batch_fits(struct path *lower_path);
+extern void wrapfs_batch_add(struct inode *inode);
+
+/* hashing of a file as it is written (stream.c) */
+extern void wrapfs_stream_write(struct file *file, struct file *lower_file, loff_t pos, size_t count);
+extern void wrapfs_stream_break(struct inode *inode);
+extern int wrapfs_stream_release(struct inode *inode, struct file *file, struct path *lower_path, int last);
+
+/* per-mount pools of crypto hash contexts (hash.c) */
+struct wrapfs_hash_pool;
+extern void wrapfs_init_hash_pools(struct super_block *sb);
+extern void wrapfs_destroy_hash_pools(struct super_block *sb);
+extern struct wrapfs_hash_pool *wrapfs_hash_pool(struct super_block *sb, const char *algo);
+extern struct wrapfs_hash_ctx *wrapfs_get_hash(struct wrapfs_hash_pool *pool);
+extern struct wrapfs_hash_ctx *wrapfs_try_get_hash(struct wrapfs_hash_pool *pool);
+extern void wrapfs_put_hash(struct wrapfs_hash_ctx *ctx);
+extern void wrapfs_hash_readahead(struct file *filp);
+extern int wrapfs_hash_init(struct wrapfs_hash_ctx *ctx);
+extern int wrapfs_hash_final(struct wrapfs_hash_ctx *ctx, unsigned char *out);
+extern int wrapfs_hash_import(struct wrapfs_hash_ctx *ctx, const void *state);
+extern int wrapfs_hash_export(struct wrapfs_hash_ctx *ctx, void *state);
+extern int wrapfs_hash_digest(struct wrapfs_hash_ctx *ctx, struct scatterlist *sg, unsigned int nbytes,
+	unsigned char *out);
+extern int wrapfs_hash_range(struct wrapfs_hash_ctx *ctx, struct file *filp, loff_t pos, loff_t len);
+extern int wrapfs_hash_hole(struct wrapfs_hash_ctx *ctx, struct file *filp, loff_t pos, loff_t len);
+extern void wrapfs_hash_prefetch_file(struct file *filp, loff_t len);
+extern int wrapfs_hash_start(struct wrapfs_hash_ctx *ctx, struct file *filp, loff_t len, unsigned char *out);
+extern int wrapfs_hash_finish(struct wrapfs_hash_ctx *ctx, int pending);
+
+/* choice of the fastest crypto driver of an algo (bench.c) */
+extern void wrapfs_bench_init(void);
+extern int wrapfs_bench_pick(const char *algo, char *driver, size_t len);
+
+/* the xxhash64 integrity_type (xxhash.c) */
+extern void wrapfs_init_xxhash(void);
+extern void wrapfs_exit_xxhash(void);
+
+/* saved hash state of the files that only grow (resume.c) */
+extern void wrapfs_resume_save(struct path lower_path, struct wrapfs_hash_pool *pool, const void *state,
+	loff_t len, const unsigned char *ival, unsigned int ilen);
+extern long wrapfs_resume_rehash(struct inode *inode, struct path lower_path, struct wrapfs_integrity *rec,
+	const char *algo, struct list_head *dirty, unsigned int dirty_all);
+
+/* functions related to the chunked tree hash (tree.c) */
+extern long tree_hash(struct inode *inode, struct path lower_path, const char *algo,
+	unsigned char *root, unsigned int *rlen);
+
+/* functions related to the block hash tree (merkle.c) */
+extern long merkle_build(struct inode *inode, struct path lower_path, const char *algo,
+	unsigned char *root, unsigned int *rlen);
+extern long merkle_update(struct inode *inode, struct path lower_path, const char *algo,
+	struct list_head *dirty, unsigned char *root, unsigned int *rlen);
+extern int merkle_open(struct inode *inode, struct path lower_path, const char *algo,
+	unsigned char *root, unsigned int rlen);
+extern int merkle_verify_range(struct inode *inode, struct file *lower_file,
+	loff_t pos, size_t count);
+extern void merkle_release(struct inode *inode);
+extern void merkle_flush_freed(void);
+extern void merkle_remove_tree(struct super_block *sb, struct inode *lower_inode);
+extern int wrapfs_init_sidecar(struct super_block *sb);
+extern int wrapfs_sidecar_dir(struct super_block *sb, struct path *dir);
 
 
 #define CHUNKSIZE PAGE_SIZE
 
+/* page cache pages per crypto update and readahead window when hashing a file */
+#define WRAPFS_HASH_BATCH 16
+#define WRAPFS_HASH_RA_PAGES ((2 * 1024 * 1024) / PAGE_CACHE_SIZE)
+/* batches whose reads are kept in flight ahead of the one being hashed */
+#define WRAPFS_HASH_DEPTH 4
+/* times a file changing under compute_integrity_unlocked is hashed before giving up */
+#define WRAPFS_HASH_RETRIES 3
+/* extents asked from fiemap at a time when looking for holes */
+#define WRAPFS_HOLE_EXTENTS 16
+
 #define ATTR_HAS_INTEGRITY "user.has_integrity"
 #define ATTR_INTEGRITY_VAL "user.integrity_val"
 #define ATTR_INTEGRITY_TYPE "user.integrity_type"
-#define MAXLEN_ALGO_NAME 10
+/* the three above are stored together in this one, see integrity.c */
+#define ATTR_INTEGRITY "user.integrity"
+/* verify policy of a file or directory, inherited like has_integrity */
+#define ATTR_INTEGRITY_VERIFY "user.integrity_verify"
+/* hash state saved for the next update of a large file, see resume.c */
+#define ATTR_INTEGRITY_RESUME "user.integrity_resume"
+#define MAXLEN_ALGO_NAME 24
 #define MAXLEN 50
 
 #define ATTR_DEFAULTALGO "md5"
 
+/*
+ * integrity_type families: a plain crypto algo name ("md5") hashes the
+ * whole file, "merkle(<algo>)" keeps a per-block hash tree so that open
+ * only checks the root and every block is checked on its first read,
+ * "tree(<algo>)" hashes large chunks of the file on all CPUs and combines
+ * their digests.
+ */
+#define INTEGRITY_FAMILY_FLAT 0
+#define INTEGRITY_FAMILY_MERKLE 1
+#define INTEGRITY_FAMILY_TREE 2
+#define MERKLE_PREFIX "merkle("
+#define TREE_PREFIX "tree("
+
+/* chunked tree hash geometry: 4MB chunks, growing to keep the count bounded */
+#define WRAPFS_TREE_CHUNK_SHIFT 22
+#define WRAPFS_TREE_MAX_CHUNKS 256
+
+/* block hash tree geometry */
+#define MERKLE_BLOCKSIZE PAGE_SIZE
+#define MERKLE_MAX_LEVELS 8
+
+/* mount options: when release rehashes a written file, what open does meanwhile */
+#define WRAPFS_REHASH_SYNC 0		/* rehash=sync, in the closing process */
+#define WRAPFS_REHASH_DEFERRED 1	/* rehash=deferred, on the rehash workqueue */
+#define WRAPFS_PENDING_WAIT 0		/* pending=wait, open waits for the rehash */
+#define WRAPFS_PENDING_OPEN 1		/* pending=open, open without a check */
+
+/* verify policies, the verify= mount option and ATTR_INTEGRITY_VERIFY */
+#define WRAPFS_VERIFY_MOUNT 0		/* in a record: go with the policy of the mount */
+#define WRAPFS_VERIFY_OPEN 1		/* open checks the file, the default */
+#define WRAPFS_VERIFY_FIRST_READ 2	/* the first read or page fault checks the file */
+#define WRAPFS_VERIFY_BACKGROUND 3	/* open goes ahead, the verify workqueue checks the file */
+#define WRAPFS_VERIFY_PERIODIC 4	/* background, and again once the last check is N seconds old */
+#define WRAPFS_VERIFY_OFF 5		/* the file is not checked */
+#define WRAPFS_VERIFY_MAXLEN 24		/* longest text form, "periodic=<seconds>" */
+
+/* bits of verify_state, the check a file still owes to its readers */
+#define WRAPFS_VSTATE_DUE 0		/* verify=first-read, not checked yet */
+#define WRAPFS_VSTATE_FAILED 1		/* a check after open failed, reads get EPERM */
+
+/* verified digest cache: buckets, and entries unless vcache=<entries> says otherwise */
+#define WRAPFS_VCACHE_BITS 10
+#define WRAPFS_VCACHE_DEFAULT 4096
+
+/* scrubber: scrub= commands, states, defaults of scrub_bps= and scrub_iops= */
+#define WRAPFS_SCRUB_NONE 0
+#define WRAPFS_SCRUB_START 1		/* start, or go on from the saved position */
+#define WRAPFS_SCRUB_STOP 2
+#define WRAPFS_SCRUB_RESTART 3		/* start again from the root */
+#define WRAPFS_SCRUB_IDLE 0		/* never started, stopped or failed */
+#define WRAPFS_SCRUB_RUNNING 1
+#define WRAPFS_SCRUB_DONE 2		/* the last pass went through the whole tree */
+#define WRAPFS_SCRUB_BPS_DEFAULT (8 * 1024 * 1024)
+#define WRAPFS_SCRUB_IOPS_DEFAULT 100
+#define WRAPFS_SCRUB_MAX_DEPTH 16	/* deeper directories are not scrubbed */
+#define WRAPFS_SCRUB_CHECKPOINT 64	/* entries between two saved positions */
+/* state and counters of the scrubber, read-only on the root of the mount */
+#define ATTR_INTEGRITY_SCRUB "user.integrity_scrub"
+
+/* how long each driver of an algo hashes when they are compared, and how many are known */
+#define WRAPFS_BENCH_JIFFIES 16
+#define WRAPFS_BENCH_MAX_DRIVERS 8
+
+/* deferred rehashes of files up to this size go in batches of up to WRAPFS_BATCH_NR */
+#define WRAPFS_BATCH_MAX_SIZE (WRAPFS_HASH_BATCH * PAGE_CACHE_SIZE)
+#define WRAPFS_BATCH_NR 32
+
+/* smaller files are rehashed whole, a saved hash state isn't worth a setxattr */
+#define WRAPFS_RESUME_MIN (1024 * 1024)
+
+/* past this many written ranges per inode they are merged into one */
+#define WRAPFS_MAX_DIRTY_RANGES 32
+
+/* hidden directory in the lower root holding the per-file hash trees */
+#define WRAPFS_SIDECAR_DIR ".wrapfs_integrity"
+/* directory in it holding the markers of the files being written, and their longest name */
+#define WRAPFS_PENDING_DIR "pending"
+#define WRAPFS_PENDING_NAMELEN 208
+
 
 #ifdef EXTRA_CREDIT
 	#undef EXTRA_CREDIT
@@ -102,17 +341,144 @@ extern int calculate_integrity(char *dest, char *src, int len, const char *algo)
 // #define EXTRA_CREDIT
 
 
+/* running hash of a file written from offset 0, see stream.c */
+struct wrapfs_stream {
+	struct mutex mutex;		/* one write hashed at a time */
+	struct wrapfs_hash_pool *pool;
+	char type[MAXLEN_ALGO_NAME + 1];	/* integrity_type it was started for */
+	loff_t pos;			/* bytes hashed so far */
+	char state[0];			/* state_size bytes exported from the request */
+};
+
 /* file private data */
 struct wrapfs_file_info {
 	struct file *lower_file;
 	const struct vm_operations_struct *lower_vm_ops;
+	struct wrapfs_stream *stream;	/* NULL until the file is first streamed */
+};
+
+/* extents of a lower file, as fiemap gave them for [start, end) */
+struct wrapfs_hole_map {
+	struct file *filp;		/* NULL if the map is not filled */
+	loff_t start;
+	loff_t end;
+	unsigned int nr;
+	struct fiemap_extent ext[WRAPFS_HOLE_EXTENTS];
+};
+
+/* pages of a file handed to one crypto update */
+struct wrapfs_hash_batch {
+	struct scatterlist sg[WRAPFS_HASH_BATCH];
+	struct page *pages[WRAPFS_HASH_BATCH];	/* NULL where the zero page stands for a hole */
+	unsigned int nr;
+	unsigned int bytes;
+};
+
+/* an asynchronous hash request with its scratch space, owned by one caller at a time */
+struct wrapfs_hash_ctx {
+	struct list_head list;		/* in the free list of the pool */
+	struct wrapfs_hash_pool *pool;
+	struct crypto_ahash *tfm;
+	struct ahash_request *req;	/* holds the state of the running hash */
+	struct completion done;		/* signalled when an async request finishes */
+	int err;			/* result of the async request */
+	char *buffer;			/* CHUNKSIZE bytes */
+	struct wrapfs_hash_batch batch[2];	/* one being hashed while the other is read */
+	struct wrapfs_hole_map holes;	/* extents of the file being hashed */
+};
+
+/* the contexts of one crypto algo, see hash.c */
+struct wrapfs_hash_pool {
+	struct list_head list;		/* in the hash_pools of the super block */
+	char algo[MAXLEN_ALGO_NAME + 1];
+	char driver[CRYPTO_MAX_ALG_NAME];	/* implementation the crypto API picked */
+	unsigned int digest_size;
+	unsigned int state_size;	/* of an exported request */
+	unsigned int zero_page_ok;	/* zero_page_digest is set */
+	unsigned char zero_page_digest[MAXLEN];	/* of PAGE_SIZE zero bytes */
+	unsigned int empty_ok;		/* empty_digest is set */
+	unsigned char empty_digest[MAXLEN];	/* of no bytes at all */
+	spinlock_t lock;		/* protects free */
+	struct list_head free;
+	wait_queue_head_t wait;		/* for a context to become free */
+	unsigned int nr_ctx;
+	struct wrapfs_hash_ctx ctx[0];
+};
+
+/* in-memory state of a verified block hash tree, see merkle.c */
+struct wrapfs_merkle;
+
+/* a byte range [start, end) written since the integrity_val was last updated */
+struct wrapfs_dirty_range {
+	struct list_head list;
+	loff_t start;
+	loff_t end;
+};
+
+/* the integrity attributes of a file, kept together in ATTR_INTEGRITY */
+struct wrapfs_integrity {
+	unsigned char flag;			/* has_integrity, '0', '1' or 0 if not set */
+	char type[MAXLEN_ALGO_NAME + 1];	/* integrity_type, empty if not set */
+	unsigned int ilen;			/* length of integrity_val, 0 if not set */
+	unsigned char ival[MAXLEN];		/* integrity_val */
+	unsigned int legacy;			/* read from the xattrs of an older wrapfs */
+	unsigned char verify;			/* WRAPFS_VERIFY_*, 0 if not set */
+	unsigned int verify_period;		/* seconds, for WRAPFS_VERIFY_PERIODIC */
+};
+
+/* what a lower inode looked like when its contents were verified */
+struct wrapfs_stamp {
+	loff_t size;
+	struct timespec mtime;
+	struct timespec ctime;
+	u64 version;
+	unsigned int racy;	/* a write right after it may leave it as it is, see wrapfs_get_stamp */
+};
+
+/* where the scrubber is: readdir offset and name hash of an entry per directory level */
+struct wrapfs_scrub_pos {
+	unsigned int depth;		/* levels in use, 0 to start from the root */
+	loff_t pos[WRAPFS_SCRUB_MAX_DEPTH];
+	u32 hash[WRAPFS_SCRUB_MAX_DEPTH];
 };
 
 /* wrapfs inode data in memory */
 struct wrapfs_inode_info {
 	struct inode *lower_inode;
+	struct mutex merkle_mutex;	/* protects merkle, reads of verified blocks look at it under RCU */
+	struct wrapfs_merkle *merkle;
+	spinlock_t dirty_lock;		/* protects the dirty_*, verified*, verify_* and rehash_* fields */
+	struct list_head dirty_ranges;	/* sorted, non overlapping */
+	unsigned int nr_dirty_ranges;
+	unsigned int dirty_all;		/* written where the ranges can't tell */
+	seqcount_t verified_seq;	/* bumped under dirty_lock when verified* change */
+	unsigned int verified;		/* contents matched integrity_val at verified_stamp */
+	struct wrapfs_stamp verified_stamp;
+	unsigned long verified_at;	/* jiffies of the check, for verify=periodic */
+	unsigned long verify_state;	/* WRAPFS_VSTATE_* bits, atomic */
+	struct path verify_path;	/* lower path for the queued background check */
+	unsigned int verify_fresh;	/* the queued check must not use the vcache */
+	struct work_struct verify_work;
+	atomic_t writers;		/* opens for write, the last close rehashes */
+	struct file *stream_file;	/* the file whose writes are hashed, under dirty_lock */
+	struct mutex pending_mutex;	/* serializes creating and removing the marker */
+	unsigned int pending_marker;	/* the marker of the file exists, see pending.c */
+	unsigned int pending_failed;	/* the marker couldn't be created, not tried again until the file is clean */
+	unsigned int rehash_pending;	/* a deferred rehash is queued or running */
+	struct path rehash_path;	/* lower path for the queued rehash */
+	struct work_struct rehash_work;
+	struct list_head batch_list;	/* in batch_list of the super block, under its batch_lock */
+	struct mutex verify_mutex;	/* one integrity check of the file at a time */
+	unsigned long verify_seq;	/* checks started, protected by verify_mutex */
+	int verify_result;		/* result of the last check */
+	unsigned int verify_fresh_last;	/* the last check hashed the file even if the vcache knew it */
+	unsigned int verify_ilen;	/* integrity_val the last check compared against */
+	unsigned char verify_ival[MAXLEN];
+	spinlock_t integrity_lock;	/* protects the integrity* fields */
+	unsigned int integrity_cached;	/* integrity holds the record of the lower file */
+	unsigned long integrity_gen;	/* bumped on every put_integrity_record */
+	struct wrapfs_integrity integrity;
 	struct inode vfs_inode;
-	unsigned int dirty_flag;
 };
 
 /* wrapfs dentry data in memory */
@@ -124,6 +490,45 @@ struct wrapfs_dentry_info {
 /* wrapfs super-block data in memory */
 struct wrapfs_sb_info {
 	struct super_block *lower_sb;
+	const struct cred *kernel_cred;	/* used to access the sidecar store */
+	struct path sidecar;		/* lower WRAPFS_SIDECAR_DIR, set at mount */
+	struct path pending_dir;	/* WRAPFS_PENDING_DIR in it, NULL without markers */
+	struct list_head recover_list;	/* inodes held for the rehashes queued at mount */
+	struct work_struct recover_work;	/* drops them once their rehashes are done */
+	spinlock_t hash_lock;		/* protects hash_pools */
+	struct mutex hash_mutex;	/* serializes creating a pool */
+	struct list_head hash_pools;
+	struct workqueue_struct *hash_wq;	/* spreads a tree hash over the CPUs */
+	unsigned int rehash_mode;	/* WRAPFS_REHASH_* */
+	unsigned int pending_mode;	/* WRAPFS_PENDING_* */
+	struct workqueue_struct *rehash_wq;	/* deferred rehashes, rehash=deferred only */
+	spinlock_t batch_lock;		/* protects batch_list */
+	struct list_head batch_list;	/* inodes of small files waiting for their rehash */
+	struct work_struct batch_work;	/* rehashes them, on rehash_wq */
+	spinlock_t verify_lock;		/* protects verify_mode and verify_period */
+	unsigned char verify_mode;	/* verify=, WRAPFS_VERIFY_* */
+	unsigned int verify_period;
+	struct workqueue_struct *verify_wq;	/* background and periodic checks */
+	spinlock_t vcache_lock;		/* protects vcache_lru, vcache_nr and the table updates */
+	struct hlist_head *vcache_table;	/* RCU, NULL without a vcache */
+	struct list_head vcache_lru;
+	unsigned long vcache_nr;
+	unsigned long vcache_max;	/* vcache=<entries>, 0 turns it off */
+	struct shrinker vcache_shrinker;
+	struct mutex scrub_mutex;	/* serializes starting and stopping scrub_task */
+	struct task_struct *scrub_task;
+	unsigned int scrub_cmd;		/* scrub= of the last mount or remount */
+	unsigned int scrub_bps;		/* scrub_bps=, 0 for no limit */
+	unsigned int scrub_iops;	/* scrub_iops=, 0 for no limit */
+	spinlock_t scrub_lock;		/* protects scrub_state, scrub_pos and the counters */
+	unsigned int scrub_state;	/* WRAPFS_SCRUB_IDLE, RUNNING or DONE */
+	struct wrapfs_scrub_pos scrub_pos;
+	unsigned long scrub_files;	/* checked and matched */
+	unsigned long scrub_failed;	/* checked and didn't match */
+	unsigned long scrub_errors;	/* couldn't be checked */
+	unsigned long scrub_skipped;	/* being written or rehashed */
+	unsigned long scrub_passes;	/* walks through the whole tree */
+	u64 scrub_bytes;
 };
 
 /*
@@ -159,16 +564,10 @@ static inline void wrapfs_set_lower_file(struct file *f, struct file *val)
 	WRAPFS_F(f)->lower_file = val;
 }
 
-/* get the dirty_flag in the inode private data */
+/* check whether the inode was written since its integrity_val was updated */
 static inline unsigned int wrapfs_get_dirty_flag(const struct inode *i)
 {
-	return WRAPFS_I(i)->dirty_flag;
-}
-
-/* set the dirty_flag in the inode private data */
-static inline void wrapfs_set_dirty_flag(struct inode *i, unsigned int val)
-{
-	WRAPFS_I(i)->dirty_flag = val;
+	return WRAPFS_I(i)->dirty_all || !list_empty(&WRAPFS_I(i)->dirty_ranges);
 }
 
 /* inode to lower inode. */
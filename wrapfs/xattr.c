@@ -38,6 +38,68 @@
 // }
 
 
+/* the integrity attributes are fields of ATTR_INTEGRITY, not xattrs of their own */
+static int is_integrity_xattr(const char *name) {
+	return !strcmp(name, ATTR_HAS_INTEGRITY) || !strcmp(name, ATTR_INTEGRITY_VAL) ||
+		!strcmp(name, ATTR_INTEGRITY_TYPE) || !strcmp(name, ATTR_INTEGRITY_VERIFY);
+}
+
+/* the cached tree and the sidecar of a file belong to its old integrity_type, drop what the new one doesn't use */
+static void integrity_type_changed(struct dentry *dentry, struct inode *lower_inode,
+	const struct wrapfs_integrity *rec) {
+	char algo[MAXLEN_ALGO_NAME + 1];
+
+	if(!S_ISREG(lower_inode->i_mode))
+		return;
+	merkle_release(dentry->d_inode);
+	if(parse_integrity_type(integrity_record_type(rec), algo, sizeof(algo)) != INTEGRITY_FAMILY_MERKLE)
+		merkle_remove_tree(dentry->d_sb, lower_inode);
+}
+
+/* Method to read an integrity attribute out of the integrity record
+ * Input: wrapfs dentry, lower_path, attribute name, buffer and its size (0 to query the length)
+ * Output: returns the length of the attribute; else return respective -ERRNO
+ */
+static ssize_t get_integrity_xattr(struct dentry *dentry, struct path lower_path, const char *name,
+	void *value, size_t size) {
+	struct wrapfs_integrity rec;
+	char verify[WRAPFS_VERIFY_MAXLEN + 1];
+	const void *field = NULL;
+	size_t len = 0;
+	long retval;
+
+	retval = get_integrity_record(dentry->d_inode, lower_path, &rec);
+	if(retval<0)
+		return retval;
+
+	if(!strcmp(name, ATTR_HAS_INTEGRITY)) {
+		field = &rec.flag;
+		len = rec.flag ? 1 : 0;
+	}
+	else if(!strcmp(name, ATTR_INTEGRITY_VAL)) {
+		field = rec.ival;
+		len = rec.ilen;
+	}
+	else if(!strcmp(name, ATTR_INTEGRITY_TYPE)) {
+		field = rec.type;
+		len = strlen(rec.type);
+	}
+	else if(!strcmp(name, ATTR_INTEGRITY_VERIFY) && rec.verify) {
+		field = verify;
+		len = wrapfs_format_verify(rec.verify, rec.verify_period, verify);
+	}
+
+	/* ATTR_INTEGRITY itself and ATTR_INTEGRITY_RESUME are not shown */
+	if(!len)
+		return -ENODATA;
+	if(size) {
+		if(size < len)
+			return -ERANGE;
+		memcpy(value, field, len);
+	}
+	return len;
+}
+
 /*
  * BKL held by caller.
  * dentry->d_inode->i_mutex locked
@@ -72,6 +134,12 @@ ssize_t wrapfs_getxattr(struct dentry *dentry, const char *name, void *value, si
 	// 	}
 	// }
 
+	/* the scrubber of the mount tells its state on the root */
+	if(!strcmp(name, ATTR_INTEGRITY_SCRUB) && IS_ROOT(dentry)) {
+		retval = wrapfs_scrub_status(dentry->d_sb, value, size);
+		goto out;
+	}
+
     /* get the lower level path from the given wrapfs dentry */
     wrapfs_get_lower_path(dentry, &lower_path);
     lower_dentry = lower_path.dentry;
@@ -82,7 +150,11 @@ ssize_t wrapfs_getxattr(struct dentry *dentry, const char *name, void *value, si
     // printk("xattr.c: wrapfs_getxattr: calling vfs_getxattr\n");
     printk("xattr.c: wrapfs_getxattr: name=%s, size=%d\n", name, size);
 
-    retval = vfs_getxattr(lower_dentry, (char *) name, (void *) value, size);
+    /* the integrity attributes are virtual, they come from the integrity record */
+    if(is_integrity_xattr(name) || !strcmp(name, ATTR_INTEGRITY) || !strcmp(name, ATTR_INTEGRITY_RESUME))
+    	retval = get_integrity_xattr(dentry, lower_path, name, value, size);
+    else
+    	retval = vfs_getxattr(lower_dentry, (char *) name, (void *) value, size);
 
     /* unlock lower parent dentry object */
     unlock_dir(lower_parent_dentry);
@@ -103,11 +175,12 @@ int wrapfs_setxattr(struct dentry *dentry, const char *name, const void *value,
     struct path lower_path;
 	int retval = -EOPNOTSUPP;
 	int integrity_val = -1;
-	int temp_retval;
-#ifdef EXTRA_CREDIT
-	char *integrity_type;
-	unsigned char ibuf;
-#endif
+	int present;
+	struct wrapfs_integrity rec;
+	char verify[WRAPFS_VERIFY_MAXLEN + 1];
+	unsigned char verify_mode = 0;
+	unsigned int verify_period = 0;
+	char integrity_type[MAXLEN_ALGO_NAME + 1];
 
 	if(name == NULL || value == NULL) {
 		printk("wrapfs_setxattr: name/value cannot be NULL\n");
@@ -115,8 +188,9 @@ int wrapfs_setxattr(struct dentry *dentry, const char *name, const void *value,
 		goto out;
 	}
 
-	if(!strcmp(name, ATTR_INTEGRITY_VAL)) {
-		printk("wrapfs_setxattr: cannot set %s\n", ATTR_INTEGRITY_VAL);
+	if(!strcmp(name, ATTR_INTEGRITY_VAL) || !strcmp(name, ATTR_INTEGRITY) ||
+		!strcmp(name, ATTR_INTEGRITY_RESUME) || !strcmp(name, ATTR_INTEGRITY_SCRUB)) {
+		printk("wrapfs_setxattr: cannot set %s\n", name);
 		retval = -EOPNOTSUPP;
 		goto out;
 	}
@@ -143,7 +217,29 @@ int wrapfs_setxattr(struct dentry *dentry, const char *name, const void *value,
 		
 	}
 
-#ifdef EXTRA_CREDIT
+	if(!strcmp(name, ATTR_INTEGRITY_VERIFY)) {
+		if(!(current_uid() == 0)) {
+			printk("wrapfs_setxattr: only root can set the specified xattr\n");
+			retval = -EOPNOTSUPP;
+			goto out;
+		}
+
+		if(!(size > 0 && size <= WRAPFS_VERIFY_MAXLEN)) {
+			printk("wrapfs_setxattr: size provided is not valid\n");
+			retval = -EINVAL;
+			goto out;
+		}
+
+		/* value is not NUL terminated, work on a copy */
+		memcpy(verify, value, size);
+		verify[size] = '\0';
+		if(wrapfs_parse_verify(verify, &verify_mode, &verify_period)) {
+			printk("wrapfs_setxattr: verify policy [%s] is not valid\n", verify);
+			retval = -EINVAL;
+			goto out;
+		}
+	}
+
 	if(!strcmp(name, ATTR_INTEGRITY_TYPE)) {
 		if(!(current_uid() == 0)) {
 			printk("wrapfs_setxattr: only root can set the specified xattr\n");
@@ -157,17 +253,15 @@ int wrapfs_setxattr(struct dentry *dentry, const char *name, const void *value,
 			goto out;
 		}
 
-		integrity_type = (char*)value;
+		/* value is not NUL terminated, work on a copy */
+		memcpy(integrity_type, value, size);
 		integrity_type[size] = '\0';
 
-		retval = crypto_has_alg(integrity_type, 1, 1);
-		if(!retval) {
-			printk("wrapfs_setxattr: crypto algo [%s] not supported \n", integrity_type);
-			retval = -EINVAL;
+		/* a type this build doesn't hash with is refused, not stored and ignored */
+		retval = check_integrity_type(integrity_type);
+		if(retval<0)
 			goto out;
-		}
 	}
-#endif
 
 
 	/* get the lower level path from the given wrapfs dentry */
@@ -195,46 +289,83 @@ int wrapfs_setxattr(struct dentry *dentry, const char *name, const void *value,
     // ??? remove the (char *) value in the below line the '/0' is not sure to be set!
     // printk("xattr.c: wrapfs_setxattr: name=%s, value=%c, size=%d\n", (char *) name, *((char *) value), size);
 
-	retval = vfs_setxattr(lower_dentry, (char *) name, (void *) value, size, flags);
-	if(retval<0) {
-		printk("wrapfs_setxattr: %s cannot be set!!\n", name);
+	/* other xattrs go to the lower file as they are */
+	if(!is_integrity_xattr(name)) {
+		retval = vfs_setxattr(lower_dentry, (char *) name, (void *) value, size, flags);
+		if(retval<0)
+			printk("wrapfs_setxattr: %s cannot be set!!\n", name);
 		goto unlock_out;
 	}
 
-	/* if inode is a directory then skip the step of computing/removing integrity_val */
-	if(S_ISDIR(lower_dentry->d_inode->i_mode))
+	retval = get_integrity_record(dentry->d_inode, lower_path, &rec);
+	if(retval<0)
 		goto unlock_out;
 
-	// printk("xattr.c: wrapfs_setxattr: not directory!!\n");
+	/* XATTR_CREATE and XATTR_REPLACE apply to the attribute, not to the record */
+	if(integrity_val != -1)
+		present = rec.flag != 0;
+	else if(verify_mode)
+		present = rec.verify != 0;
+	else
+		present = rec.type[0] != '\0';
+	if((flags & XATTR_CREATE) && present) {
+		retval = -EEXIST;
+		goto unlock_out;
+	}
+	if((flags & XATTR_REPLACE) && !present) {
+		retval = -ENODATA;
+		goto unlock_out;
+	}
 
-#ifdef EXTRA_CREDIT
-	/* when integrity_type is set, we need to recompute the integrity_val*/
-	if(integrity_val == -1)
-	{
-		vfs_getxattr(lower_dentry, ATTR_HAS_INTEGRITY, &ibuf, 1);
-		if(ibuf == '1')
-			integrity_val = 1;
+	if(integrity_val != -1)
+		rec.flag = *((char*)(value));
+	else if(verify_mode) {
+		/* the contents and integrity_val stay as they are, only when they are checked changes */
+		rec.verify = verify_mode;
+		rec.verify_period = verify_period;
+		goto put_record;
+	}
+	else {
+		strcpy(rec.type, integrity_type);
+		integrity_type_changed(dentry, lower_dentry->d_inode, &rec);
 	}
-#endif
 
-	if(integrity_val == 1) {
-		retval = set_integrity_val(lower_path);
+	/* the integrity attributes have changed, check the file again on next open */
+	wrapfs_clear_verified(dentry->d_inode);
+
+	/* if inode is a directory then skip the step of computing/removing integrity_val */
+	if(S_ISDIR(lower_dentry->d_inode->i_mode))
+		goto put_record;
+
+	// printk("xattr.c: wrapfs_setxattr: not directory!!\n");
+
+	/* when has_integrity or integrity_type is set, we need to recompute the integrity_val,
+	 * it goes to the lower file in the same setxattr as the attribute; the lower parent is
+	 * unlocked while the file is hashed */
+	if(rec.flag == '1') {
+		retval = compute_integrity_unlocked(dentry->d_inode, lower_path, &rec, &lower_parent_dentry);
 		if(retval<0) {
 			retval = -EPERM;
 			printk("xattr.c: wrapfs_setxattr: %s cannot be set!!\n", ATTR_INTEGRITY_VAL);
+			goto unlock_out;
 		}
 	}
 	else if(integrity_val == 0) {
-		/* also remove the ATTR_INTEGRITY_VAL attribute 
-		error should not be thrown if the integrity_val doesn't exist */
-		temp_retval = vfs_removexattr(lower_dentry, ATTR_INTEGRITY_VAL);
-		if(temp_retval == -ENODATA) {
-			printk("%s already removed!!\n", ATTR_INTEGRITY_VAL);
+		/* the hash tree of the file is not needed anymore */
+		if(S_ISREG(lower_dentry->d_inode->i_mode)) {
+			merkle_release(dentry->d_inode);
+			merkle_remove_tree(dentry->d_sb, lower_dentry->d_inode);
 		}
-		else
-			retval = temp_retval;
+
+		/* also remove the integrity_val */
+		rec.ilen = 0;
 	}
 
+put_record:
+	retval = put_integrity_record(dentry->d_inode, lower_path, &rec);
+	if(retval<0)
+		printk("wrapfs_setxattr: %s cannot be set!!\n", name);
+
 unlock_out:
 	/* unlock lower parent dentry object */
     unlock_dir(lower_parent_dentry);
@@ -262,10 +393,9 @@ int wrapfs_removexattr(struct dentry *dentry, const char *name)
     struct path lower_path;
 	int retval = -EOPNOTSUPP;
 	int remove_integrity_val = 0;
-	int temp_retval;
-#ifdef EXTRA_CREDIT
+	int remove_verify = 0;
+	struct wrapfs_integrity rec;
 	int update_integrity_val = 0;
-#endif
 
 	if(name == NULL) {
 		printk("wrapfs_removexattr: name cannot be NULL\n");
@@ -273,8 +403,9 @@ int wrapfs_removexattr(struct dentry *dentry, const char *name)
 		goto out;
 	}
 
-	if(!strcmp(name, ATTR_INTEGRITY_VAL)) {
-		printk("wrapfs_removexattr: cannot remove %s\n", ATTR_INTEGRITY_VAL);
+	if(!strcmp(name, ATTR_INTEGRITY_VAL) || !strcmp(name, ATTR_INTEGRITY) ||
+		!strcmp(name, ATTR_INTEGRITY_RESUME) || !strcmp(name, ATTR_INTEGRITY_SCRUB)) {
+		printk("wrapfs_removexattr: cannot remove %s\n", name);
 		retval = -EOPNOTSUPP;
 		goto out;
 	}
@@ -289,7 +420,16 @@ int wrapfs_removexattr(struct dentry *dentry, const char *name)
 		remove_integrity_val = 1;
 	}
 
-#ifdef EXTRA_CREDIT
+	if(!strcmp(name, ATTR_INTEGRITY_VERIFY)) {
+		if(!(current_uid() == 0)) {
+			printk("wrapfs_removexattr: only root can remove the specified xattr\n");
+			retval = -EOPNOTSUPP;
+			goto out;
+		}
+
+		remove_verify = 1;
+	}
+
 	if(!strcmp(name, ATTR_INTEGRITY_TYPE)) {
 		if(!(current_uid() == 0)) {		
 			printk("wrapfs_removexattr: only root can remove the specified xattr\n");
@@ -299,7 +439,6 @@ int wrapfs_removexattr(struct dentry *dentry, const char *name)
 
 		update_integrity_val = 1;
 	}
-#endif
 
 	/* get the lower level path from the given wrapfs dentry */
     wrapfs_get_lower_path(dentry, &lower_path);
@@ -312,47 +451,65 @@ int wrapfs_removexattr(struct dentry *dentry, const char *name)
     // ??? remove the (char *) value in the below line the '/0' is not sure to be set!
     // printk("xattr.c: wrapfs_removexattr: name=%s\n", (char *) name);
 
-	retval = vfs_removexattr(lower_dentry, (char *) name);
-	if(retval<0) {
-		if(retval == -ENODATA)
-			printk("wrapfs_removexattr: %s already removed!!\n", name);
-		else
-			printk("wrapfs_removexattr: %s is not removed!!\n", name);
+	/* other xattrs go to the lower file as they are */
+	if(!is_integrity_xattr(name)) {
+		retval = vfs_removexattr(lower_dentry, (char *) name);
+		if(retval<0) {
+			if(retval == -ENODATA)
+				printk("wrapfs_removexattr: %s already removed!!\n", name);
+			else
+				printk("wrapfs_removexattr: %s is not removed!!\n", name);
+		}
+		goto unlock_out;
+	}
+
+	retval = get_integrity_record(dentry->d_inode, lower_path, &rec);
+	if(retval<0)
+		goto unlock_out;
+	if(remove_integrity_val ? !rec.flag : remove_verify ? !rec.verify : !rec.type[0]) {
+		printk("wrapfs_removexattr: %s already removed!!\n", name);
+		retval = -ENODATA;
 		goto unlock_out;
 	}
 
+	/* the file goes back to the verify policy of the mount */
+	if(remove_verify) {
+		rec.verify = 0;
+		rec.verify_period = 0;
+		goto put_record;
+	}
+	wrapfs_clear_verified(dentry->d_inode);
+
 	if(remove_integrity_val) {
-		/* also remove the ATTR_INTEGRITY_VAL attribute 
-		error should not be thrown if the integrity_val doesn't exist */
-		temp_retval = vfs_removexattr(lower_dentry, ATTR_INTEGRITY_VAL);
-		if(temp_retval == -ENODATA) {
-			printk("%s already removed!!\n", ATTR_INTEGRITY_VAL);
-		}
-		else {
-			retval = temp_retval;
-			goto unlock_out;
+		/* the hash tree of the file is not needed anymore */
+		if(S_ISREG(lower_dentry->d_inode->i_mode)) {
+			merkle_release(dentry->d_inode);
+			merkle_remove_tree(dentry->d_sb, lower_dentry->d_inode);
 		}
 
-#ifdef EXTRA_CREDIT
-		temp_retval = vfs_removexattr(lower_dentry, ATTR_INTEGRITY_TYPE);
-		if(temp_retval == -ENODATA) {
-			printk("%s already removed!!\n", ATTR_INTEGRITY_TYPE);
-		}
-		else {
-			retval = temp_retval;
-			goto unlock_out;
-		}
-#endif
+		/* also remove the integrity_val (and integrity_type) with has_integrity */
+		rec.flag = 0;
+		rec.ilen = 0;
+		rec.type[0] = '\0';
+	}
+	else {
+		rec.type[0] = '\0';
+		integrity_type_changed(dentry, lower_dentry->d_inode, &rec);
 	}
 
-#ifdef EXTRA_CREDIT
-	if(update_integrity_val == 1) {
-		retval = set_integrity_val(lower_path);
+	/* recompute the integrity_val with the default algo, without the lower parent locked */
+	if(update_integrity_val == 1 && rec.flag == '1' && !S_ISDIR(lower_dentry->d_inode->i_mode)) {
+		retval = compute_integrity_unlocked(dentry->d_inode, lower_path, &rec, &lower_parent_dentry);
 		if(retval<0) {
 			printk("xattr.c: wrapfs_removexattr: %s cannot be set!!\n", ATTR_INTEGRITY_VAL);
+			goto unlock_out;
 		}
 	}
-#endif
+
+put_record:
+	retval = put_integrity_record(dentry->d_inode, lower_path, &rec);
+	if(retval<0)
+		printk("wrapfs_removexattr: %s is not removed!!\n", name);
 
 unlock_out:
 	/* unlock lower parent dentry object */
@@ -362,6 +519,20 @@ out:
     return retval;
 }
 
+/* append a name to a listxattr buffer, only the length is counted when size is 0 */
+static ssize_t list_xattr_name(char *list, size_t size, ssize_t used, const char *name) {
+	size_t len = strlen(name) + 1;
+
+	if(used<0)
+		return used;
+	if(size) {
+		if(used + len > size)
+			return -ERANGE;
+		memcpy(list + used, name, len);
+	}
+	return used + len;
+}
+
 /*
  * BKL held by caller.
  * dentry->d_inode->i_mutex locked
@@ -371,8 +542,11 @@ ssize_t wrapfs_listxattr(struct dentry *dentry, char *list, size_t size)
 	struct dentry *lower_dentry = NULL;
 	struct dentry *lower_parent_dentry = NULL;
     struct path lower_path;
-	int retval = -EOPNOTSUPP;
-	char *encoded_list = NULL;
+	ssize_t retval = -EOPNOTSUPP;
+	ssize_t lower_size;
+	char *lower_list = NULL;
+	char *name;
+	struct wrapfs_integrity rec;
 	
 	/* get the lower level path from the given wrapfs dentry */
     wrapfs_get_lower_path(dentry, &lower_path);
@@ -384,14 +558,46 @@ ssize_t wrapfs_listxattr(struct dentry *dentry, char *list, size_t size)
     // printk("xattr.c: wrapfs_listxattr: calling vfs_listxattr\n");
     // printk("xattr.c: wrapfs_listxattr: size=%d\n", size);
 
-	encoded_list = list;
-	retval = vfs_listxattr(lower_dentry, encoded_list, size);
+	/* the lower list has ATTR_INTEGRITY in place of the integrity attributes */
+	lower_size = vfs_listxattr(lower_dentry, NULL, 0);
+	if(lower_size<0) {
+		retval = lower_size;
+		goto unlock_out;
+	}
+	lower_list = kmalloc(lower_size + 1, GFP_KERNEL);
+	if(!lower_list) {
+		retval = -ENOMEM;
+		goto unlock_out;
+	}
+	lower_size = vfs_listxattr(lower_dentry, lower_list, lower_size);
+	if(lower_size<0) {
+		retval = lower_size;
+		goto unlock_out;
+	}
+
+	retval = get_integrity_record(dentry->d_inode, lower_path, &rec);
+	if(retval<0)
+		goto unlock_out;
+
+	for(name = lower_list; name < lower_list + lower_size; name += strlen(name) + 1) {
+		if(!strcmp(name, ATTR_INTEGRITY) || !strcmp(name, ATTR_INTEGRITY_RESUME) ||
+			is_integrity_xattr(name))
+			continue;
+		retval = list_xattr_name(list, size, retval, name);
+	}
+	if(rec.flag)
+		retval = list_xattr_name(list, size, retval, ATTR_HAS_INTEGRITY);
+	if(rec.ilen)
+		retval = list_xattr_name(list, size, retval, ATTR_INTEGRITY_VAL);
+	if(rec.type[0])
+		retval = list_xattr_name(list, size, retval, ATTR_INTEGRITY_TYPE);
+	if(rec.verify)
+		retval = list_xattr_name(list, size, retval, ATTR_INTEGRITY_VERIFY);
 
+unlock_out:
+	kfree(lower_list);
 	/* unlock lower parent dentry object */
     unlock_dir(lower_parent_dentry);
     wrapfs_put_lower_path(dentry, &lower_path);
     return retval;
 }
-
-
-
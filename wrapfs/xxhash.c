@@ -0,0 +1,192 @@
+/*
+ * This file contains the xxhash64 integrity_type.
+ *
+ * Some trees only need to find bit rot and torn writes, not tampering, and
+ * for them a crypto hash is several times more CPU than the job takes. The
+ * crypto API of this kernel already has crc32c (with the crc32 instruction
+ * where the CPU has it, see bench.c for the choice of the driver), but not
+ * xxhash64, so it is registered here as a synchronous hash at module load.
+ * Both then go through compute_integrity and check_integrity like any other
+ * algo, e.g. setfattr -n user.integrity_type -v xxhash64, and combine with
+ * the merkle(...) and tree(...) families.
+ *
+ * The digest is XXH64 with seed 0 of the contents, in the canonical (big
+ * endian) byte order, so it is the value xxhsum prints for the file. The
+ * hash keeps 32 bytes of input between updates, the state a resume (see
+ * resume.c) exports is the whole descriptor.
+ */
+
+#include "wrapfs.h"
+#include <asm/unaligned.h>
+
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+#define XXHASH64_DIGEST_SIZE 8
+#define XXHASH64_STRIPE 32
+
+struct xxhash64_state {
+	u64 total_len;
+	u64 v1, v2, v3, v4;
+	u8 mem[XXHASH64_STRIPE];	/* input that doesn't make a whole stripe yet */
+	unsigned int memsize;
+};
+
+static int xxhash64_registered;
+
+static inline u64 xxh_rotl64(u64 x, unsigned int r) {
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline u64 xxh64_round(u64 acc, u64 input) {
+	acc += input * XXH_PRIME64_2;
+	acc = xxh_rotl64(acc, 31);
+	return acc * XXH_PRIME64_1;
+}
+
+static inline u64 xxh64_merge_round(u64 acc, u64 val) {
+	acc ^= xxh64_round(0, val);
+	return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+/* fold one stripe of 32 bytes into the four lanes */
+static void xxh64_stripe(struct xxhash64_state *state, const u8 *p) {
+	state->v1 = xxh64_round(state->v1, get_unaligned_le64(p));
+	state->v2 = xxh64_round(state->v2, get_unaligned_le64(p + 8));
+	state->v3 = xxh64_round(state->v3, get_unaligned_le64(p + 16));
+	state->v4 = xxh64_round(state->v4, get_unaligned_le64(p + 24));
+}
+
+static int xxhash64_init(struct shash_desc *desc) {
+	struct xxhash64_state *state = shash_desc_ctx(desc);
+
+	memset(state, 0, sizeof(*state));
+	state->v1 = XXH_PRIME64_1 + XXH_PRIME64_2;
+	state->v2 = XXH_PRIME64_2;
+	state->v3 = 0;
+	state->v4 = -XXH_PRIME64_1;
+	return 0;
+}
+
+/* Method to feed bytes to a running xxhash64
+ * Following are the steps:
+ * 1. fill up the stripe kept from the last update and fold it
+ * 2. fold the whole stripes of the input in place
+ * 3. keep the rest for the next update
+ */
+static int xxhash64_update(struct shash_desc *desc, const u8 *data, unsigned int len) {
+	struct xxhash64_state *state = shash_desc_ctx(desc);
+	const u8 *end = data + len;
+	unsigned int fill;
+
+	state->total_len += len;
+
+	if(state->memsize + len < XXHASH64_STRIPE) {
+		memcpy(state->mem + state->memsize, data, len);
+		state->memsize += len;
+		return 0;
+	}
+
+	if(state->memsize) {
+		fill = XXHASH64_STRIPE - state->memsize;
+		memcpy(state->mem + state->memsize, data, fill);
+		xxh64_stripe(state, state->mem);
+		data += fill;
+		state->memsize = 0;
+	}
+
+	while(data + XXHASH64_STRIPE <= end) {
+		xxh64_stripe(state, data);
+		data += XXHASH64_STRIPE;
+	}
+
+	if(data < end) {
+		memcpy(state->mem, data, end - data);
+		state->memsize = end - data;
+	}
+	return 0;
+}
+
+/* Method to finish a running xxhash64: merge the lanes, fold the kept bytes and mix */
+static int xxhash64_final(struct shash_desc *desc, u8 *out) {
+	struct xxhash64_state *state = shash_desc_ctx(desc);
+	const u8 *p = state->mem;
+	const u8 *end = p + state->memsize;
+	u64 h;
+
+	if(state->total_len >= XXHASH64_STRIPE) {
+		h = xxh_rotl64(state->v1, 1) + xxh_rotl64(state->v2, 7) +
+			xxh_rotl64(state->v3, 12) + xxh_rotl64(state->v4, 18);
+		h = xxh64_merge_round(h, state->v1);
+		h = xxh64_merge_round(h, state->v2);
+		h = xxh64_merge_round(h, state->v3);
+		h = xxh64_merge_round(h, state->v4);
+	}
+	else
+		h = state->v3 + XXH_PRIME64_5;
+	h += state->total_len;
+
+	while(p + 8 <= end) {
+		h ^= xxh64_round(0, get_unaligned_le64(p));
+		h = xxh_rotl64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+		p += 8;
+	}
+	if(p + 4 <= end) {
+		h ^= (u64)get_unaligned_le32(p) * XXH_PRIME64_1;
+		h = xxh_rotl64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+		p += 4;
+	}
+	while(p < end) {
+		h ^= (*p) * XXH_PRIME64_5;
+		h = xxh_rotl64(h, 11) * XXH_PRIME64_1;
+		p++;
+	}
+
+	h ^= h >> 33;
+	h *= XXH_PRIME64_2;
+	h ^= h >> 29;
+	h *= XXH_PRIME64_3;
+	h ^= h >> 32;
+
+	put_unaligned_be64(h, out);
+	return 0;
+}
+
+static struct shash_alg xxhash64_alg = {
+	.digestsize	= XXHASH64_DIGEST_SIZE,
+	.init		= xxhash64_init,
+	.update		= xxhash64_update,
+	.final		= xxhash64_final,
+	.descsize	= sizeof(struct xxhash64_state),
+	.base		= {
+		.cra_name		= "xxhash64",
+		.cra_driver_name	= "xxhash64-wrapfs",
+		.cra_priority		= 100,
+		.cra_blocksize		= 1,
+		.cra_module		= THIS_MODULE,
+	}
+};
+
+/* Method to register xxhash64 with the crypto API, called at module load
+ * Output: none, without it setting integrity_type to xxhash64 fails as for an unknown algo
+ */
+void wrapfs_init_xxhash(void) {
+	int retval;
+
+	retval = crypto_register_shash(&xxhash64_alg);
+	if(retval) {
+		printk("wrapfs_init_xxhash: cannot register xxhash64, err=%d\n", retval);
+		return;
+	}
+	xxhash64_registered = 1;
+}
+
+/* Method to unregister xxhash64, called at module unload */
+void wrapfs_exit_xxhash(void) {
+	if(xxhash64_registered)
+		crypto_unregister_shash(&xxhash64_alg);
+	xxhash64_registered = 0;
+}